@@ -0,0 +1,3 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+// Userspace stand-in, see zed_pl_kcompat.h
+#include "../zed_pl_kcompat.h"
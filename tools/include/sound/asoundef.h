@@ -0,0 +1,23 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+// Userspace stand-in: MIDI controller numbers
+#ifndef ZED_PL_KCOMPAT_ASOUNDEF_H
+#define ZED_PL_KCOMPAT_ASOUNDEF_H
+
+#define MIDI_CTL_MSB_BANK             0x00
+#define MIDI_CTL_MSB_MODWHEEL         0x01
+#define MIDI_CTL_MSB_DATA_ENTRY       0x06
+#define MIDI_CTL_MSB_MAIN_VOLUME      0x07
+#define MIDI_CTL_MSB_PAN              0x0a
+#define MIDI_CTL_MSB_EXPRESSION       0x0b
+#define MIDI_CTL_LSB_BANK             0x20
+#define MIDI_CTL_LSB_DATA_ENTRY       0x26
+#define MIDI_CTL_SUSTAIN              0x40
+#define MIDI_CTL_NONREG_PARM_NUM_LSB  0x62
+#define MIDI_CTL_NONREG_PARM_NUM_MSB  0x63
+#define MIDI_CTL_REGIST_PARM_NUM_LSB  0x64
+#define MIDI_CTL_REGIST_PARM_NUM_MSB  0x65
+#define MIDI_CTL_ALL_SOUNDS_OFF       0x78
+#define MIDI_CTL_RESET_CONTROLLERS    0x79
+#define MIDI_CTL_ALL_NOTES_OFF        0x7b
+
+#endif
@@ -0,0 +1,8 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+// Userspace stand-in, see zed_pl_kcompat.h
+#include "../zed_pl_kcompat.h"
+
+// Pseudo controls passed to the control callback
+#define MIDI_CTL_PITCHBEND     0x80
+#define MIDI_CTL_AFTERTOUCH    0x81
+#define MIDI_CTL_CHAN_PRESSURE 0x82
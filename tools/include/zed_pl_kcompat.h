@@ -0,0 +1,573 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Zedboard PL synthesizer userspace tools
+ *
+ * @author Yuhei Horibe
+ * Userspace stand-ins for the kernel APIs used by zed_pl_midi.c and zed_pl_smf.c,
+ * so that the driver's MIDI handlers and SMF parser build into the benchmark.
+ * Locks, atomics and atomic bit operations are real, so that parts can be
+ * played from several threads. Work items and timers are run by the
+ * benchmark loop (zed_pl_kcompat_run()) on one thread.
+ * Register accesses go to the simulated window of the benchmark.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under  the terms of the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the License, or (at your
+ * option) any later version.
+ */
+
+#ifndef ZED_PL_KCOMPAT_H
+#define ZED_PL_KCOMPAT_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Types
+typedef uint8_t  u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef unsigned long long u64;
+typedef int8_t   s8;
+typedef int16_t  s16;
+typedef int32_t  s32;
+typedef long long s64;
+typedef unsigned int gfp_t;
+typedef s64 ktime_t;
+
+#define __iomem
+#define __user
+#define ____cacheline_aligned_in_smp
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#define READ_ONCE(x)     (*(volatile typeof(x) *)&(x))
+#define WRITE_ONCE(x, v) (*(volatile typeof(x) *)&(x) = (v))
+#define IS_ENABLED(option) 0
+
+#define ARRAY_SIZE(a)        (sizeof(a) / sizeof((a)[0]))
+#define DIV_ROUND_UP(n, d)   (((n) + (d) - 1) / (d))
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+#define min(a, b)            ((a) < (b) ? (a) : (b))
+#define max(a, b)            ((a) > (b) ? (a) : (b))
+#define min_t(t, a, b)       min((t)(a), (t)(b))
+#define max_t(t, a, b)       max((t)(a), (t)(b))
+#define clamp(v, lo, hi)     min(max(v, lo), hi)
+#define clamp_t(t, v, lo, hi) clamp((t)(v), (t)(lo), (t)(hi))
+#define clamp_val(v, lo, hi) clamp(v, (typeof(v))(lo), (typeof(v))(hi))
+#define abs(x)               ({ typeof(x) __x = (x); __x < 0 ? -__x : __x; })
+#define BUILD_BUG_ON(c)      ((void)sizeof(char[1 - 2 * !!(c)]))
+#define fallthrough          __attribute__((__fallthrough__))
+
+#define PAGE_SIZE      4096
+#define GFP_KERNEL     0
+#define GFP_ATOMIC     1
+#define NSEC_PER_USEC  1000L
+#define NSEC_PER_MSEC  1000000L
+#define NSEC_PER_SEC   1000000000L
+#define USEC_PER_MSEC  1000L
+#define USEC_PER_SEC   1000000L
+#define U32_MAX        UINT32_MAX
+
+// Module
+struct module;
+#define THIS_MODULE ((struct module *)0)
+#define MODULE_PARM_DESC(name, desc)
+#define MODULE_LICENSE(l)
+#define MODULE_AUTHOR(a)
+#define MODULE_DESCRIPTION(d)
+#define EXPORT_SYMBOL(s)
+#define EXPORT_SYMBOL_GPL(s)
+
+// Module parameters can be set by name (uint parameters only)
+void zed_pl_kcompat_add_param(const char *name, unsigned int *val);
+int  zed_pl_kcompat_set_param(const char *name, unsigned int val);
+#define module_param(name, type, perm) \
+    static void __attribute__((constructor)) __zed_pl_param_##name(void) \
+    { zed_pl_kcompat_add_param(#name, &name); }
+
+// Printing
+struct device {
+    const char *name;
+};
+#define printk(fmt, ...)                 do { } while (0)
+#define dev_err(dev, fmt, ...)           fprintf(stderr, fmt, ##__VA_ARGS__)
+#define dev_warn(dev, fmt, ...)          fprintf(stderr, fmt, ##__VA_ARGS__)
+#define dev_info(dev, fmt, ...)          do { } while (0)
+#define dev_dbg(dev, fmt, ...)           do { } while (0)
+#define scnprintf(buf, size, fmt, ...)   snprintf(buf, size, fmt, ##__VA_ARGS__)
+
+// Memory (device managed memory lives until exit)
+#define devm_kcalloc(dev, n, size, gfp) calloc(n, size)
+#define devm_kzalloc(dev, size, gfp)    calloc(1, size)
+#define kzalloc(size, gfp)              calloc(1, size)
+#define kmalloc(size, gfp)              malloc(size)
+#define kfree(p)                        free((void *)(p))
+#define kvmalloc_array(n, size, gfp)    calloc(n, size)
+#define kvfree(p)                       free((void *)(p))
+
+// Sorting (the callers' compare functions give a total order, so qsort's stability doesn't matter)
+#define sort(base, num, size, cmp, swap) qsort(base, num, size, cmp)
+
+// Barriers and locks
+#define barrier()               __asm__ __volatile__("" ::: "memory")
+#define smp_mb()                __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define smp_rmb()               __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_wmb()               __atomic_thread_fence(__ATOMIC_RELEASE)
+#define smp_mb__before_atomic() barrier()
+#define smp_mb__after_atomic()  barrier()
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax()             __builtin_ia32_pause()
+#else
+#define cpu_relax()             barrier()
+#endif
+
+typedef struct { int locked; } spinlock_t;
+struct mutex { spinlock_t lock; };
+
+static inline void spin_lock(spinlock_t *l)
+{
+    while (__atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE)) {
+        while (READ_ONCE(l->locked)) {
+            cpu_relax();
+        }
+    }
+}
+
+static inline int spin_trylock(spinlock_t *l)
+{
+    return !__atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE);
+}
+
+static inline void spin_unlock(spinlock_t *l)
+{
+    __atomic_store_n(&l->locked, 0, __ATOMIC_RELEASE);
+}
+
+#define DEFINE_SPINLOCK(x)                   spinlock_t x = { 0 }
+#define spin_lock_init(l)                    ((l)->locked = 0)
+#define spin_lock_irqsave(l, f)              ((f) = 0, spin_lock(l))
+#define spin_unlock_irqrestore(l, f)         ((void)(f), spin_unlock(l))
+#define spin_trylock_irqsave(l, f)           ((f) = 0, spin_trylock(l))
+#define mutex_init(m)                        spin_lock_init(&(m)->lock)
+#define mutex_lock(m)                        spin_lock(&(m)->lock)
+#define mutex_unlock(m)                      spin_unlock(&(m)->lock)
+#define might_sleep()                        do { } while (0)
+
+// RCU (the benchmark never updates a table while parts are played)
+struct rcu_head { void *next; };
+#define __rcu
+#define rcu_read_lock()                      barrier()
+#define rcu_read_unlock()                    barrier()
+#define rcu_dereference(p)                   (p)
+#define rcu_dereference_protected(p, c)      (p)
+#define rcu_assign_pointer(p, v)             ((p) = (v))
+#define RCU_INIT_POINTER(p, v)               ((p) = (v))
+#define kfree_rcu(p, head)                   kfree(p)
+#define lockdep_is_held(l)                   1
+
+// Atomics
+typedef struct { int counter; } atomic_t;
+typedef struct { s64 counter; } atomic64_t;
+#define atomic_read(a)           __atomic_load_n(&(a)->counter, __ATOMIC_RELAXED)
+#define atomic_set(a, v)         __atomic_store_n(&(a)->counter, (v), __ATOMIC_RELAXED)
+#define atomic_add(i, a)         ((void)__atomic_add_fetch(&(a)->counter, (i), __ATOMIC_RELAXED))
+#define atomic_sub(i, a)         ((void)__atomic_sub_fetch(&(a)->counter, (i), __ATOMIC_RELAXED))
+#define atomic_inc(a)            atomic_add(1, a)
+#define atomic_dec(a)            atomic_sub(1, a)
+#define atomic_inc_return(a)     __atomic_add_fetch(&(a)->counter, 1, __ATOMIC_SEQ_CST)
+#define atomic_dec_return(a)     __atomic_sub_fetch(&(a)->counter, 1, __ATOMIC_SEQ_CST)
+#define atomic_cmpxchg(a, o, n)  __sync_val_compare_and_swap(&(a)->counter, o, n)
+#define atomic64_read(a)         __atomic_load_n(&(a)->counter, __ATOMIC_RELAXED)
+#define atomic64_set(a, v)       __atomic_store_n(&(a)->counter, (v), __ATOMIC_RELAXED)
+#define atomic64_inc(a)          ((void)__atomic_add_fetch(&(a)->counter, 1, __ATOMIC_RELAXED))
+#define atomic64_add(i, a)       ((void)__atomic_add_fetch(&(a)->counter, (i), __ATOMIC_RELAXED))
+
+// Bit operations and bitmaps
+#define BITS_PER_LONG         (8 * (int)sizeof(long))
+#define BIT(n)                (1UL << (n))
+#define BIT_MASK(n)           (1UL << ((n) % BITS_PER_LONG))
+#define BIT_WORD(n)           ((n) / BITS_PER_LONG)
+#define BITS_TO_LONGS(n)      DIV_ROUND_UP(n, BITS_PER_LONG)
+#define DECLARE_BITMAP(name, bits) unsigned long name[BITS_TO_LONGS(bits)]
+
+static inline void __set_bit(int nr, volatile unsigned long *addr)
+{
+    addr[BIT_WORD(nr)] |= BIT_MASK(nr);
+}
+
+static inline void __clear_bit(int nr, volatile unsigned long *addr)
+{
+    addr[BIT_WORD(nr)] &= ~BIT_MASK(nr);
+}
+
+static inline int test_bit(int nr, const volatile unsigned long *addr)
+{
+    return (addr[BIT_WORD(nr)] >> (nr % BITS_PER_LONG)) & 1;
+}
+
+// Atomic versions
+static inline int test_and_set_bit(int nr, volatile unsigned long *addr)
+{
+    return (__atomic_fetch_or(&addr[BIT_WORD(nr)], BIT_MASK(nr), __ATOMIC_SEQ_CST) & BIT_MASK(nr)) != 0;
+}
+
+static inline int test_and_clear_bit(int nr, volatile unsigned long *addr)
+{
+    return (__atomic_fetch_and(&addr[BIT_WORD(nr)], ~BIT_MASK(nr), __ATOMIC_SEQ_CST) & BIT_MASK(nr)) != 0;
+}
+
+static inline void set_bit(int nr, volatile unsigned long *addr)
+{
+    __atomic_fetch_or(&addr[BIT_WORD(nr)], BIT_MASK(nr), __ATOMIC_RELAXED);
+}
+
+static inline void clear_bit(int nr, volatile unsigned long *addr)
+{
+    __atomic_fetch_and(&addr[BIT_WORD(nr)], ~BIT_MASK(nr), __ATOMIC_RELAXED);
+}
+
+static inline void clear_bit_unlock(int nr, volatile unsigned long *addr)
+{
+    __atomic_fetch_and(&addr[BIT_WORD(nr)], ~BIT_MASK(nr), __ATOMIC_RELEASE);
+}
+
+#define test_and_set_bit_lock(nr, addr) test_and_set_bit(nr, addr)
+
+// Word at a time, like the kernel versions
+static inline unsigned long __find_next(const unsigned long *addr, unsigned long size,
+                                        unsigned long offset, unsigned long invert)
+{
+    unsigned long w;
+
+    if (offset >= size) {
+        return size;
+    }
+    w = (addr[BIT_WORD(offset)] ^ invert) & (~0UL << (offset % BITS_PER_LONG));
+    offset -= offset % BITS_PER_LONG;
+    while (!w) {
+        offset += BITS_PER_LONG;
+        if (offset >= size) {
+            return size;
+        }
+        w = addr[BIT_WORD(offset)] ^ invert;
+    }
+    return min(offset + __builtin_ctzl(w), size);
+}
+
+#define find_next_bit(addr, size, offset)      __find_next(addr, size, offset, 0UL)
+#define find_next_zero_bit(addr, size, offset) __find_next(addr, size, offset, ~0UL)
+
+#define find_first_bit(addr, size)      find_next_bit(addr, size, 0)
+#define find_first_zero_bit(addr, size) find_next_zero_bit(addr, size, 0)
+#define for_each_set_bit(bit, addr, size) \
+    for ((bit) = find_first_bit(addr, size); (bit) < (size); (bit) = find_next_bit(addr, size, (bit) + 1))
+
+static inline void bitmap_zero(unsigned long *dst, unsigned int nbits)
+{
+    memset(dst, 0, BITS_TO_LONGS(nbits) * sizeof(unsigned long));
+}
+
+static inline void bitmap_copy(unsigned long *dst, const unsigned long *src, unsigned int nbits)
+{
+    memcpy(dst, src, BITS_TO_LONGS(nbits) * sizeof(unsigned long));
+}
+
+static inline void bitmap_or(unsigned long *dst, const unsigned long *a, const unsigned long *b, unsigned int nbits)
+{
+    unsigned int i;
+
+    for (i = 0; i < BITS_TO_LONGS(nbits); i++) {
+        dst[i] = a[i] | b[i];
+    }
+}
+
+static inline int bitmap_weight(const unsigned long *src, unsigned int nbits)
+{
+    unsigned int i;
+    int w = 0;
+
+    for (i = 0; i < nbits / BITS_PER_LONG; i++) {
+        w += __builtin_popcountl(src[i]);
+    }
+    if (nbits % BITS_PER_LONG) {
+        w += __builtin_popcountl(src[i] & (~0UL >> (BITS_PER_LONG - nbits % BITS_PER_LONG)));
+    }
+    return w;
+}
+
+static inline bool bitmap_empty(const unsigned long *src, unsigned int nbits)
+{
+    return find_first_bit(src, nbits) >= nbits;
+}
+
+static inline void bitmap_set(unsigned long *map, unsigned int start, unsigned int len)
+{
+    while (len--) {
+        __set_bit(start++, map);
+    }
+}
+
+static inline void bitmap_clear(unsigned long *map, unsigned int start, unsigned int len)
+{
+    while (len--) {
+        __clear_bit(start++, map);
+    }
+}
+
+static inline void bitmap_from_arr32(unsigned long *bitmap, const u32 *buf, unsigned int nbits)
+{
+    unsigned int i;
+
+    bitmap_zero(bitmap, nbits);
+    for (i = 0; i < DIV_ROUND_UP(nbits, 32); i++) {
+        bitmap[i / (BITS_PER_LONG / 32)] |= (unsigned long)buf[i] << (32 * (i % (BITS_PER_LONG / 32)));
+    }
+    if (nbits % BITS_PER_LONG) {
+        bitmap[nbits / BITS_PER_LONG] &= ~0UL >> (BITS_PER_LONG - nbits % BITS_PER_LONG);
+    }
+}
+
+// Unaligned big endian loads
+static inline u16 get_unaligned_be16(const void *p)
+{
+    const u8 *b = p;
+
+    return (b[0] << 8) | b[1];
+}
+
+static inline u32 get_unaligned_be32(const void *p)
+{
+    const u8 *b = p;
+
+    return ((u32)b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+}
+
+// Math
+static inline u64 div_u64(u64 dividend, u32 divisor)
+{
+    return dividend / divisor;
+}
+
+static inline s64 div_s64(s64 dividend, s32 divisor)
+{
+    return dividend / divisor;
+}
+
+static inline u64 div64_u64(u64 dividend, u64 divisor)
+{
+    return dividend / divisor;
+}
+
+s16 fixp_sin16(int degrees);
+
+// Time (simulated clock of the benchmark)
+// A thread playing events sets its own clock to the time of each event,
+// the clock shared with the timers may be ahead of it
+extern u64 zed_pl_kcompat_now_ns;
+extern __thread s64 zed_pl_kcompat_thread_ns;   // -1: use the shared clock
+
+static inline u64 ktime_get_ns(void)
+{
+    if (zed_pl_kcompat_thread_ns >= 0) {
+        return zed_pl_kcompat_thread_ns;
+    }
+    return __atomic_load_n(&zed_pl_kcompat_now_ns, __ATOMIC_RELAXED);
+}
+
+#define ktime_get()            ((ktime_t)ktime_get_ns())
+#define ktime_to_ns(t)         ((s64)(t))
+#define ns_to_ktime(ns)        ((ktime_t)(ns))
+#define ms_to_ktime(ms)        ((ktime_t)(ms) * NSEC_PER_MSEC)
+#define ktime_add(a, b)        ((a) + (b))
+#define ktime_add_ns(t, ns)    ((t) + (ns))
+#define ktime_sub(a, b)        ((a) - (b))
+
+// Timers and work items (run by zed_pl_kcompat_run(); queued from any thread)
+enum hrtimer_restart {
+    HRTIMER_NORESTART,
+    HRTIMER_RESTART,
+};
+
+enum hrtimer_mode {
+    HRTIMER_MODE_ABS,
+    HRTIMER_MODE_REL,
+};
+
+#define CLOCK_MONOTONIC 1
+
+struct hrtimer {
+    enum hrtimer_restart (*function)(struct hrtimer *);
+    ktime_t expires;
+    bool    active;
+};
+
+struct work_struct {
+    void (*func)(struct work_struct *);
+    bool pending;
+};
+
+struct workqueue_struct;
+#define system_highpri_wq ((struct workqueue_struct *)0)
+#define system_wq         ((struct workqueue_struct *)0)
+
+void hrtimer_init(struct hrtimer *timer, int clock, enum hrtimer_mode mode);
+void hrtimer_start(struct hrtimer *timer, ktime_t t, enum hrtimer_mode mode);
+int  hrtimer_cancel(struct hrtimer *timer);
+u64  hrtimer_forward_now(struct hrtimer *timer, ktime_t interval);
+
+#define INIT_WORK(w, fn) ((w)->func = (fn), (w)->pending = false)
+bool queue_work(struct workqueue_struct *wq, struct work_struct *work);
+#define schedule_work(w)    queue_work(system_wq, w)
+#define cancel_work_sync(w) ((w)->pending = false)
+#define flush_work(w)       zed_pl_kcompat_run()
+
+// Run queued work items
+void zed_pl_kcompat_run(void);
+
+// Advance the simulated clock, running timers and work items on the way
+void zed_pl_kcompat_advance(u64 t);
+
+// Default parameters, clock at 0, no timers or work items
+void zed_pl_kcompat_reset(void);
+
+// Register window (the benchmark's simulated PL block)
+u32  zed_pl_kcompat_readl(const volatile void __iomem *addr);
+void zed_pl_kcompat_writel(u32 val, volatile void __iomem *addr);
+#define readl(addr)      zed_pl_kcompat_readl(addr)
+#define writel(v, addr)  zed_pl_kcompat_writel(v, addr)
+
+static inline void __iowrite32_copy(void __iomem *to, const void *from, size_t count)
+{
+    const u32 *src = from;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        writel(src[i], (u32 __iomem *)to + i);
+    }
+}
+
+// Sound: just what the driver's structures and handlers use
+struct snd_card {
+    struct module *module;
+};
+
+struct snd_soc_card {
+    struct snd_card *snd_card;
+};
+
+struct snd_seq_device;
+struct snd_seq_port_subscribe;
+struct snd_kcontrol;
+struct snd_ctl_elem_info;
+struct snd_ctl_elem_value;
+struct clk;
+struct rchan;
+struct dentry;
+struct uio_info;
+
+struct snd_seq_addr {
+    unsigned char client;
+    unsigned char port;
+};
+
+struct snd_seq_ev_note {
+    unsigned char channel;
+    unsigned char note;
+    unsigned char velocity;
+    unsigned char off_velocity;
+    unsigned int  duration;
+};
+
+struct snd_seq_ev_ctrl {
+    unsigned char channel;
+    unsigned char unused1, unused2, unused3;
+    unsigned int  param;
+    signed int    value;
+};
+
+struct snd_seq_ev_ext {
+    unsigned int len;
+    void        *ptr;
+};
+
+struct snd_seq_event {
+    unsigned char       type;
+    unsigned char       flags;
+    char                tag;
+    unsigned char       queue;
+    unsigned int        time[2];
+    struct snd_seq_addr source;
+    struct snd_seq_addr dest;
+    union {
+        struct snd_seq_ev_note note;
+        struct snd_seq_ev_ctrl control;
+        struct snd_seq_ev_ext  ext;
+        unsigned char          raw8[12];
+    } data;
+};
+
+// MIDI channel state (kept by the MIDI emulation)
+struct snd_midi_channel {
+    void         *private;
+    int           number;
+    int           client;
+    int           port;
+    unsigned char midi_mode;
+    unsigned int  drum_channel:1;
+    unsigned int  param_type:1;
+    unsigned char midi_aftertouch;
+    unsigned char midi_pressure;
+    unsigned char midi_program;
+    short         midi_pitchbend;
+    unsigned char control[128];
+    unsigned char note[128];
+    short         gm_rpn_pitch_bend_range;
+    short         gm_rpn_fine_tuning;
+    short         gm_rpn_coarse_tuning;
+    unsigned char gm_volume;
+    unsigned char gm_expression;
+    unsigned char gm_pan;
+    unsigned char gm_modulation;
+};
+
+struct snd_midi_channel_set {
+    void                    *private_data;
+    int                      client;
+    int                      port;
+    int                      max_channels;
+    struct snd_midi_channel *channels;
+};
+
+// MIDI emulation callbacks
+struct snd_midi_op {
+    void (*note_on)(void *private_data, int note, int vel, struct snd_midi_channel *chan);
+    void (*note_off)(void *private_data, int note, int vel, struct snd_midi_channel *chan);
+    void (*key_press)(void *private_data, int note, int vel, struct snd_midi_channel *chan);
+    void (*note_terminate)(void *private_data, int note, struct snd_midi_channel *chan);
+    void (*control)(void *private_data, int type, struct snd_midi_channel *chan);
+    void (*nrpn)(void *private_data, struct snd_midi_channel *chan, struct snd_midi_channel_set *chset);
+    void (*sysex)(void *private_data, unsigned char *buf, int len, int parsed, struct snd_midi_channel_set *chset);
+};
+
+#define SNDRV_MIDI_PARAM_TYPE_REGISTERED    0
+#define SNDRV_MIDI_PARAM_TYPE_NONREGISTERED 1
+
+#define SNDRV_MIDI_SYSEX_NOT_PARSED 0
+#define SNDRV_MIDI_SYSEX_GM_ON      1
+#define SNDRV_MIDI_MODE_GS          2
+#define SNDRV_MIDI_MODE_XG          3
+
+#define SNDRV_MIDI_NOTE_OFF      0x00
+#define SNDRV_MIDI_NOTE_ON       0x01
+#define SNDRV_MIDI_NOTE_RELEASED 0x02
+
+// Kernel fifo (only the declaration is needed)
+#define DECLARE_KFIFO(fifo, type, size) \
+    struct { type buf[size]; unsigned int in, out; } fifo
+
+#endif
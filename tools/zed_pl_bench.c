@@ -0,0 +1,714 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Zedboard PL synthesizer MIDI benchmark
+ *
+ * @author Yuhei Horibe
+ * Replays Standard MIDI Files through the driver's MIDI handlers
+ * (zed_pl_midi.c built against zed_pl_kcompat.h), on a RAM register
+ * window with a simulated unit_free_reg: a unit is busy while triggered,
+ * and for its release time after (2 ms per vca_release step, as in the
+ * software model). Files are played as fast as possible on a simulated
+ * clock, so the results don't depend on the host timer.
+ * With workers=<n>, channels are sharded across n threads (part % n, as
+ * midi_workers does) and events/s is the aggregate wall-clock rate (the
+ * other counts depend on the thread interleaving, and are not printed).
+ *
+ * Usage: zed_pl_bench [-u units] [-c config]... [-s seconds] [file.mid ...]
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under  the terms of the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the License, or (at your
+ * option) any later version.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sound/asoundef.h>
+#include "zed_pl_kcompat.h"
+#include "../zed_pl_synth.h"
+
+#define ZED_PL_BENCH_MAX_CONFIGS 16
+#define ZED_PL_BENCH_MAX_WORKERS 16
+#define ZED_PL_BENCH_RING        256      // Events in flight per worker thread
+#define ZED_PL_BENCH_GAIN_ONE    1024     // Limiter gain (Q10)
+
+struct bench_song {
+    const char              *name;
+    struct zed_pl_smf_event *events;
+    size_t                   count;
+};
+
+// Simulated PL block
+struct bench_sim {
+    uint32_t *regs;
+    int       num_units;
+    uint8_t  *trigger;
+    uint64_t *release_end;
+    uint64_t  reads;    // Totals of the threads (see sim_add_counts())
+    uint64_t  writes;
+};
+
+static struct bench_sim sim;
+
+// Register accesses of the calling thread
+static __thread uint64_t sim_reads;
+static __thread uint64_t sim_writes;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-u units] [-c config]... [-s seconds] [file.mid ...]\n"
+            "  -u  number of units (default %d)\n"
+            "  -c  allocator configuration, comma separated <param>=<value>:\n"
+            "      module parameters (e.g. busy_verify), max_voices, units,\n"
+            "      workers (threads playing the channels, 0: replay thread)\n"
+            "      (repeat for several configurations, default: driver defaults)\n"
+            "  -s  seconds of the generated stream when no file is given (default 60)\n",
+            prog, ZED_PL_SYNTH_DEFAULT_UNITS);
+}
+
+// Register window
+static bool sim_unit_busy(int u)
+{
+    return sim.trigger[u] || (ktime_get_ns() < sim.release_end[u]);
+}
+
+u32 zed_pl_kcompat_readl(const volatile void __iomem *addr)
+{
+    size_t off = (const volatile uint32_t *)addr - sim.regs;
+
+    sim_reads++;
+    if (off >= ZED_PL_UNIT_FREE_OFF(sim.num_units)) {
+        int base = (off - ZED_PL_UNIT_FREE_OFF(sim.num_units)) * 32;
+        uint32_t busy = 0;
+        int i;
+
+        for (i = 0; (i < 32) && (base + i < sim.num_units); i++) {
+            busy |= (uint32_t)sim_unit_busy(base + i) << i;
+        }
+        sim.regs[off] = busy;
+    }
+    return sim.regs[off];
+}
+
+void zed_pl_kcompat_writel(u32 val, volatile void __iomem *addr)
+{
+    size_t off = (volatile uint32_t *)addr - sim.regs;
+    int u = off / ZED_PL_UNIT_REG_WORDS;
+
+    sim_writes++;
+    if ((u < sim.num_units) && ((off % ZED_PL_UNIT_REG_WORDS) == ZED_PL_REG_CTL)) {
+        bool trig = (val >> 2) & 1;
+
+        if (sim.trigger[u] && !trig) {
+            uint32_t rel = sim.regs[u * ZED_PL_UNIT_REG_WORDS + ZED_PL_REG_VCA_EG] >> 24;
+
+            sim.release_end[u] = ktime_get_ns() + (uint64_t)rel * ZED_PL_EG_MS_STEP * NSEC_PER_MSEC;
+        }
+        sim.trigger[u] = trig;
+    }
+    sim.regs[off] = val;
+}
+
+static void sim_add_counts(void)
+{
+    __atomic_add_fetch(&sim.reads, sim_reads, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&sim.writes, sim_writes, __ATOMIC_RELAXED);
+    sim_reads  = 0;
+    sim_writes = 0;
+}
+
+static int sim_polyphony(void)
+{
+    int n = 0;
+    int u;
+
+    for (u = 0; u < sim.num_units; u++) {
+        n += sim_unit_busy(u);
+    }
+    return n;
+}
+
+// Standard MIDI File loading, through the player's parser (zed_pl_smf.c)
+static int smf_load(struct bench_song *song, const char *path)
+{
+    struct zed_pl_smf smf;
+    uint8_t *buf;
+    long size;
+    int ret = -1;
+    FILE *fp;
+
+    fp = fopen(path, "rb");
+    if (!fp) {
+        perror(path);
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    buf = malloc(size > 0 ? size : 1);
+    if (buf && (fread(buf, 1, size, fp) == (size_t)size)) {
+        ret = zed_pl_smf_parse(&smf, buf, size);
+    }
+    fclose(fp);
+    free(buf);
+    if (ret) {
+        fprintf(stderr, "%s: not a valid MIDI file\n", path);
+        return -1;
+    }
+
+    song->name   = path;
+    song->events = smf.events;
+    song->count  = smf.num_events;
+    return 0;
+}
+
+// Dense generated stream: 15 melodic channels with overlapping notes,
+// volume/expression changes, pitch bend and modulation
+static uint32_t lcg(uint32_t *s)
+{
+    *s = *s * 1103515245 + 12345;
+    return *s >> 8;
+}
+
+static int bench_event_cmp(const void *a, const void *b)
+{
+    const struct zed_pl_smf_event *ea = a;
+    const struct zed_pl_smf_event *eb = b;
+
+    if (ea->time_us != eb->time_us) {
+        return (ea->time_us < eb->time_us) ? -1 : 1;
+    }
+    // Note off before note on at the same time
+    return (int)((ea->status & 0xF0) == 0x90 && ea->data[1]) - (int)((eb->status & 0xF0) == 0x90 && eb->data[1]);
+}
+
+static int song_generate(struct bench_song *song, double seconds)
+{
+    uint64_t len_us = (uint64_t)(seconds * 1e6);
+    size_t max = (size_t)(seconds * 400) + 64;
+    uint32_t s = 1;
+    uint64_t t;
+    size_t n = 0;
+    int ch;
+
+    song->events = malloc(max * sizeof(*song->events));
+    if (!song->events) {
+        return -1;
+    }
+
+    for (ch = 0; ch < 16; ch++) {
+        struct zed_pl_smf_event *e = &song->events[n++];
+
+        e->time_us = 0;
+        e->status  = 0xC0 | ch;
+        e->data[0] = (ch * 8) & 0x7F;
+    }
+
+    // About 160 notes and 40 controllers a second
+    for (t = 0; t < len_us; t += 5000) {
+        struct zed_pl_smf_event *e;
+        uint32_t r = lcg(&s);
+
+        if (n + 2 > max) {
+            break;
+        }
+        ch = r % 15;
+        if (ch == 9) {
+            ch = 15;
+        }
+        e = &song->events[n++];
+        e->time_us = t;
+        if ((r >> 8) % 5 == 0) {
+            static const uint8_t ctls[] = { MIDI_CTL_MSB_MAIN_VOLUME, MIDI_CTL_MSB_EXPRESSION,
+                                            MIDI_CTL_MSB_MODWHEEL, MIDI_CTL_MSB_PAN };
+
+            if ((r >> 16) & 1) {
+                e->status  = 0xE0 | ch;
+                e->data[0] = 0;
+                e->data[1] = 32 + (r >> 17) % 64;
+            } else {
+                e->status  = 0xB0 | ch;
+                e->data[0] = ctls[(r >> 17) % ARRAY_SIZE(ctls)];
+                e->data[1] = (r >> 19) & 0x7F;
+            }
+            continue;
+        }
+        e->status  = 0x90 | ch;
+        e->data[0] = 36 + (r >> 8) % 60;
+        e->data[1] = 40 + (r >> 16) % 80;
+
+        // Note off after 20-400 ms
+        song->events[n] = *e;
+        song->events[n].time_us = t + 20000 + (lcg(&s) % 380000);
+        song->events[n].data[1] = 0;
+        n++;
+    }
+    qsort(song->events, n, sizeof(*song->events), bench_event_cmp);
+
+    song->name  = "generated";
+    song->count = n;
+    return 0;
+}
+
+// MIDI emulation: the part of seq_midi_emul the driver relies on
+static const struct snd_midi_op bench_ops = {
+    .note_on        = zed_pl_synth_note_on,
+    .note_off       = zed_pl_synth_note_off,
+    .note_terminate = zed_pl_synth_terminate_note,
+    .control        = zed_pl_synth_control,
+    .nrpn           = zed_pl_synth_nrpn,
+    .sysex          = zed_pl_synth_sysex,
+};
+
+static void bench_reset_channel(struct snd_midi_channel *chan, int n)
+{
+    memset(chan, 0, sizeof(*chan));
+    chan->number = n;
+    chan->control[MIDI_CTL_MSB_MAIN_VOLUME] = 100;
+    chan->control[MIDI_CTL_MSB_PAN]         = 64;
+    chan->control[MIDI_CTL_MSB_EXPRESSION]  = 127;
+    chan->gm_volume     = 100;
+    chan->gm_pan        = 64;
+    chan->gm_expression = 127;
+    chan->drum_channel  = (n == 9);
+}
+
+static void bench_note_off(struct zed_pl_port *port, struct snd_midi_channel *chan, int note, int vel)
+{
+    if (!(chan->note[note] & SNDRV_MIDI_NOTE_ON)) {
+        return ;
+    }
+    if (chan->control[MIDI_CTL_SUSTAIN] >= 64) {
+        chan->note[note] |= SNDRV_MIDI_NOTE_RELEASED;
+        return ;
+    }
+    chan->note[note] = 0;
+    bench_ops.note_off(port, note, vel, chan);
+}
+
+static void bench_control(struct zed_pl_port *port, struct snd_midi_channel *chan, int param, int value)
+{
+    int n;
+
+    chan->control[param] = value;
+    switch (param) {
+    case MIDI_CTL_SUSTAIN:
+        if (value < 64) {
+            for (n = 0; n < 128; n++) {
+                if (chan->note[n] & SNDRV_MIDI_NOTE_RELEASED) {
+                    chan->note[n] = 0;
+                    bench_ops.note_off(port, n, 0, chan);
+                }
+            }
+        }
+        break;
+    case MIDI_CTL_MSB_DATA_ENTRY:
+        chan->control[MIDI_CTL_LSB_DATA_ENTRY] = 0;
+        fallthrough;
+    case MIDI_CTL_LSB_DATA_ENTRY:
+        if (chan->param_type == SNDRV_MIDI_PARAM_TYPE_NONREGISTERED) {
+            bench_ops.nrpn(port, chan, port->chset);
+        } else {
+            zed_pl_synth_rpn(port, chan);
+        }
+        break;
+    case MIDI_CTL_REGIST_PARM_NUM_LSB:
+    case MIDI_CTL_REGIST_PARM_NUM_MSB:
+        chan->param_type = SNDRV_MIDI_PARAM_TYPE_REGISTERED;
+        break;
+    case MIDI_CTL_NONREG_PARM_NUM_LSB:
+    case MIDI_CTL_NONREG_PARM_NUM_MSB:
+        chan->param_type = SNDRV_MIDI_PARAM_TYPE_NONREGISTERED;
+        break;
+    case MIDI_CTL_ALL_SOUNDS_OFF:
+    case MIDI_CTL_ALL_NOTES_OFF:
+        for (n = 0; n < 128; n++) {
+            if (chan->note[n]) {
+                chan->note[n] = 0;
+                bench_ops.note_off(port, n, 0, chan);
+            }
+        }
+        break;
+    default:
+        // GM controllers kept by the emulation
+        if (param == MIDI_CTL_MSB_MAIN_VOLUME) {
+            chan->gm_volume = value;
+        } else if (param == MIDI_CTL_MSB_EXPRESSION) {
+            chan->gm_expression = value;
+        } else if (param == MIDI_CTL_MSB_PAN) {
+            chan->gm_pan = value;
+        } else if (param == MIDI_CTL_MSB_MODWHEEL) {
+            chan->gm_modulation = value;
+        }
+        bench_ops.control(port, param, chan);
+        break;
+    }
+}
+
+static void bench_event(struct zed_pl_port *port, const struct zed_pl_smf_event *e)
+{
+    struct snd_midi_channel *chan = &port->chset->channels[e->status & 0x0F];
+
+    switch (e->status & 0xF0) {
+    case 0x90:
+        if (e->data[1]) {
+            if (chan->note[e->data[0]] & SNDRV_MIDI_NOTE_ON) {
+                bench_ops.note_off(port, e->data[0], 0, chan);
+            }
+            chan->note[e->data[0]] = SNDRV_MIDI_NOTE_ON;
+            bench_ops.note_on(port, e->data[0], e->data[1], chan);
+            break;
+        }
+        fallthrough;
+    case 0x80:
+        bench_note_off(port, chan, e->data[0], e->data[1]);
+        break;
+    case 0xB0:
+        bench_control(port, chan, e->data[0], e->data[1]);
+        break;
+    case 0xC0:
+        chan->midi_program = e->data[0];
+        zed_pl_synth_program(port, chan);
+        break;
+    case 0xD0:
+        chan->midi_pressure = e->data[0];
+        bench_ops.control(port, MIDI_CTL_CHAN_PRESSURE, chan);
+        break;
+    case 0xE0:
+        chan->midi_pitchbend = ((e->data[1] << 7) | e->data[0]) - 8192;
+        bench_ops.control(port, MIDI_CTL_PITCHBEND, chan);
+        break;
+    default:
+        break;
+    }
+}
+
+// Worker thread: plays the channels sharded to it, in the order of the song
+struct bench_worker {
+    pthread_t                 thread;
+    struct zed_pl_port       *port;
+    const struct zed_pl_smf_event *ring[ZED_PL_BENCH_RING];
+    unsigned int              head;     // Written by the replay thread
+    unsigned int              tail;     // Written by the worker
+} __attribute__((aligned(64)));
+
+static void *bench_worker_fn(void *arg)
+{
+    struct bench_worker *wk = arg;
+
+    for (;;) {
+        const struct zed_pl_smf_event *e;
+
+        while (__atomic_load_n(&wk->head, __ATOMIC_ACQUIRE) == wk->tail) {
+            sched_yield();
+        }
+        e = wk->ring[wk->tail % ZED_PL_BENCH_RING];
+        if (!e) {
+            break;
+        }
+        zed_pl_kcompat_thread_ns = e->time_us * NSEC_PER_USEC;
+        bench_event(wk->port, e);
+        __atomic_store_n(&wk->tail, wk->tail + 1, __ATOMIC_RELEASE);
+    }
+    sim_add_counts();
+    return NULL;
+}
+
+// NULL stops the worker
+static void bench_worker_push(struct bench_worker *wk, const struct zed_pl_smf_event *e)
+{
+    while (wk->head - __atomic_load_n(&wk->tail, __ATOMIC_ACQUIRE) >= ZED_PL_BENCH_RING) {
+        sched_yield();
+    }
+    wk->ring[wk->head % ZED_PL_BENCH_RING] = e;
+    __atomic_store_n(&wk->head, wk->head + 1, __ATOMIC_RELEASE);
+}
+
+// One run: a song through a freshly probed driver state
+struct bench_result {
+    uint64_t events;
+    double   time_s;    // CPU time of the replay thread, wall time with workers
+    int      workers;   // The counts below depend on the thread interleaving then
+    uint64_t reads;
+    uint64_t writes;
+    int      dropped;
+    int      steals;
+    int      peak;
+    int      level;     // Highest output sum (amp_l/amp_r)
+    int      gain;      // Lowest limiter gain
+};
+
+static double seconds(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Apply "param=value,..." (after the driver defaults)
+static int bench_config(struct zed_pl_card_data *prv, const char *config, int *units, int *workers, bool apply)
+{
+    char buf[256];
+    char *tok;
+    char *save;
+
+    snprintf(buf, sizeof(buf), "%s", config);
+    for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(tok, '=');
+        unsigned int val;
+        int i;
+
+        if (!eq) {
+            return -1;
+        }
+        *eq = '\0';
+        val = strtoul(eq + 1, NULL, 0);
+
+        if (!strcmp(tok, "units")) {
+            *units = val;
+        } else if (!strcmp(tok, "workers")) {
+            *workers = val;
+        } else if (!strcmp(tok, "max_voices")) {
+            for (i = 0; apply && (i < ZED_PL_SYNTH_NUM_PARTS); i++) {
+                prv->policy.max_voices[i] = val;
+            }
+        } else if (apply && zed_pl_kcompat_set_param(tok, val)) {
+            fprintf(stderr, "Unknown parameter %s\n", tok);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int bench_run(const struct bench_song *song, const char *config, int units, struct bench_result *res)
+{
+    static struct device dev = { .name = "zed_pl_bench" };
+    static struct bench_worker workers[ZED_PL_BENCH_MAX_WORKERS];
+    struct zed_pl_card_data *prv;
+    struct snd_midi_channel_set chset;
+    struct snd_midi_channel chans[ZED_PL_SYNTH_MIDI_CH];
+    struct zed_pl_port *port;
+    clockid_t clock;
+    size_t window;
+    size_t i;
+    double t;
+    int num_workers = 0;
+    int started = 0;
+    int ret = -1;
+
+    zed_pl_kcompat_reset();
+    if (bench_config(NULL, config, &units, &num_workers, false) || (units <= 0) ||
+        (units > ZED_PL_SYNTH_MAX_UNITS) || (num_workers < 0) || (num_workers > ZED_PL_BENCH_MAX_WORKERS)) {
+        return -1;
+    }
+
+    // Probe
+    prv = calloc(1, sizeof(*prv));
+    window = ZED_PL_REG_WINDOW_SIZE(units);
+    memset(&sim, 0, sizeof(sim));
+    sim.num_units   = units;
+    sim.regs        = calloc(1, window);
+    sim.trigger     = calloc(units, sizeof(*sim.trigger));
+    sim.release_end = calloc(units, sizeof(*sim.release_end));
+    if (!prv || !sim.regs || !sim.trigger || !sim.release_end) {
+        goto out;
+    }
+    prv->dev        = &dev;
+    prv->num_units  = units;
+    prv->num_voices = units + ZED_PL_SYNTH_OVERFLOW_SLOTS;
+    prv->addr_base  = (void __iomem *)sim.regs;
+    prv->size       = window;
+    if (zed_pl_synth_alloc_voices(prv)) {
+        goto out;
+    }
+    zed_pl_synth_init_channels();
+    zed_pl_synth_init_voice_table(prv);
+    zed_pl_synth_init_limiter(prv);
+    zed_pl_synth_init_params(prv);
+    zed_pl_synth_init_mod(prv);
+    if (bench_config(prv, config, &units, &num_workers, true)) {
+        goto out;
+    }
+
+    chset.private_data = &prv->ports[0];
+    chset.max_channels = ZED_PL_SYNTH_MIDI_CH;
+    chset.channels     = chans;
+    for (i = 0; i < ZED_PL_SYNTH_MIDI_CH; i++) {
+        bench_reset_channel(&chans[i], i);
+    }
+    prv->num_ports  = 1;
+    port            = &prv->ports[0];
+    port->prv       = prv;
+    port->chset     = &chset;
+    zed_pl_synth_midi_init(port);
+
+    // Replay (register traffic of the setup isn't counted)
+    memset(res, 0, sizeof(*res));
+    res->workers = num_workers;
+    sim_reads  = 0;
+    sim_writes = 0;
+    sim.reads  = 0;
+    sim.writes = 0;
+    res->gain = ZED_PL_BENCH_GAIN_ONE;
+
+    // Workers run the channel events, this thread the clock, timers and work items
+    for (started = 0; started < num_workers; started++) {
+        struct bench_worker *wk = &workers[started];
+
+        wk->port = port;
+        wk->head = 0;
+        wk->tail = 0;
+        if (pthread_create(&wk->thread, NULL, bench_worker_fn, wk)) {
+            goto out;
+        }
+    }
+
+    clock = num_workers ? CLOCK_MONOTONIC : CLOCK_THREAD_CPUTIME_ID;
+    t = seconds(clock);
+    for (i = 0; i < song->count; i++) {
+        const struct zed_pl_smf_event *e = &song->events[i];
+        int poly;
+
+        zed_pl_kcompat_advance(e->time_us * NSEC_PER_USEC);
+        if (num_workers) {
+            bench_worker_push(&workers[(e->status & 0x0F) % num_workers], e);
+        } else {
+            bench_event(port, e);
+        }
+        zed_pl_kcompat_run();
+
+        poly = sim_polyphony();
+        if (poly > res->peak) {
+            res->peak = poly;
+        }
+        if (prv->limiter.gain < res->gain) {
+            res->gain = prv->limiter.gain;
+        }
+    }
+    for (; started > 0; started--) {
+        bench_worker_push(&workers[started - 1], NULL);
+        pthread_join(workers[started - 1].thread, NULL);
+    }
+    res->time_s  = seconds(clock) - t;
+    zed_pl_kcompat_run();
+    sim_add_counts();
+    res->events  = song->count;
+    res->reads   = sim.reads;
+    res->writes  = sim.writes;
+    res->dropped = atomic_read(&prv->policy.dropped);
+    res->steals  = atomic_read(&prv->policy.steals);
+    res->level   = prv->limiter.peak;
+    ret = 0;
+
+out:
+    for (; started > 0; started--) {
+        bench_worker_push(&workers[started - 1], NULL);
+        pthread_join(workers[started - 1].thread, NULL);
+    }
+    if (prv) {
+        free(prv->voices.note);
+        free(prv->voices.vel);
+        free(prv->voices.channel);
+        free(prv->voices.state);
+        free(prv->voices.next);
+        free(prv->voices.prev);
+        free(prv->voices.age);
+        free(prv->voices.level);
+        free(prv->voices.spread);
+        free(prv->voice_busy);
+        free(prv->uio_units);
+        free(prv->shadow_unit);
+        free(prv->predict.busy);
+        free(prv->predict.free_at);
+        free(prv);
+    }
+    free(sim.regs);
+    free(sim.trigger);
+    free(sim.release_end);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    const char *configs[ZED_PL_BENCH_MAX_CONFIGS];
+    struct bench_song *songs;
+    int num_configs = 0;
+    int num_songs;
+    int units = ZED_PL_SYNTH_DEFAULT_UNITS;
+    double seconds = 60.0;
+    int opt;
+    int i;
+    int c;
+
+    while ((opt = getopt(argc, argv, "u:c:s:h")) != -1) {
+        switch (opt) {
+        case 'u':
+            units = atoi(optarg);
+            break;
+        case 'c':
+            if (num_configs < ZED_PL_BENCH_MAX_CONFIGS) {
+                configs[num_configs++] = optarg;
+            }
+            break;
+        case 's':
+            seconds = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (num_configs == 0) {
+        configs[num_configs++] = "";
+    }
+
+    num_songs = (optind < argc) ? argc - optind : 1;
+    songs = calloc(num_songs, sizeof(*songs));
+    if (!songs) {
+        return 1;
+    }
+    if (optind < argc) {
+        for (i = 0; i < num_songs; i++) {
+            if (smf_load(&songs[i], argv[optind + i])) {
+                return 1;
+            }
+        }
+    } else if (song_generate(&songs[0], seconds)) {
+        return 1;
+    }
+
+    printf("%-24s %-24s %8s %10s %8s %8s %8s %7s %5s %6s %5s\n",
+           "file", "config", "events", "events/s", "reads/ev", "writes/ev", "dropped", "steals", "peak",
+           "level", "gain");
+    for (i = 0; i < num_songs; i++) {
+        for (c = 0; c < num_configs; c++) {
+            struct bench_result res;
+
+            if (bench_run(&songs[i], configs[c], units, &res)) {
+                fprintf(stderr, "Invalid configuration \"%s\"\n", configs[c]);
+                return 1;
+            }
+
+            // With worker threads only the rate is reproducible
+            if (res.workers) {
+                printf("%-24s %-24s %8llu %10.0f %8s %9s %8s %7s %5s %6s %5s\n",
+                       songs[i].name, configs[c],
+                       (unsigned long long)res.events, res.events / (res.time_s > 0 ? res.time_s : 1e-9),
+                       "-", "-", "-", "-", "-", "-", "-");
+                continue;
+            }
+            printf("%-24s %-24s %8llu %10.0f %8.3f %9.3f %8d %7d %5d %6d %5.2f\n",
+                   songs[i].name, configs[c][0] ? configs[c] : "default",
+                   (unsigned long long)res.events, res.events / (res.time_s > 0 ? res.time_s : 1e-9),
+                   (double)res.reads / (res.events ? res.events : 1),
+                   (double)res.writes / (res.events ? res.events : 1),
+                   res.dropped, res.steals, res.peak,
+                   res.level, (double)res.gain / ZED_PL_BENCH_GAIN_ONE);
+        }
+    }
+    return 0;
+}
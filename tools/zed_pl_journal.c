@@ -0,0 +1,170 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Zedboard PL synthesizer userspace tools
+ *
+ * @author Yuhei Horibe
+ * Journal loading and the simulated register window
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under  the terms of the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the License, or (at your
+ * option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "zed_pl_tools.h"
+
+int zed_pl_window_init(struct zed_pl_window *win, int num_units)
+{
+    win->num_units = num_units;
+    win->regs      = calloc(num_units * ZED_PL_UNIT_WORDS + ZED_PL_COMMON_WORDS(num_units), sizeof(uint32_t));
+    return win->regs ? 0 : -1;
+}
+
+void zed_pl_window_free(struct zed_pl_window *win)
+{
+    free(win->regs);
+    win->regs = NULL;
+}
+
+// Returns the word offset written, or -1 when the write is out of the window
+int zed_pl_window_apply(struct zed_pl_window *win, const struct zed_pl_journal_rec *rec)
+{
+    int off;
+
+    if (rec->unit == ZED_PL_JOURNAL_COMMON) {
+        if (rec->word >= ZED_PL_COMMON_WORDS(win->num_units)) {
+            return -1;
+        }
+        off = win->num_units * ZED_PL_UNIT_WORDS + rec->word;
+    } else {
+        if ((rec->unit >= win->num_units) || (rec->word >= ZED_PL_UNIT_WORDS)) {
+            return -1;
+        }
+        off = rec->unit * ZED_PL_UNIT_WORDS + rec->word;
+    }
+    win->regs[off] = rec->value;
+    return off;
+}
+
+static int zed_pl_journal_valid(const struct zed_pl_journal_rec *rec, int num_units)
+{
+    if ((rec->magic != ZED_PL_JOURNAL_MAGIC) || (rec->ts_ns == 0)) {
+        return 0;
+    }
+    if (rec->unit == ZED_PL_JOURNAL_COMMON) {
+        return rec->word < ZED_PL_COMMON_WORDS(num_units);
+    }
+    return (rec->unit < num_units) && (rec->word < ZED_PL_UNIT_WORDS);
+}
+
+// Sort entry (load order breaks timestamp ties)
+struct zed_pl_journal_ent {
+    struct zed_pl_journal_rec rec;
+    size_t                    seq;
+};
+
+static int zed_pl_journal_cmp(const void *a, const void *b)
+{
+    const struct zed_pl_journal_ent *ea = a;
+    const struct zed_pl_journal_ent *eb = b;
+
+    if (ea->rec.ts_ns != eb->rec.ts_ns) {
+        return (ea->rec.ts_ns < eb->rec.ts_ns) ? -1 : 1;
+    }
+    return (ea->seq < eb->seq) ? -1 : (ea->seq > eb->seq);
+}
+
+static int zed_pl_journal_sort(struct zed_pl_journal *jn)
+{
+    struct zed_pl_journal_ent *ents;
+    size_t i;
+
+    if (jn->count == 0) {
+        return 0;
+    }
+    ents = malloc(jn->count * sizeof(*ents));
+    if (!ents) {
+        return -1;
+    }
+    for (i = 0; i < jn->count; i++) {
+        ents[i].rec = jn->recs[i];
+        ents[i].seq = i;
+    }
+    qsort(ents, jn->count, sizeof(*ents), zed_pl_journal_cmp);
+    for (i = 0; i < jn->count; i++) {
+        jn->recs[i] = ents[i].rec;
+    }
+    free(ents);
+    return 0;
+}
+
+int zed_pl_journal_load(struct zed_pl_journal *jn, char **files, int num_files, int num_units)
+{
+    int i;
+
+    memset(jn, 0, sizeof(*jn));
+    for (i = 0; i < num_files; i++) {
+        const struct zed_pl_journal_rec *map;
+        struct zed_pl_journal_rec *recs;
+        struct stat st;
+        size_t n;
+        size_t j;
+        int fd;
+
+        fd = open(files[i], O_RDONLY);
+        if (fd < 0) {
+            perror(files[i]);
+            return -1;
+        }
+        if (fstat(fd, &st) < 0) {
+            perror(files[i]);
+            close(fd);
+            return -1;
+        }
+
+        n = st.st_size / sizeof(*map);
+        if (n == 0) {
+            close(fd);
+            continue;
+        }
+
+        // Journals are read in place, no copy until the merge
+        map = mmap(NULL, n * sizeof(*map), PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            perror(files[i]);
+            return -1;
+        }
+
+        recs = realloc(jn->recs, (jn->count + n) * sizeof(*recs));
+        if (!recs) {
+            munmap((void *)map, n * sizeof(*map));
+            return -1;
+        }
+        jn->recs = recs;
+
+        for (j = 0; j < n; j++) {
+            if (zed_pl_journal_valid(&map[j], num_units)) {
+                jn->recs[jn->count++] = map[j];
+            } else {
+                jn->skipped++;
+            }
+        }
+        munmap((void *)map, n * sizeof(*map));
+    }
+
+    return zed_pl_journal_sort(jn);
+}
+
+void zed_pl_journal_free(struct zed_pl_journal *jn)
+{
+    free(jn->recs);
+    memset(jn, 0, sizeof(*jn));
+}
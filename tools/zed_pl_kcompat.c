@@ -0,0 +1,194 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Zedboard PL synthesizer userspace tools
+ *
+ * @author Yuhei Horibe
+ * Runtime of the kernel API stand-ins (zed_pl_kcompat.h):
+ * module parameters, simulated clock, timers and work items.
+ * Timers and work items may be armed from any thread, and are run by
+ * the thread driving the clock.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under  the terms of the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the License, or (at your
+ * option) any later version.
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include "zed_pl_kcompat.h"
+
+#define ZED_PL_KCOMPAT_PARAMS 16
+#define ZED_PL_KCOMPAT_TIMERS 8
+#define ZED_PL_KCOMPAT_WORKS  16
+
+struct zed_pl_kcompat_param {
+    const char   *name;
+    unsigned int *val;
+    unsigned int  def;
+};
+
+static struct zed_pl_kcompat_param params[ZED_PL_KCOMPAT_PARAMS];
+static int num_params;
+
+static struct hrtimer     *timers[ZED_PL_KCOMPAT_TIMERS];
+static int num_timers;
+static struct work_struct *works[ZED_PL_KCOMPAT_WORKS];
+static int num_works;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+
+u64 zed_pl_kcompat_now_ns;
+__thread s64 zed_pl_kcompat_thread_ns = -1;
+
+// Module parameters
+void zed_pl_kcompat_add_param(const char *name, unsigned int *val)
+{
+    if (num_params < ZED_PL_KCOMPAT_PARAMS) {
+        params[num_params].name = name;
+        params[num_params].val  = val;
+        params[num_params].def  = *val;
+        num_params++;
+    }
+}
+
+int zed_pl_kcompat_set_param(const char *name, unsigned int val)
+{
+    int i;
+
+    for (i = 0; i < num_params; i++) {
+        if (!strcmp(params[i].name, name)) {
+            *params[i].val = val;
+            return 0;
+        }
+    }
+    return -ENOENT;
+}
+
+// Back to the default parameters, time 0, nothing queued
+void zed_pl_kcompat_reset(void)
+{
+    int i;
+
+    for (i = 0; i < num_params; i++) {
+        *params[i].val = params[i].def;
+    }
+    __atomic_store_n(&zed_pl_kcompat_now_ns, 0, __ATOMIC_RELAXED);
+    num_timers = 0;
+    num_works  = 0;
+}
+
+s16 fixp_sin16(int degrees)
+{
+    return (s16)lrint(sin(degrees * M_PI / 180.0) * 0x7FFF);
+}
+
+// Timers
+void hrtimer_init(struct hrtimer *timer, int clock, enum hrtimer_mode mode)
+{
+    timer->active = false;
+    if (num_timers < ZED_PL_KCOMPAT_TIMERS) {
+        timers[num_timers++] = timer;
+    }
+}
+
+void hrtimer_start(struct hrtimer *timer, ktime_t t, enum hrtimer_mode mode)
+{
+    pthread_mutex_lock(&queue_lock);
+    timer->expires = (mode == HRTIMER_MODE_REL) ? ktime_get() + t : t;
+    timer->active  = true;
+    pthread_mutex_unlock(&queue_lock);
+}
+
+int hrtimer_cancel(struct hrtimer *timer)
+{
+    int was_active;
+
+    pthread_mutex_lock(&queue_lock);
+    was_active    = timer->active;
+    timer->active = false;
+    pthread_mutex_unlock(&queue_lock);
+    return was_active;
+}
+
+u64 hrtimer_forward_now(struct hrtimer *timer, ktime_t interval)
+{
+    u64 overruns = 0;
+
+    while (timer->expires <= ktime_get()) {
+        timer->expires += interval;
+        overruns++;
+    }
+    return overruns;
+}
+
+// Work items
+bool queue_work(struct workqueue_struct *wq, struct work_struct *work)
+{
+    bool queued = false;
+
+    pthread_mutex_lock(&queue_lock);
+    if (!work->pending && (num_works < ZED_PL_KCOMPAT_WORKS)) {
+        work->pending      = true;
+        works[num_works++] = work;
+        queued = true;
+    }
+    pthread_mutex_unlock(&queue_lock);
+    return queued;
+}
+
+void zed_pl_kcompat_run(void)
+{
+    pthread_mutex_lock(&queue_lock);
+    while (num_works) {
+        struct work_struct *work = works[0];
+        bool pending = work->pending;
+
+        memmove(works, works + 1, --num_works * sizeof(works[0]));
+        work->pending = false;
+        if (pending) {
+            pthread_mutex_unlock(&queue_lock);
+            work->func(work);
+            pthread_mutex_lock(&queue_lock);
+        }
+    }
+    pthread_mutex_unlock(&queue_lock);
+}
+
+// Advance the clock to t, firing the timers that expire on the way
+void zed_pl_kcompat_advance(u64 t)
+{
+    for (;;) {
+        struct hrtimer *next = NULL;
+        int i;
+
+        pthread_mutex_lock(&queue_lock);
+        for (i = 0; i < num_timers; i++) {
+            if (timers[i]->active && (timers[i]->expires <= (ktime_t)t) &&
+                (!next || (timers[i]->expires < next->expires))) {
+                next = timers[i];
+            }
+        }
+        if (next) {
+            if (next->expires > (ktime_t)zed_pl_kcompat_now_ns) {
+                __atomic_store_n(&zed_pl_kcompat_now_ns, next->expires, __ATOMIC_RELAXED);
+            }
+            next->active = false;
+        }
+        pthread_mutex_unlock(&queue_lock);
+        if (!next) {
+            break;
+        }
+
+        if (next->function(next) == HRTIMER_RESTART) {
+            pthread_mutex_lock(&queue_lock);
+            next->active = true;
+            pthread_mutex_unlock(&queue_lock);
+        }
+        zed_pl_kcompat_run();
+    }
+
+    if (t > zed_pl_kcompat_now_ns) {
+        __atomic_store_n(&zed_pl_kcompat_now_ns, t, __ATOMIC_RELAXED);
+    }
+    zed_pl_kcompat_run();
+}
@@ -0,0 +1,269 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Zedboard PL synthesizer renderer
+ *
+ * @author Yuhei Horibe
+ * Renders a register journal to a WAV file through the software model,
+ * and benchmarks the model.
+ *
+ * Usage: zed_pl_render [-u units] [-T tail] [-S] -o out.wav journal0 [journal1 ...]
+ *        zed_pl_render -b voices [-s seconds] [-S]
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under  the terms of the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the License, or (at your
+ * option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "zed_pl_tools.h"
+#include "../zed_pl_model.h"
+
+typedef void (*render_fn)(struct zed_pl_model *m, int16_t *out, int frames);
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-u units] [-T tail] [-S] -o out.wav journal0 [journal1 ...]\n"
+            "       %s -b voices [-s seconds] [-S]\n"
+            "  -u  number of units (default %d)\n"
+            "  -T  seconds rendered after the last write (default 1)\n"
+            "  -S  use the scalar inner loops\n"
+            "  -b  benchmark with the given number of sounding voices\n"
+            "  -s  seconds of audio rendered by the benchmark (default 10)\n",
+            prog, prog, ZED_PL_DEFAULT_UNITS);
+}
+
+static void put_le16(FILE *fp, uint16_t v)
+{
+    fputc(v & 0xFF, fp);
+    fputc(v >> 8, fp);
+}
+
+static void put_le32(FILE *fp, uint32_t v)
+{
+    put_le16(fp, v & 0xFFFF);
+    put_le16(fp, v >> 16);
+}
+
+static void wav_header(FILE *fp, unsigned int rate, uint32_t frames)
+{
+    uint32_t bytes = frames * 4;
+
+    fwrite("RIFF", 1, 4, fp);
+    put_le32(fp, 36 + bytes);
+    fwrite("WAVEfmt ", 1, 8, fp);
+    put_le32(fp, 16);
+    put_le16(fp, 1);            // PCM
+    put_le16(fp, 2);            // Stereo
+    put_le32(fp, rate);
+    put_le32(fp, rate * 4);
+    put_le16(fp, 4);
+    put_le16(fp, 16);
+    fwrite("data", 1, 4, fp);
+    put_le32(fp, bytes);
+}
+
+static void model_apply(struct zed_pl_model *m, const struct zed_pl_journal_rec *rec)
+{
+    if (rec->unit == ZED_PL_JOURNAL_COMMON) {
+        if (rec->word == ZED_PL_REG_AUDIO_CTL) {
+            zed_pl_model_write_audio_ctl(m, rec->value);
+        }
+        return ;
+    }
+    zed_pl_model_write_unit(m, rec->unit, rec->word, rec->value);
+}
+
+static int render_journal(char **files, int num_files, int num_units, double tail,
+                          const char *out, render_fn render)
+{
+    struct zed_pl_model_unit *units;
+    struct zed_pl_model m;
+    struct zed_pl_journal jn;
+    int16_t buf[2 * ZED_PL_MODEL_BLOCK];
+    uint64_t t0;
+    uint64_t done = 0;
+    uint64_t end;
+    size_t i;
+    FILE *fp;
+
+    if (zed_pl_journal_load(&jn, files, num_files, num_units) < 0) {
+        return 1;
+    }
+    if (jn.count == 0) {
+        fprintf(stderr, "No records.\n");
+        return 1;
+    }
+
+    units = calloc(num_units, sizeof(*units));
+    fp    = fopen(out, "wb");
+    if (!units || !fp) {
+        perror(out);
+        return 1;
+    }
+    zed_pl_model_init(&m, units, num_units);
+
+    // Rate switches in the middle of a journal are applied, but the WAV keeps the first rate
+    for (i = 0; i < jn.count; i++) {
+        if ((jn.recs[i].unit == ZED_PL_JOURNAL_COMMON) && (jn.recs[i].word == ZED_PL_REG_AUDIO_CTL)) {
+            zed_pl_model_write_audio_ctl(&m, jn.recs[i].value);
+            break;
+        }
+    }
+    wav_header(fp, m.rate, 0);
+
+    t0 = jn.recs[0].ts_ns;
+    for (i = 0; i <= jn.count; i++) {
+        if (i < jn.count) {
+            end = (jn.recs[i].ts_ns - t0) * m.rate / 1000000000ULL;
+        } else {
+            end = done + (uint64_t)(tail * m.rate);
+        }
+
+        while (done < end) {
+            int n = (end - done > ZED_PL_MODEL_BLOCK) ? ZED_PL_MODEL_BLOCK : (int)(end - done);
+
+            render(&m, buf, n);
+            fwrite(buf, sizeof(int16_t), 2 * n, fp);
+            done += n;
+        }
+
+        if (i < jn.count) {
+            model_apply(&m, &jn.recs[i]);
+        }
+    }
+
+    // Fix up the sizes
+    fseek(fp, 0, SEEK_SET);
+    wav_header(fp, m.rate, done);
+    fclose(fp);
+
+    printf("%zu writes, %llu frames at %u Hz\n", jn.count, (unsigned long long)done, m.rate);
+    free(units);
+    zed_pl_journal_free(&jn);
+    return 0;
+}
+
+static double cpu_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Start voices with a spread of pitches, wave types and envelopes
+static void bench_setup(struct zed_pl_model *m, int voices)
+{
+    int i;
+
+    for (i = 0; i < voices; i++) {
+        zed_pl_model_write_unit(m, i, ZED_PL_REG_FREQ, 110 + 37 * i);
+        zed_pl_model_write_unit(m, i, ZED_PL_REG_VCA_EG, 0x40204008 + (i & 0xF));
+        zed_pl_model_write_unit(m, i, ZED_PL_REG_AMP, ((64 + i) << 16) | (64 - (i & 0x3F)));
+        zed_pl_model_write_unit(m, i, ZED_PL_REG_CTL, 0x4 | (i % 3));
+    }
+}
+
+static int bench(int voices, double seconds, render_fn render)
+{
+    struct zed_pl_model_unit *units = calloc(2 * voices, sizeof(*units));
+    struct zed_pl_model m;
+    struct zed_pl_model ref;
+    int16_t buf[2 * ZED_PL_MODEL_BLOCK];
+    int16_t chk[2 * ZED_PL_MODEL_BLOCK];
+    long frames;
+    long i;
+    double t;
+
+    if (!units) {
+        return 1;
+    }
+
+    // Check the vector path against the scalar path first (with a release in between)
+    zed_pl_model_init(&m, units, voices);
+    zed_pl_model_init(&ref, units + voices, voices);
+    bench_setup(&m, voices);
+    bench_setup(&ref, voices);
+    for (i = 0; i < 2000; i++) {
+        if (i == 1000) {
+            zed_pl_model_write_unit(&m, 0, ZED_PL_REG_CTL, 0);
+            zed_pl_model_write_unit(&ref, 0, ZED_PL_REG_CTL, 0);
+        }
+        zed_pl_model_render(&m, buf, ZED_PL_MODEL_BLOCK);
+        zed_pl_model_render_scalar(&ref, chk, ZED_PL_MODEL_BLOCK);
+        if (memcmp(buf, chk, sizeof(buf))) {
+            fprintf(stderr, "Vector and scalar output differ at block %ld\n", i);
+            return 2;
+        }
+    }
+
+    zed_pl_model_init(&m, units, voices);
+    bench_setup(&m, voices);
+    frames = (long)(seconds * m.rate);
+
+    t = cpu_seconds();
+    for (i = 0; i < frames; i += ZED_PL_MODEL_BLOCK) {
+        render(&m, buf, ZED_PL_MODEL_BLOCK);
+    }
+    t = cpu_seconds() - t;
+
+    printf("voices        %d\n", voices);
+    printf("audio         %.1f s at %u Hz\n", seconds, m.rate);
+    printf("cpu           %.3f s\n", t);
+    printf("ns/voice/frame %.2f\n", t * 1e9 / ((double)frames * voices));
+    printf("voices/core   %.0f (realtime)\n", voices * seconds / t);
+    free(units);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    render_fn render = zed_pl_model_render;
+    const char *out = NULL;
+    double seconds = 10.0;
+    double tail = 1.0;
+    int num_units = ZED_PL_DEFAULT_UNITS;
+    int voices = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "u:T:So:b:s:h")) != -1) {
+        switch (opt) {
+        case 'u':
+            num_units = atoi(optarg);
+            break;
+        case 'T':
+            tail = atof(optarg);
+            break;
+        case 'S':
+            render = zed_pl_model_render_scalar;
+            break;
+        case 'o':
+            out = optarg;
+            break;
+        case 'b':
+            voices = atoi(optarg);
+            break;
+        case 's':
+            seconds = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (voices > 0) {
+        return bench(voices, seconds, render);
+    }
+    if (!out || (optind >= argc) || (num_units <= 0) || (num_units >= ZED_PL_JOURNAL_COMMON)) {
+        usage(argv[0]);
+        return 1;
+    }
+    return render_journal(&argv[optind], argc - optind, num_units, tail, out, render);
+}
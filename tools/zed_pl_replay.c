@@ -0,0 +1,223 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Zedboard PL synthesizer register journal replay
+ *
+ * @author Yuhei Horibe
+ * Feeds a captured register journal into a simulated register window,
+ * so that driver behaviour can be reproduced without the board.
+ *
+ * Usage: zed_pl_replay [-u units] [-v] [-t] [-d] [-o window.bin] journal0 [journal1 ...]
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under  the terms of the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the License, or (at your
+ * option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "zed_pl_tools.h"
+
+static const char *zed_pl_word_name[] = { "freq", "ctl", "vca_eg", "amp" };
+static const char *zed_pl_common_name[] = { "audio_ctl", "unit_free" };
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-u units] [-v] [-t] [-d] [-o window.bin] journal0 [journal1 ...]\n"
+            "  -u  number of units (default %d)\n"
+            "  -v  print every write\n"
+            "  -t  replay with the recorded timing\n"
+            "  -d  dump the register window at the end\n"
+            "  -o  write the final register window to a file (for diffs)\n",
+            prog, ZED_PL_DEFAULT_UNITS);
+}
+
+static void print_write(const struct zed_pl_journal_rec *rec, uint64_t t0)
+{
+    double t = (rec->ts_ns - t0) / 1e6;
+    uint32_t v = rec->value;
+
+    if (rec->unit == ZED_PL_JOURNAL_COMMON) {
+        printf("%12.3f ms  common %-9s 0x%08x\n", t, zed_pl_common_name[rec->word ? 1 : 0], v);
+        return ;
+    }
+
+    printf("%12.3f ms  unit %3u %-9s 0x%08x", t, rec->unit, zed_pl_word_name[rec->word], v);
+    switch (rec->word) {
+    case ZED_PL_REG_FREQ:
+        printf("  freq %u\n", ZED_PL_FREQ(v));
+        break;
+    case ZED_PL_REG_CTL:
+        printf("  wave %u trigger %u\n", ZED_PL_WAVE_TYPE(v), ZED_PL_TRIGGER(v));
+        break;
+    case ZED_PL_REG_VCA_EG:
+        printf("  a %u d %u s %u r %u\n", ZED_PL_ATTACK(v), ZED_PL_DECAY(v), ZED_PL_SUSTAIN(v), ZED_PL_RELEASE(v));
+        break;
+    default:
+        printf("  l %u r %u\n", ZED_PL_AMP_L(v), ZED_PL_AMP_R(v));
+        break;
+    }
+}
+
+// Writes the hardware would misinterpret
+static int check_write(const struct zed_pl_window *win, const struct zed_pl_journal_rec *rec)
+{
+    const uint32_t *unit;
+
+    if (rec->unit == ZED_PL_JOURNAL_COMMON) {
+        return rec->word >= ZED_PL_REG_UNIT_FREE;   // Read only
+    }
+
+    unit = &win->regs[rec->unit * ZED_PL_UNIT_WORDS];
+    switch (rec->word) {
+    case ZED_PL_REG_FREQ:
+        return (rec->value >> 16) != 0;
+    case ZED_PL_REG_CTL:
+        if ((rec->value >> 3) || (ZED_PL_WAVE_TYPE(rec->value) == 3)) {
+            return 1;
+        }
+        // Triggered without a pitch
+        return ZED_PL_TRIGGER(rec->value) && (ZED_PL_FREQ(unit[ZED_PL_REG_FREQ]) == 0);
+    default:
+        return 0;
+    }
+}
+
+static void sleep_until(const struct timespec *start, uint64_t offset_ns)
+{
+    struct timespec ts = *start;
+
+    ts.tv_sec  += offset_ns / 1000000000ULL;
+    ts.tv_nsec += offset_ns % 1000000000ULL;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+int main(int argc, char **argv)
+{
+    struct zed_pl_journal jn;
+    struct zed_pl_window  win;
+    struct timespec start;
+    const char *out = NULL;
+    uint64_t per_word[ZED_PL_UNIT_WORDS] = { 0 };
+    uint64_t common = 0;
+    uint64_t bad = 0;
+    uint64_t t0;
+    uint64_t span;
+    int num_units = ZED_PL_DEFAULT_UNITS;
+    int verbose = 0;
+    int timed = 0;
+    int dump = 0;
+    size_t i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "u:vtdo:h")) != -1) {
+        switch (opt) {
+        case 'u':
+            num_units = atoi(optarg);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 't':
+            timed = 1;
+            break;
+        case 'd':
+            dump = 1;
+            break;
+        case 'o':
+            out = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if ((optind >= argc) || (num_units <= 0) || (num_units >= ZED_PL_JOURNAL_COMMON)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (zed_pl_journal_load(&jn, &argv[optind], argc - optind, num_units) < 0) {
+        return 1;
+    }
+    if (zed_pl_window_init(&win, num_units) < 0) {
+        return 1;
+    }
+    if (jn.count == 0) {
+        fprintf(stderr, "No records.\n");
+        return 1;
+    }
+
+    t0 = jn.recs[0].ts_ns;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < jn.count; i++) {
+        const struct zed_pl_journal_rec *rec = &jn.recs[i];
+
+        if (timed) {
+            sleep_until(&start, rec->ts_ns - t0);
+        }
+        if (verbose) {
+            print_write(rec, t0);
+        }
+        if (check_write(&win, rec)) {
+            bad++;
+            if (verbose) {
+                printf("  ^ suspicious write\n");
+            }
+        }
+        zed_pl_window_apply(&win, rec);
+
+        if (rec->unit == ZED_PL_JOURNAL_COMMON) {
+            common++;
+        } else {
+            per_word[rec->word]++;
+        }
+    }
+    span = jn.recs[jn.count - 1].ts_ns - t0;
+
+    printf("records       %zu (skipped %zu)\n", jn.count, jn.skipped);
+    printf("span          %.3f ms\n", span / 1e6);
+    if (span) {
+        printf("writes/s      %.0f\n", jn.count * 1e9 / span);
+    }
+    printf("freq/ctl/eg/amp %llu/%llu/%llu/%llu, common %llu\n",
+           (unsigned long long)per_word[0], (unsigned long long)per_word[1],
+           (unsigned long long)per_word[2], (unsigned long long)per_word[3],
+           (unsigned long long)common);
+    printf("suspicious    %llu\n", (unsigned long long)bad);
+
+    if (dump) {
+        int u;
+
+        for (u = 0; u < num_units; u++) {
+            const uint32_t *r = &win.regs[u * ZED_PL_UNIT_WORDS];
+
+            printf("unit %3d  %08x %08x %08x %08x\n", u, r[0], r[1], r[2], r[3]);
+        }
+        printf("common    %08x %08x\n", win.regs[num_units * ZED_PL_UNIT_WORDS],
+               win.regs[num_units * ZED_PL_UNIT_WORDS + 1]);
+    }
+
+    if (out) {
+        FILE *fp = fopen(out, "wb");
+        size_t words = num_units * ZED_PL_UNIT_WORDS + ZED_PL_COMMON_WORDS(num_units);
+
+        if (!fp || (fwrite(win.regs, sizeof(uint32_t), words, fp) != words)) {
+            perror(out);
+            return 1;
+        }
+        fclose(fp);
+    }
+
+    zed_pl_window_free(&win);
+    zed_pl_journal_free(&jn);
+    return bad ? 2 : 0;
+}
@@ -0,0 +1,69 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Zedboard PL synthesizer userspace tools
+ *
+ * @author Yuhei Horibe
+ * Register window layout and journal loading, shared by the tools
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under  the terms of the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the License, or (at your
+ * option) any later version.
+ */
+
+#ifndef ZED_PL_TOOLS_H
+#define ZED_PL_TOOLS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "../zed_pl_journal.h"
+
+// Register window (same layout as the PL block)
+// Units, then audio_ctl and the free bitmap (32 units per word)
+#define ZED_PL_DEFAULT_UNITS     32
+#define ZED_PL_UNIT_WORDS        4
+#define ZED_PL_COMMON_WORDS(n)   (1 + ((n) + 31) / 32)
+
+enum zed_pl_unit_word {
+    ZED_PL_REG_FREQ   = 0,
+    ZED_PL_REG_CTL    = 1,
+    ZED_PL_REG_VCA_EG = 2,
+    ZED_PL_REG_AMP    = 3,
+};
+
+enum zed_pl_common_word {
+    ZED_PL_REG_AUDIO_CTL = 0,
+    ZED_PL_REG_UNIT_FREE = 1,
+};
+
+// Field access
+#define ZED_PL_FREQ(v)        ((v) & 0xFFFF)
+#define ZED_PL_WAVE_TYPE(v)   ((v) & 0x3)
+#define ZED_PL_TRIGGER(v)     (((v) >> 2) & 0x1)
+#define ZED_PL_ATTACK(v)      ((v) & 0xFF)
+#define ZED_PL_DECAY(v)       (((v) >> 8) & 0xFF)
+#define ZED_PL_SUSTAIN(v)     (((v) >> 16) & 0xFF)
+#define ZED_PL_RELEASE(v)     (((v) >> 24) & 0xFF)
+#define ZED_PL_AMP_L(v)       ((v) & 0xFFFF)
+#define ZED_PL_AMP_R(v)       ((v) >> 16)
+
+struct zed_pl_window {
+    int       num_units;
+    uint32_t *regs;     // num_units * ZED_PL_UNIT_WORDS + ZED_PL_COMMON_WORDS(num_units)
+};
+
+struct zed_pl_journal {
+    struct zed_pl_journal_rec *recs;
+    size_t                     count;
+    size_t                     skipped;   // Invalid or unused slots
+};
+
+int  zed_pl_window_init(struct zed_pl_window *win, int num_units);
+void zed_pl_window_free(struct zed_pl_window *win);
+int  zed_pl_window_apply(struct zed_pl_window *win, const struct zed_pl_journal_rec *rec);
+
+// Load and merge journal files (one per CPU), sorted by time
+int  zed_pl_journal_load(struct zed_pl_journal *jn, char **files, int num_files, int num_units);
+void zed_pl_journal_free(struct zed_pl_journal *jn);
+
+#endif
@@ -0,0 +1,232 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Zedboard PL synthesizer ALSA controls
+ *
+ * @author Yuhei Horibe
+ * Mixer controls of the synthesizer voice allocator,
+ * so that they can be tuned live with amixer
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under  the terms of the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the License, or (at your
+ * option) any later version.
+ */
+
+#include <linux/module.h>
+#include <sound/control.h>
+#include "zed_pl_synth.h"
+
+// Control IDs (private_value)
+enum zed_pl_ctl_id {
+    ZED_PL_CTL_VOICE_MAX = 0,
+    ZED_PL_CTL_VOICE_RESERVE,
+    ZED_PL_CTL_VOICE_PRIORITY,
+    ZED_PL_CTL_VOICE_ACTIVE,
+    ZED_PL_CTL_VOICE_STEALS,
+    ZED_PL_CTL_VOICE_DROPPED,
+    ZED_PL_CTL_VOICE_STACKED,
+    ZED_PL_CTL_VOICE_DEGRADED,
+};
+
+static struct zed_pl_card_data *zed_pl_ctl_prv(struct snd_kcontrol *kcontrol)
+{
+    struct snd_soc_card *card = snd_kcontrol_chip(kcontrol);
+
+    return snd_soc_card_get_drvdata(card);
+}
+
+// Number of parts (MIDI channels of all sequencer ports)
+static int zed_pl_ctl_parts(struct zed_pl_card_data *prv)
+{
+    return ZED_PL_SYNTH_MIDI_CH * prv->num_ports;
+}
+
+// Per-channel controls (one element per part)
+static int zed_pl_ctl_channel_info(struct snd_kcontrol *kcontrol,
+                                   struct snd_ctl_elem_info *uinfo)
+{
+    struct zed_pl_card_data *prv = zed_pl_ctl_prv(kcontrol);
+
+    uinfo->type              = SNDRV_CTL_ELEM_TYPE_INTEGER;
+    uinfo->count             = zed_pl_ctl_parts(prv);
+    uinfo->value.integer.min = 0;
+
+    switch (kcontrol->private_value) {
+    case ZED_PL_CTL_VOICE_PRIORITY:
+        uinfo->value.integer.max = ZED_PL_PRIORITY_MAX;
+        break;
+    case ZED_PL_CTL_VOICE_RESERVE:
+        uinfo->value.integer.max = zed_pl_synth_kernel_units(prv);
+        break;
+    default:
+        uinfo->value.integer.max = prv->num_voices;
+        break;
+    }
+    return 0;
+}
+
+static int zed_pl_ctl_channel_get(struct snd_kcontrol *kcontrol,
+                                  struct snd_ctl_elem_value *ucontrol)
+{
+    struct zed_pl_card_data *prv = zed_pl_ctl_prv(kcontrol);
+    struct zed_pl_voice_policy *pol = &prv->policy;
+    int i;
+
+    for (i = 0; i < zed_pl_ctl_parts(prv); i++) {
+        long *val = &ucontrol->value.integer.value[i];
+
+        switch (kcontrol->private_value) {
+        case ZED_PL_CTL_VOICE_MAX:
+            *val = READ_ONCE(pol->max_voices[i]);
+            break;
+        case ZED_PL_CTL_VOICE_RESERVE:
+            *val = READ_ONCE(pol->reserved[i]);
+            break;
+        case ZED_PL_CTL_VOICE_PRIORITY:
+            *val = READ_ONCE(pol->priority[i]);
+            break;
+        case ZED_PL_CTL_VOICE_ACTIVE:
+            *val = atomic_read(&pol->active[i]);
+            break;
+        default:
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+static int zed_pl_ctl_channel_put(struct snd_kcontrol *kcontrol,
+                                  struct snd_ctl_elem_value *ucontrol)
+{
+    struct zed_pl_card_data *prv = zed_pl_ctl_prv(kcontrol);
+    struct zed_pl_voice_policy *pol = &prv->policy;
+    uint16_t *field;
+    long max;
+    long total = 0;
+    int changed = 0;
+    int i;
+
+    switch (kcontrol->private_value) {
+    case ZED_PL_CTL_VOICE_MAX:
+        field = pol->max_voices;
+        max   = prv->num_voices;
+        break;
+    case ZED_PL_CTL_VOICE_RESERVE:
+        field = pol->reserved;
+        max   = zed_pl_synth_kernel_units(prv);
+        break;
+    case ZED_PL_CTL_VOICE_PRIORITY:
+        field = pol->priority;
+        max   = ZED_PL_PRIORITY_MAX;
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    for (i = 0; i < zed_pl_ctl_parts(prv); i++) {
+        long val = ucontrol->value.integer.value[i];
+
+        if ((val < 0) || (val > max)) {
+            return -EINVAL;
+        }
+        total += val;
+    }
+
+    // Reservations can't exceed the number of units (not counting UIO units)
+    if ((kcontrol->private_value == ZED_PL_CTL_VOICE_RESERVE) &&
+        (total > zed_pl_synth_kernel_units(prv))) {
+        return -EINVAL;
+    }
+
+    // The allocator reads these without locks; each entry is updated atomically
+    mutex_lock(&prv->access_mutex);
+    for (i = 0; i < zed_pl_ctl_parts(prv); i++) {
+        uint16_t val = ucontrol->value.integer.value[i];
+
+        if (field[i] != val) {
+            WRITE_ONCE(field[i], val);
+            changed = 1;
+        }
+    }
+    mutex_unlock(&prv->access_mutex);
+    return changed;
+}
+
+// Allocator statistics
+static int zed_pl_ctl_stat_info(struct snd_kcontrol *kcontrol,
+                                struct snd_ctl_elem_info *uinfo)
+{
+    uinfo->type              = SNDRV_CTL_ELEM_TYPE_INTEGER;
+    uinfo->count             = 1;
+    uinfo->value.integer.min = 0;
+    uinfo->value.integer.max = INT_MAX;
+    return 0;
+}
+
+static int zed_pl_ctl_stat_get(struct snd_kcontrol *kcontrol,
+                               struct snd_ctl_elem_value *ucontrol)
+{
+    struct zed_pl_card_data *prv = zed_pl_ctl_prv(kcontrol);
+
+    switch (kcontrol->private_value) {
+    case ZED_PL_CTL_VOICE_STEALS:
+        ucontrol->value.integer.value[0] = atomic_read(&prv->policy.steals);
+        break;
+    case ZED_PL_CTL_VOICE_DROPPED:
+        ucontrol->value.integer.value[0] = atomic_read(&prv->policy.dropped);
+        break;
+    case ZED_PL_CTL_VOICE_STACKED:
+        ucontrol->value.integer.value[0] = atomic_read(&prv->policy.stacked);
+        break;
+    case ZED_PL_CTL_VOICE_DEGRADED:
+        ucontrol->value.integer.value[0] = atomic_read(&prv->policy.degraded);
+        break;
+    default:
+        return -EINVAL;
+    }
+    return 0;
+}
+
+#define ZED_PL_CTL_CHANNEL(xname, id) { \
+    .iface         = SNDRV_CTL_ELEM_IFACE_MIXER, \
+    .name          = xname, \
+    .info          = zed_pl_ctl_channel_info, \
+    .get           = zed_pl_ctl_channel_get, \
+    .put           = zed_pl_ctl_channel_put, \
+    .private_value = id, \
+}
+
+#define ZED_PL_CTL_CHANNEL_RO(xname, id) { \
+    .iface         = SNDRV_CTL_ELEM_IFACE_MIXER, \
+    .name          = xname, \
+    .access        = SNDRV_CTL_ELEM_ACCESS_READ | SNDRV_CTL_ELEM_ACCESS_VOLATILE, \
+    .info          = zed_pl_ctl_channel_info, \
+    .get           = zed_pl_ctl_channel_get, \
+    .private_value = id, \
+}
+
+#define ZED_PL_CTL_STAT(xname, id) { \
+    .iface         = SNDRV_CTL_ELEM_IFACE_MIXER, \
+    .name          = xname, \
+    .access        = SNDRV_CTL_ELEM_ACCESS_READ | SNDRV_CTL_ELEM_ACCESS_VOLATILE, \
+    .info          = zed_pl_ctl_stat_info, \
+    .get           = zed_pl_ctl_stat_get, \
+    .private_value = id, \
+}
+
+static const struct snd_kcontrol_new zed_pl_synth_controls[] = {
+    ZED_PL_CTL_CHANNEL("Synth Voice Max", ZED_PL_CTL_VOICE_MAX),
+    ZED_PL_CTL_CHANNEL("Synth Voice Reserve", ZED_PL_CTL_VOICE_RESERVE),
+    ZED_PL_CTL_CHANNEL("Synth Voice Priority", ZED_PL_CTL_VOICE_PRIORITY),
+    ZED_PL_CTL_CHANNEL_RO("Synth Voice Active", ZED_PL_CTL_VOICE_ACTIVE),
+    ZED_PL_CTL_STAT("Synth Voice Steals", ZED_PL_CTL_VOICE_STEALS),
+    ZED_PL_CTL_STAT("Synth Voice Dropped", ZED_PL_CTL_VOICE_DROPPED),
+    ZED_PL_CTL_STAT("Synth Voice Stacked", ZED_PL_CTL_VOICE_STACKED),
+    ZED_PL_CTL_STAT("Synth Voice Degraded", ZED_PL_CTL_VOICE_DEGRADED),
+};
+
+int zed_pl_synth_add_controls(struct zed_pl_card_data *prv)
+{
+    return snd_soc_add_card_controls(prv->card, zed_pl_synth_controls,
+                                     ARRAY_SIZE(zed_pl_synth_controls));
+}
@@ -0,0 +1,112 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Zedboard PL synthesizer register write journal
+ *
+ * @author Yuhei Horibe
+ * Every MMIO write to the synth block is recorded into per-CPU relay
+ * buffers in debugfs (<debugfs>/<device>/journal<cpu>).
+ * The buffers run in flight recorder mode, so the latest writes are kept.
+ * Records are timestamped; tools/zed_pl_replay merges the CPUs back in order.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under  the terms of the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the License, or (at your
+ * option) any later version.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/debugfs.h>
+#include <linux/relay.h>
+#include <linux/ktime.h>
+#include "zed_pl_synth.h"
+#include "zed_pl_journal.h"
+
+// Journal size per CPU in KiB (0: disabled)
+static unsigned int journal_kb;
+module_param(journal_kb, uint, 0444);
+MODULE_PARM_DESC(journal_kb, "Register write journal size per CPU in KiB (0: disabled)");
+
+#define ZED_PL_JOURNAL_SUBBUF_SIZE 4096
+
+static struct dentry *zed_pl_journal_create_buf_file(const char *filename, struct dentry *parent,
+                                                     umode_t mode, struct rchan_buf *buf, int *is_global)
+{
+    return debugfs_create_file(filename, mode, parent, buf, &relay_file_operations);
+}
+
+static int zed_pl_journal_remove_buf_file(struct dentry *dentry)
+{
+    debugfs_remove(dentry);
+    return 0;
+}
+
+// Flight recorder: always switch to the next sub-buffer, overwriting the oldest
+static int zed_pl_journal_subbuf_start(struct rchan_buf *buf, void *subbuf,
+                                       void *prev_subbuf, size_t prev_padding)
+{
+    return 1;
+}
+
+static struct rchan_callbacks zed_pl_journal_callbacks = {
+    .subbuf_start       = zed_pl_journal_subbuf_start,
+    .create_buf_file    = zed_pl_journal_create_buf_file,
+    .remove_buf_file    = zed_pl_journal_remove_buf_file,
+};
+
+void __zed_pl_journal_record(struct zed_pl_card_data *prv, int word_off, uint32_t val)
+{
+    struct zed_pl_journal_rec rec;
+
+    rec.ts_ns = ktime_get_ns();
+    rec.value = val;
+    rec.magic = ZED_PL_JOURNAL_MAGIC;
+    if (word_off < ZED_PL_COMMON_REG_OFF(prv->num_units)) {
+        rec.unit = word_off / ZED_PL_UNIT_REG_WORDS;
+        rec.word = word_off % ZED_PL_UNIT_REG_WORDS;
+    } else {
+        rec.unit = ZED_PL_JOURNAL_COMMON;
+        rec.word = word_off - ZED_PL_COMMON_REG_OFF(prv->num_units);
+    }
+
+    // Per-CPU buffer, relay_write() only disables local interrupts
+    relay_write(prv->journal, &rec, sizeof(rec));
+}
+
+// Journal failures are not fatal, the synth works without it
+void zed_pl_journal_init(struct zed_pl_card_data *prv)
+{
+    size_t n_subbufs;
+
+    if (!journal_kb) {
+        return ;
+    }
+
+    prv->debugfs = debugfs_create_dir(dev_name(prv->dev), NULL);
+    if (IS_ERR_OR_NULL(prv->debugfs)) {
+        prv->debugfs = NULL;
+        dev_warn(prv->dev, "No debugfs, register journal disabled.\n");
+        return ;
+    }
+
+    n_subbufs = max_t(size_t, 2, (journal_kb * 1024) / ZED_PL_JOURNAL_SUBBUF_SIZE);
+    prv->journal = relay_open("journal", prv->debugfs, ZED_PL_JOURNAL_SUBBUF_SIZE,
+                              n_subbufs, &zed_pl_journal_callbacks, prv);
+    if (!prv->journal) {
+        debugfs_remove_recursive(prv->debugfs);
+        prv->debugfs = NULL;
+        dev_err(prv->dev, "Failed to open register journal.\n");
+        return ;
+    }
+    dev_info(prv->dev, "Register journal enabled (%u KiB per CPU).\n", journal_kb);
+}
+
+void zed_pl_journal_release(struct zed_pl_card_data *prv)
+{
+    if (prv->journal) {
+        relay_close(prv->journal);
+        prv->journal = NULL;
+    }
+    debugfs_remove_recursive(prv->debugfs);
+    prv->debugfs = NULL;
+}
@@ -0,0 +1,35 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Zedboard PL synthesizer register write journal
+ *
+ * @author Yuhei Horibe
+ * Record format of the register write journal.
+ * Shared by the driver and the userspace tools.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under  the terms of the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the License, or (at your
+ * option) any later version.
+ */
+
+#ifndef ZED_PL_JOURNAL_H
+#define ZED_PL_JOURNAL_H
+
+#include <linux/types.h>
+
+// Unit number of the common registers (audio_ctl, unit_free_reg)
+#define ZED_PL_JOURNAL_COMMON 0xFFFF
+
+// Marks a valid record (relay buffers aren't cleared)
+#define ZED_PL_JOURNAL_MAGIC  0xA5
+
+// One MMIO register write
+struct zed_pl_journal_rec {
+    __u64 ts_ns;    // CLOCK_MONOTONIC
+    __u32 value;
+    __u16 unit;     // Unit number or ZED_PL_JOURNAL_COMMON
+    __u8  word;     // Word offset in the unit (or in the common registers)
+    __u8  magic;
+};
+
+#endif
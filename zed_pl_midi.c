@@ -13,10 +13,77 @@
 #include "zed_pl_synth.h"
 #include <linux/types.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/io.h>
+#include <linux/bitops.h>
+#include <linux/spinlock.h>
+#include <linux/math64.h>
+#include <linux/fixp-arith.h>
 #include <sound/asoundef.h>
 
 #define ZED_PL_NOTE_MAX 127
 
+// Allocations between reads of the hardware free bitmap
+static unsigned int busy_verify = 64;
+module_param(busy_verify, uint, 0644);
+MODULE_PARM_DESC(busy_verify, "Read unit_free_reg every N allocations, use the predicted release otherwise (0: read on every allocation)");
+
+// Summed voice level (amp_l or amp_r) above which all voices are scaled down
+static unsigned int headroom;
+module_param(headroom, uint, 0644);
+MODULE_PARM_DESC(headroom, "Limit of the summed amp_l/amp_r of sounding voices, they are scaled down above it (0: off)");
+
+// Universal sysex device ID (tuning messages for other devices are ignored)
+static unsigned int sysex_dev_id;
+module_param(sysex_dev_id, uint, 0644);
+MODULE_PARM_DESC(sysex_dev_id, "Device ID of universal sysex messages (0-126, 127 is accepted by every device)");
+
+// NRPN map (driver specific)
+// NRPN MSB selects the synth, LSB selects the parameter.
+// Data entry MSB (and LSB bit 6 for 8-bit fields) carries the value.
+#define ZED_PL_NRPN_MSB 0x20
+
+enum zed_pl_nrpn_param {
+    ZED_PL_NRPN_WAVE_TYPE   = 0x00,
+    ZED_PL_NRPN_VCA_ATTACK  = 0x01,
+    ZED_PL_NRPN_VCA_DECAY   = 0x02,
+    ZED_PL_NRPN_VCA_SUSTAIN = 0x03,
+    ZED_PL_NRPN_VCA_RELEASE = 0x04,
+    ZED_PL_NRPN_LFO_RATE    = 0x05, // 0.1 Hz
+    ZED_PL_NRPN_VIB_DEPTH   = 0x06, // cents at full modulation
+    ZED_PL_NRPN_TREM_DEPTH  = 0x07, // 127: full depth
+    ZED_PL_NRPN_UNISON      = 0x08, // Units per note (1 - ZED_PL_UNISON_MAX)
+    ZED_PL_NRPN_UNI_DETUNE  = 0x09, // cents between the outer units of a stack
+    ZED_PL_NRPN_UNI_SPREAD  = 0x0A, // pan between the outer units of a stack
+    ZED_PL_NRPN_LIVE_UPDATE = 0x10, // >= 64: edits also reach sounding voices
+};
+
+// RPN (registered parameters)
+#define ZED_PL_RPN_BEND_RANGE   0x0000
+#define ZED_PL_RPN_FINE_TUNE    0x0001
+#define ZED_PL_RPN_COARSE_TUNE  0x0002
+#define ZED_PL_RPN_TUNING_PROG  0x0003  // MIDI Tuning Standard program select
+#define ZED_PL_RPN_MPE_CONFIG   0x0006  // MPE configuration message (manager channel)
+
+// Scene switch controller (ZED_PL_CC_SCENE)
+// Value: scene number, bit 6 set cuts the sounding voices instead of letting them ring out
+#define ZED_PL_SCENE_MASK       0x3F
+#define ZED_PL_SCENE_CUT        0x40
+#define ZED_PL_NUM_SCENES       8
+
+// MPE pitch bend sensitivity defaults (cents)
+#define ZED_PL_MPE_MEMBER_BEND  4800
+#define ZED_PL_MPE_MANAGER_BEND 200
+
+// Unity gain for amplitude scaling (Q10)
+#define ZED_PL_GAIN_ONE 1024
+
+// Lowest gain the limiter applies
+#define ZED_PL_LIMITER_MIN_GAIN (ZED_PL_GAIN_ONE / 64)
+
+// Largest unison stack (units per note)
+#define ZED_PL_UNISON_MAX 4
+
 enum zed_pl_wave_type {
     ZED_PL_WAVE_SQUARE = 0,
     ZED_PL_WAVE_SAW    = 1,
@@ -39,7 +106,27 @@ static const int note_freq[] = {
     7902, 8372, 8870, 9397, 9956, 10548, 11175, 11840, 12544
 };
 
+// MIDI Tuning Standard
+// A tuning program has the pitch of every note (semitones with a 14 bit
+// fraction) and the frequency it gives, so that a note on stays one lookup.
+// Programs are replaced whole and published with RCU: the event path never
+// waits for a retune.
+#define ZED_PL_NUM_TUNINGS      128
+#define ZED_PL_TUNING_FRAC_BITS 14
+#define ZED_PL_TUNING_ONE       (1 << ZED_PL_TUNING_FRAC_BITS)
+
+struct zed_pl_tuning {
+    struct rcu_head rcu;
+    int32_t         pitch[ARRAY_SIZE(note_freq)];
+    uint16_t        freq[ARRAY_SIZE(note_freq)];
+};
+
+// NULL: equal temperament (note_freq)
+static struct zed_pl_tuning __rcu *zed_tunings[ZED_PL_NUM_TUNINGS];
+static DEFINE_SPINLOCK(zed_tuning_lock);
+
 // Preset tone parameters
+// Packed register words: loading a program copies two words to the channel template
 struct zed_pl_params {
     uint32_t wave_type;
     union {
@@ -51,10 +138,11 @@ struct zed_pl_params {
         } bit;
         uint32_t vca_eg_all;
     } vca_eg;
+    uint8_t  unison;    // Units per note (0: one)
 };
 
 // Preset parameters
-static struct zed_pl_params zed_pl_synth_preset_tones[] = {
+static const struct zed_pl_params zed_pl_synth_preset_tones[] = {
     { 0, {{ 0x80, 0x02, 0x08, 0x02 }}, }, // 001: Acoustic grand
     { 1, {{ 0x80, 0x02, 0x08, 0x02 }}, }, // 002: Bright acoustic
     { 2, {{ 0x80, 0x02, 0x40, 0x02 }}, }, // 003: Electric grand
@@ -111,8 +199,8 @@ static struct zed_pl_params zed_pl_synth_preset_tones[] = {
 
     { 1, {{ 0x08, 0x01, 0x80, 0x01 }}, }, // 049: String Ensemble 1
     { 1, {{ 0x08, 0x01, 0x80, 0x01 }}, }, // 050: String Ensemble 2
-    { 1, {{ 0x04, 0x01, 0x80, 0x01 }}, }, // 051: SynthStrings 1
-    { 1, {{ 0x08, 0x01, 0x80, 0x02 }}, }, // 052: SynthStrings 2
+    { 1, {{ 0x04, 0x01, 0x80, 0x01 }}, 3 }, // 051: SynthStrings 1
+    { 1, {{ 0x08, 0x01, 0x80, 0x02 }}, 2 }, // 052: SynthStrings 2
     { 1, {{ 0x20, 0x01, 0x70, 0x02 }}, }, // 053: Choir Aahs
     { 1, {{ 0x20, 0x01, 0x70, 0x02 }}, }, // 054: Voice Oohs
     { 1, {{ 0x20, 0x01, 0x70, 0x02 }}, }, // 055: Synth Voice
@@ -124,8 +212,8 @@ static struct zed_pl_params zed_pl_synth_preset_tones[] = {
     { 1, {{ 0xA0, 0x20, 0x08, 0x10 }}, }, // 060: Muted Trumpet
     { 1, {{ 0xA0, 0x20, 0x40, 0x10 }}, }, // 061: French Horn
     { 1, {{ 0xA0, 0x20, 0x40, 0x10 }}, }, // 062: Brass Section
-    { 1, {{ 0xA0, 0x20, 0x40, 0x10 }}, }, // 063: SynthBrass 1
-    { 1, {{ 0xA0, 0x20, 0x40, 0x10 }}, }, // 064: SynthBrass 2
+    { 1, {{ 0xA0, 0x20, 0x40, 0x10 }}, 2 }, // 063: SynthBrass 1
+    { 1, {{ 0xA0, 0x20, 0x40, 0x10 }}, 2 }, // 064: SynthBrass 2
 
     { 1, {{ 0xA0, 0x40, 0x20, 0x08 }}, }, // 065: Soprano Sax
     { 1, {{ 0xA0, 0x40, 0x20, 0x08 }}, }, // 066: Alto Sax
@@ -146,22 +234,22 @@ static struct zed_pl_params zed_pl_synth_preset_tones[] = {
     { 2, {{ 0x40, 0x20, 0x40, 0x08 }}, }, // 080: Ocarina
 
     { 0, {{ 0x80, 0x20, 0x20, 0x08 }}, }, // 081: Square Wave
-    { 1, {{ 0x80, 0x10, 0x40, 0x08 }}, }, // 082: Saw Wave
+    { 1, {{ 0x80, 0x10, 0x40, 0x08 }}, 3 }, // 082: Saw Wave
     { 2, {{ 0x80, 0x04, 0x80, 0x08 }}, }, // 083: Syn. Calliope
     { 0, {{ 0x80, 0x20, 0x40, 0x08 }}, }, // 084: Chiffer Lead
     { 0, {{ 0x80, 0x20, 0x40, 0x08 }}, }, // 085: Charang
     { 2, {{ 0x80, 0x20, 0x40, 0x08 }}, }, // 086: Solo Vox
-    { 1, {{ 0x80, 0x20, 0x40, 0x08 }}, }, // 087: 5th Saw Wave
-    { 1, {{ 0x80, 0x20, 0x40, 0x08 }}, }, // 088: Bass& Lead
+    { 1, {{ 0x80, 0x20, 0x40, 0x08 }}, 2 }, // 087: 5th Saw Wave
+    { 1, {{ 0x80, 0x20, 0x40, 0x08 }}, 2 }, // 088: Bass& Lead
 
     { 2, {{ 0x02, 0x02, 0x40, 0x02 }}, }, // 089: Fantasia
-    { 1, {{ 0x02, 0x02, 0x40, 0x02 }}, }, // 090: Warm Pad
-    { 2, {{ 0x02, 0x02, 0x40, 0x02 }}, }, // 091: Polysynth
+    { 1, {{ 0x02, 0x02, 0x40, 0x02 }}, 3 }, // 090: Warm Pad
+    { 2, {{ 0x02, 0x02, 0x40, 0x02 }}, 2 }, // 091: Polysynth
     { 2, {{ 0x02, 0x02, 0x40, 0x02 }}, }, // 092: Space Voice
     { 2, {{ 0x02, 0x02, 0x40, 0x02 }}, }, // 093: Bowed Glass
     { 0, {{ 0x02, 0x02, 0x20, 0x02 }}, }, // 094: Metal Pad
     { 2, {{ 0x02, 0x02, 0x40, 0x02 }}, }, // 095: Halo Pad
-    { 1, {{ 0x02, 0x02, 0x40, 0x02 }}, }, // 096: Sweep Pad
+    { 1, {{ 0x02, 0x02, 0x40, 0x02 }}, 3 }, // 096: Sweep Pad
 
     { 1, {{ 0xFF, 0x20, 0x40, 0x02 }}, }, // 097: Ice Rain
     { 1, {{ 0x02, 0x02, 0x40, 0x02 }}, }, // 098: Soundtrack
@@ -181,6 +269,15 @@ static struct zed_pl_params zed_pl_synth_preset_tones[] = {
     { 1, {{ 0x20, 0x10, 0x30, 0x08 }}, }, // 111: Fiddle
     { 1, {{ 0x40, 0x20, 0x40, 0x08 }}, }, // 112: Shanai
 
+    { 2, {{ 0xFF, 0x01, 0x08, 0x01 }}, }, // 113: Tinkle Bell
+    { 2, {{ 0xFF, 0x02, 0x08, 0x01 }}, }, // 114: Agogo
+    { 2, {{ 0xC0, 0x02, 0x10, 0x02 }}, }, // 115: Steel Drums
+    { 0, {{ 0xFF, 0x04, 0x04, 0x01 }}, }, // 116: Woodblock
+    { 0, {{ 0xFF, 0x02, 0x08, 0x02 }}, }, // 117: Taiko Drum
+    { 2, {{ 0xFF, 0x02, 0x08, 0x02 }}, }, // 118: Melodic Tom
+    { 1, {{ 0xFF, 0x02, 0x08, 0x02 }}, }, // 119: Synth Drum
+    { 1, {{ 0x02, 0xFF, 0x40, 0x01 }}, }, // 120: Reverse Cymbal
+
     { 1, {{ 0x80, 0x10, 0x40, 0x08 }}, }, // 121: Guitar Fret Noise
     { 1, {{ 0x80, 0x10, 0x40, 0x08 }}, }, // 122: Breath Noise
     { 1, {{ 0x80, 0x10, 0x40, 0x08 }}, }, // 123: Seashore
@@ -191,55 +288,9 @@ static struct zed_pl_params zed_pl_synth_preset_tones[] = {
     { 1, {{ 0x80, 0x10, 0x40, 0x08 }}, }, // 128: Gunshot
 };
 
-// Register map
-// Register map per synthesizer unit
-struct zed_pl_unit_reg {
-    union {
-        uint32_t freq_reg_all;
-        struct {
-            uint32_t freq : 16;
-            uint32_t rsvd : 16;
-        } bit;
-    } freq_reg;
-    union {
-        uint32_t ctl_reg_all;
-        struct {
-            uint32_t wave_type : 2;
-            uint32_t trigger   : 1;
-            uint32_t rsvd      : 29;
-        } bit;
-    } ctl_reg;
-    union {
-        uint32_t vca_eg_reg_all;
-        struct {
-            uint32_t vca_attack  : 8;
-            uint32_t vca_decay   : 8;
-            uint32_t vca_sustain : 8;
-            uint32_t vca_release : 8;
-        } bit;
-    } vca_eg_reg;
-    union {
-        uint32_t amp_reg_all;
-        struct {
-            uint32_t amp_l : 16;
-            uint32_t amp_r : 16;
-        } bit;
-    } amp_reg;
-};
-
-struct zed_pl_common_reg {
-    union {
-        uint32_t audio_ctl_all;
-        struct {
-            uint32_t aud_clk_sel : 1;
-            uint32_t rsvd        : 31;
-        } bit;
-    } audio_ctl_reg;
-    uint32_t unit_free_reg;
-};
-
 // Per channel data
 struct zed_pl_channel_data {
+    // Template of new notes: ctl (without trigger) and vca_eg words of the program
     struct zed_pl_unit_reg    unit_reg;
     int8_t                    vol;
     int8_t                    exp;
@@ -249,362 +300,2146 @@ struct zed_pl_channel_data {
     // Instrument
     int8_t                    midi_program;
 
-    // Calculated volume
-    int16_t                   vol_l;
-    int16_t                   vol_r;
-    struct note_alloc_tracker note_alloc;
-};
-static const int ZED_PL_COMMON_REG_OFF = ZED_PL_SYNTH_NUM_UNITS * sizeof(struct zed_pl_unit_reg) / sizeof(uint32_t);
+    // Level per velocity step from vol, exp, pan and pressure (Q16)
+    uint32_t                  gain_l;
+    uint32_t                  gain_r;
+    uint32_t                  gain_pan;     // Same per pan step, before pan (Q22, unison stacks)
+
+    // Unison: units per note, detune and pan between the outer units
+    uint8_t                   unison;
+    uint8_t                   uni_detune;   // cents
+    uint8_t                   uni_spread;
+
+    // Active voices of this channel (oldest first)
+    zed_pl_vidx_t             voice_head;
+    zed_pl_vidx_t             voice_tail;
+
+    // Parameter state (RPN/NRPN)
+    int16_t                   fine_cents;
+    int16_t                   coarse_semi;
+    int16_t                   tune_cents;
+    int16_t                   bend_range;   // cents
+    int16_t                   bend_cents;   // Current pitch bend
+    uint8_t                   tuning_prog;  // zed_tunings
+    bool                      live_update;
+
+    // MPE member channel: the voice of its note gets bend and pressure directly
+    bool                      mpe_member;
+    zed_pl_vidx_t             mpe_voice;
+    int16_t                   press_gain;   // Channel pressure, ZED_PL_GAIN_ONE: full level
+
+    // LFO (the modulation wheel scales vibrato and tremolo)
+    uint32_t                  lfo_phase;
+    uint32_t                  lfo_inc;      // Phase step per control tick
+    uint8_t                   lfo_rate;     // 0.1 Hz
+    uint8_t                   vib_depth;
+    uint8_t                   trem_depth;
+
+    // Serializes all events of this channel
+    // (channels are independent and may run on different cores)
+    spinlock_t                lock;
+} ____cacheline_aligned_in_smp;
 
 // Per MIDI channel data
-static struct zed_pl_channel_data zed_ch_data[ZED_PL_SYNTH_MIDI_CH];
+// Indexed by part: port * ZED_PL_SYNTH_MIDI_CH + MIDI channel
+static struct zed_pl_channel_data zed_ch_data[ZED_PL_SYNTH_NUM_PARTS];
 
-void zed_pl_synth_release_alloc_pool(struct zed_pl_card_data *prv)
+// Predicted unit release
+static uint32_t zed_pl_predict_now(void)
 {
-    struct note_alloc_tracker *wp1, *wp2;
-    struct zed_pl_unit_reg *regs = NULL;
+    return (uint32_t)(ktime_get_ns() >> 10);
+}
 
-    if (!prv) {
-        return ;
-    }
-    regs = prv->addr_base;
+// Unit starts its release (trigger edge from 1 to 0)
+static void zed_pl_predict_release(struct zed_pl_card_data *prv, int unit_no, uint32_t vca_eg)
+{
+    struct zed_pl_predict *pred = &prv->predict;
+    uint32_t ms = ((vca_eg >> 24) & 0xFF) * ZED_PL_EG_MS_STEP + ZED_PL_PREDICT_MARGIN_MS;
+
+    WRITE_ONCE(pred->free_at[unit_no], zed_pl_predict_now() + ms * (NSEC_PER_MSEC >> 10));
+    smp_wmb();
+    set_bit(unit_no, pred->busy);
+}
 
-    // Release all notes
-    zed_pl_synth_release(prv);
+// Follow trigger edges written to a unit (before the shadow is updated)
+static void zed_pl_predict_track(struct zed_pl_card_data *prv, int unit_no, uint32_t ctl, uint32_t vca_eg)
+{
+    typeof(prv->shadow_unit[0].ctl_reg) now = { .ctl_reg_all = ctl };
 
-    // Free up all list nodes
-    list_for_each_entry_safe(wp1, wp2, &(prv->alloc_pool.list), list) {
-        list_del(&(wp1->list));
-        kfree(wp1);
+    if ((unit_no < prv->num_units) && !now.bit.trigger && prv->shadow_unit[unit_no].ctl_reg.bit.trigger) {
+        zed_pl_predict_release(prv, unit_no, vca_eg);
     }
-    INIT_LIST_HEAD(&prv->alloc_pool.list);
 }
 
-// MIDI pool allocation
-int zed_pl_synth_init_alloc_pool(struct zed_pl_card_data *prv)
+// Units predicted to be still releasing (num_units bits of busy)
+static void zed_pl_predict_busy(struct zed_pl_card_data *prv, unsigned long *busy)
 {
-    int i;
-    struct note_alloc_tracker *wp = NULL;
+    struct zed_pl_predict *pred = &prv->predict;
+    uint32_t now = zed_pl_predict_now();
+    int u;
+
+    bitmap_zero(busy, prv->num_units);
+    for_each_set_bit(u, pred->busy, prv->num_units) {
+        if ((int32_t)(READ_ONCE(pred->free_at[u]) - now) > 0) {
+            __set_bit(u, busy);
+            continue;
+        }
+        clear_bit(u, pred->busy);
 
-    INIT_LIST_HEAD(&prv->alloc_pool.list);
+        // Released again meanwhile
+        smp_mb__after_atomic();
+        if ((int32_t)(READ_ONCE(pred->free_at[u]) - now) > 0) {
+            set_bit(u, pred->busy);
+            __set_bit(u, busy);
+        }
+    }
+}
 
-    for (i = 0; i < ZED_PL_SYNTH_NUM_UNITS; i++) {
-        wp = kzalloc(sizeof(struct note_alloc_tracker), GFP_KERNEL);
-        if (wp == NULL) {
-            zed_pl_synth_release_alloc_pool(prv);
-            return -1;
+// Compare the prediction with the hardware, and correct it
+// Units claimed by the driver or owned by UIO clients aren't counted.
+// Hits are units with a predicted release that matched; idle units
+// nobody predicted anything for aren't counted either.
+static void zed_pl_predict_check(struct zed_pl_card_data *prv, const unsigned long *hw)
+{
+    struct zed_pl_predict *pred = &prv->predict;
+    DECLARE_BITMAP(expect, ZED_PL_SYNTH_MAX_UNITS);
+    DECLARE_BITMAP(tracked, ZED_PL_SYNTH_MAX_UNITS);
+    int hits = 0;
+    int u;
+
+    bitmap_copy(tracked, pred->busy, prv->num_units);
+    zed_pl_predict_busy(prv, expect);
+    for (u = 0; u < prv->num_units; u++) {
+        bool h = test_bit(u, hw);
+
+        if (test_bit(u, prv->voice_busy) || test_bit(u, prv->uio_units)) {
+            continue;
+        }
+        if (h == test_bit(u, expect)) {
+            hits += test_bit(u, tracked);
+            continue;
+        }
+        atomic_inc(&pred->misses);
+        if (h) {
+            // Release is slower than modeled
+            zed_pl_predict_release(prv, u, prv->shadow_unit[u].vca_eg_reg.vca_eg_reg_all);
+        } else {
+            clear_bit(u, pred->busy);
         }
-        list_add_tail(&wp->list, &prv->alloc_pool.list);
     }
-    return 0;
+    atomic_add(hits, &pred->hits);
+    atomic_inc(&pred->hw_reads);
+}
+
+ssize_t zed_pl_synth_show_predict_stats(struct zed_pl_card_data *prv, char *buf)
+{
+    struct zed_pl_predict *pred = &prv->predict;
+
+    return scnprintf(buf, PAGE_SIZE, "allocs %d hw_reads %d hits %d misses %d\n",
+                     atomic_read(&pred->allocs), atomic_read(&pred->hw_reads),
+                     atomic_read(&pred->hits), atomic_read(&pred->misses));
+}
+
+// Register access
+// Every write goes to the shadow copy as well,
+// so that the state can be restored after power loss
+static void zed_pl_synth_write_word(struct zed_pl_card_data *prv, int word_off, uint32_t val)
+{
+    zed_pl_journal_record(prv, word_off, val);
+    writel(val, (uint32_t __iomem *)prv->addr_base + word_off);
 }
 
-static void zed_pl_synth_calc_vol(int ch, int vel)
+void zed_pl_synth_write_unit(struct zed_pl_card_data *prv, int unit_no, const struct zed_pl_unit_reg *reg)
 {
-    int8_t  vol;
-    int8_t  exp;
-    int8_t  pan;
-    int32_t calc;
+    int off = unit_no * ZED_PL_UNIT_REG_WORDS;
+
+    zed_pl_predict_track(prv, unit_no, reg->ctl_reg.ctl_reg_all, reg->vca_eg_reg.vca_eg_reg_all);
+    prv->shadow_unit[unit_no] = *reg;
+    if (unit_no >= prv->num_units) {
+        zed_pl_overflow_write_unit(prv, unit_no, reg);
+        return ;
+    }
+    zed_pl_synth_write_word(prv, off + 0, reg->freq_reg.freq_reg_all);
+    zed_pl_synth_write_word(prv, off + 1, reg->ctl_reg.ctl_reg_all);
+    zed_pl_synth_write_word(prv, off + 2, reg->vca_eg_reg.vca_eg_reg_all);
+    zed_pl_synth_write_word(prv, off + 3, reg->amp_reg.amp_reg_all);
+}
 
-    if ((ch >=ZED_PL_SYNTH_MIDI_CH) || (ch < 0)) {
+void zed_pl_synth_write_reg(struct zed_pl_card_data *prv, int unit_no, enum zed_pl_unit_word word, uint32_t val)
+{
+    if (word == ZED_PL_REG_CTL) {
+        zed_pl_predict_track(prv, unit_no, val, prv->shadow_unit[unit_no].vca_eg_reg.vca_eg_reg_all);
+    }
+    ((uint32_t *)&prv->shadow_unit[unit_no])[word] = val;
+    if (unit_no >= prv->num_units) {
+        zed_pl_overflow_write(prv, unit_no, word, val);
         return ;
     }
-    vol = zed_ch_data[ch].vol;
-    exp = zed_ch_data[ch].exp;
-    pan = zed_ch_data[ch].pan;
+    zed_pl_synth_write_word(prv, unit_no * ZED_PL_UNIT_REG_WORDS + word, val);
+}
 
-    calc = ((int32_t)vol * vel * exp) / 32258; // 127 ^ 2
-    zed_ch_data[ch].vol_l = (calc * (128 - pan)) / 64;
-    zed_ch_data[ch].vol_r = (calc * pan) / 64;
+void zed_pl_synth_write_amp(struct zed_pl_card_data *prv, int unit_no, uint32_t amp)
+{
+    zed_pl_synth_write_reg(prv, unit_no, ZED_PL_REG_AMP, amp);
+}
 
-    return ;
+void zed_pl_synth_set_clk_sel(struct zed_pl_card_data *prv, int sel)
+{
+    prv->shadow_common.audio_ctl_reg.bit.aud_clk_sel = sel ? 1 : 0;
+    zed_pl_synth_write_word(prv, ZED_PL_AUDIO_CTL_OFF(prv->num_units),
+                            prv->shadow_common.audio_ctl_reg.audio_ctl_all);
 }
 
-void zed_pl_synth_midi_init(void)
+// Bit set: unit is busy (note on, or still in release)
+// Fills num_units bits of busy
+void zed_pl_synth_read_busy(struct zed_pl_card_data *prv, unsigned long *busy)
 {
+    uint32_t __iomem *reg = (uint32_t __iomem *)prv->addr_base + ZED_PL_UNIT_FREE_OFF(prv->num_units);
+    uint32_t words[ZED_PL_UNIT_FREE_WORDS(ZED_PL_SYNTH_MAX_UNITS)];
     int i;
-    memset(zed_ch_data, 0, sizeof(struct zed_pl_channel_data) * ZED_PL_SYNTH_MIDI_CH);
-
-    // Set default values for channel data
-    for (i = 0; i < ZED_PL_SYNTH_MIDI_CH; i++) {
-        INIT_LIST_HEAD(&(zed_ch_data[i].note_alloc.list));
 
-        struct zed_pl_unit_reg *reg = &zed_ch_data[i].unit_reg;
-        zed_ch_data[i].vol = 100;
-        reg->ctl_reg.bit.wave_type      = ZED_PL_WAVE_SAW;
-        reg->vca_eg_reg.bit.vca_attack  = 0x40;
-        reg->vca_eg_reg.bit.vca_decay   = 0x20;
-        reg->vca_eg_reg.bit.vca_sustain = 0x40;
-        reg->vca_eg_reg.bit.vca_release = 0x8;
+    for (i = 0; i < ZED_PL_UNIT_FREE_WORDS(prv->num_units); i++) {
+        words[i] = readl(reg + i);
     }
+    bitmap_from_arr32(busy, words, prv->num_units);
 }
 
-void zed_pl_synth_release(struct zed_pl_card_data *prv)
+// Write back all unit and common registers from the shadow copy
+void zed_pl_synth_restore_regs(struct zed_pl_card_data *prv)
 {
-    struct note_alloc_tracker *wp1, *wp2;
-    int i;
-    struct zed_pl_unit_reg *regs = NULL;
-
-    if (!prv) {
+    if (!prv || !prv->addr_base) {
         return ;
     }
-    regs = prv->addr_base;
 
-    // Free up list nodes
-    for (i = 0; i < ZED_PL_SYNTH_MIDI_CH; i++) {
-        list_for_each_entry_safe(wp1, wp2, &(zed_ch_data[i].note_alloc.list), list) {
-            int unit_no = wp1->unit_no;
-            // Return the node to the pool
-            list_move_tail(&(wp1->list), &(prv->alloc_pool.list));
-
-            // Release unit
-            zed_ch_data[i].unit_reg.freq_reg.bit.freq = 0;
-            zed_ch_data[i].unit_reg.ctl_reg.bit.trigger = false;
-            // NOTE: For release, don't touch amplitude
-            //zed_ch_data[ch].unit_reg.amp_reg.bit.amp_l = 0;
-            //zed_ch_data[ch].unit_reg.amp_reg.bit.amp_r = 0;
+    // Units are contiguous, so this is a single 32-bit burst
+    __iowrite32_copy(prv->addr_base, prv->shadow_unit,
+                     prv->num_units * ZED_PL_UNIT_REG_WORDS);
+    if (unlikely(prv->journal)) {
+        const uint32_t *words = (const uint32_t *)prv->shadow_unit;
+        int i;
 
-            // Write to register
-            regs[unit_no] = zed_ch_data[i].unit_reg;
+        for (i = 0; i < prv->num_units * ZED_PL_UNIT_REG_WORDS; i++) {
+            zed_pl_journal_record(prv, i, words[i]);
         }
-        INIT_LIST_HEAD(&zed_ch_data[i].note_alloc.list);
     }
+    zed_pl_synth_write_word(prv, ZED_PL_AUDIO_CTL_OFF(prv->num_units),
+                            prv->shadow_common.audio_ctl_reg.audio_ctl_all);
 }
 
-// MIDI reset event (GM/GS/XG reset)
-void zed_pl_synth_midi_reset_event(struct zed_pl_card_data *prv)
+// Voice table
+// Allocate the structures sized by the number of voices (once, at probe)
+int zed_pl_synth_alloc_voices(struct zed_pl_card_data *prv)
 {
-    zed_pl_synth_release(prv);
-    zed_pl_synth_midi_init();
+    struct zed_pl_voice_table *vt = &prv->voices;
+    int n = prv->num_voices;
+
+    vt->note    = devm_kcalloc(prv->dev, n, sizeof(*vt->note), GFP_KERNEL);
+    vt->vel     = devm_kcalloc(prv->dev, n, sizeof(*vt->vel), GFP_KERNEL);
+    vt->channel = devm_kcalloc(prv->dev, n, sizeof(*vt->channel), GFP_KERNEL);
+    vt->state   = devm_kcalloc(prv->dev, n, sizeof(*vt->state), GFP_KERNEL);
+    vt->next    = devm_kcalloc(prv->dev, n, sizeof(*vt->next), GFP_KERNEL);
+    vt->prev    = devm_kcalloc(prv->dev, n, sizeof(*vt->prev), GFP_KERNEL);
+    vt->age     = devm_kcalloc(prv->dev, n, sizeof(*vt->age), GFP_KERNEL);
+    vt->level   = devm_kcalloc(prv->dev, n, sizeof(*vt->level), GFP_KERNEL);
+    vt->spread  = devm_kcalloc(prv->dev, n, sizeof(*vt->spread), GFP_KERNEL);
+
+    prv->voice_busy  = devm_kcalloc(prv->dev, BITS_TO_LONGS(n), sizeof(unsigned long), GFP_KERNEL);
+    prv->uio_units   = devm_kcalloc(prv->dev, BITS_TO_LONGS(prv->num_units), sizeof(unsigned long), GFP_KERNEL);
+    prv->shadow_unit = devm_kcalloc(prv->dev, n, sizeof(*prv->shadow_unit), GFP_KERNEL);
+
+    prv->predict.busy    = devm_kcalloc(prv->dev, BITS_TO_LONGS(prv->num_units), sizeof(unsigned long), GFP_KERNEL);
+    prv->predict.free_at = devm_kcalloc(prv->dev, prv->num_units, sizeof(uint32_t), GFP_KERNEL);
+
+    if (!vt->note || !vt->vel || !vt->channel || !vt->state ||
+        !vt->next || !vt->prev || !vt->age || !vt->level || !vt->spread ||
+        !prv->voice_busy || !prv->uio_units || !prv->shadow_unit ||
+        !prv->predict.busy || !prv->predict.free_at) {
+        return -ENOMEM;
+    }
+    return 0;
 }
 
-// Allocate free synthesizer unit, and add to note tracker
-static int alloc_free_unit(struct zed_pl_card_data *prv, int ch, int note, int vel)
+// Hand units [first, first + count) over to UIO clients
+// Caller holds access_mutex, and no sequencer port is in use
+int zed_pl_synth_set_uio_units(struct zed_pl_card_data *prv, int first, int count)
 {
-    static int cur_pos = 0; // For round robin
-    struct zed_pl_common_reg *regs = NULL;
+    struct zed_pl_voice_policy *pol = &prv->policy;
+    int total = 0;
     int i;
 
-    if (!prv || !prv->addr_base) {
-        return -1;
+    if ((first < 0) || (count < 0) || (first + count > prv->num_units)) {
+        return -EINVAL;
     }
-    regs = prv->addr_base + ZED_PL_COMMON_REG_OFF;
 
-    for (i = 1; i <= ZED_PL_SYNTH_NUM_UNITS; i++) {
-        // It points to "unit_free_req"
-        uint32_t *unit_free_reg_off = prv->addr_base + sizeof(struct zed_pl_unit_reg) * ZED_PL_SYNTH_NUM_UNITS + sizeof(uint32_t);
-        int reg_off = (cur_pos + i) % ZED_PL_SYNTH_NUM_UNITS;
+    // Reservations must still fit in the kernel units
+    for (i = 0; i < ZED_PL_SYNTH_NUM_PARTS; i++) {
+        total += READ_ONCE(pol->reserved[i]);
+    }
+    if (total > prv->num_units - count) {
+        return -ENOSPC;
+    }
 
-        if ((*unit_free_reg_off & (1 << reg_off)) == 0) {
-            struct note_alloc_tracker *note_track = list_first_entry(&(prv->alloc_pool.list), struct note_alloc_tracker, list);
-            if (!note_track) {
-                return -1;
-            }
+    bitmap_zero(prv->uio_units, prv->num_units);
+    bitmap_set(prv->uio_units, first, count);
+    prv->uio_first = first;
+    prv->uio_count = count;
+    return 0;
+}
 
-            cur_pos = reg_off;
-            note_track->unit_no = cur_pos;
-            note_track->note    = note;
-            note_track->vel     = vel;
+void zed_pl_synth_init_voice_table(struct zed_pl_card_data *prv)
+{
+    struct zed_pl_voice_table *vt = &prv->voices;
+    int v;
+
+    for (v = 0; v < prv->num_voices; v++) {
+        vt->note[v]    = 0;
+        vt->vel[v]     = 0;
+        vt->channel[v] = 0;
+        vt->state[v]   = ZED_PL_VOICE_FREE;
+        vt->next[v]    = ZED_PL_VOICE_NONE;
+        vt->prev[v]    = ZED_PL_VOICE_NONE;
+        vt->age[v]     = 0;
+        vt->level[v]   = 0;
+        vt->spread[v]  = 0;
+    }
 
-            // Add entry for note tracker
-            list_move_tail(&note_track->list, &zed_ch_data[ch].note_alloc.list);
-            return cur_pos;
-        }
+    bitmap_zero(prv->voice_busy, prv->num_voices);
+    bitmap_zero(prv->predict.busy, prv->num_units);
+    atomic_set(&prv->predict.allocs, 0);
+    atomic_set(&prv->predict.hw_reads, 0);
+    atomic_set(&prv->predict.hits, 0);
+    atomic_set(&prv->predict.misses, 0);
+    atomic_set(&prv->alloc_cursor, 0);
+    atomic_set(&prv->voice_age, 0);
+
+    zed_pl_synth_init_policy(prv);
+}
+
+// Output headroom limiter
+// Highest summed level of the sounding voices (before the limiter)
+static int zed_pl_limiter_level(struct zed_pl_limiter *lim)
+{
+    return max(atomic_read(&lim->sum_l), atomic_read(&lim->sum_r));
+}
+
+// Schedule a gain pass when the output is over the headroom,
+// or enough below it to give gain back (hysteresis: 1/16)
+static void zed_pl_limiter_check(struct zed_pl_card_data *prv)
+{
+    struct zed_pl_limiter *lim = &prv->limiter;
+    int gain  = READ_ONCE(lim->gain);
+    u64 out   = (u64)zed_pl_limiter_level(lim) * gain;
+    u64 limit = (u64)READ_ONCE(headroom) * ZED_PL_GAIN_ONE;
+
+    if (out > (u64)READ_ONCE(lim->peak) * ZED_PL_GAIN_ONE) {
+        WRITE_ONCE(lim->peak, out / ZED_PL_GAIN_ONE);
+    }
+    if ((limit && (out > limit)) ||
+        ((gain < ZED_PL_GAIN_ONE) && (!limit || (out * 17 < limit * 16)))) {
+        queue_work(system_highpri_wq, &lim->work);
     }
-    return -1;
 }
 
-void zed_pl_synth_note_on(void *p, int note, int vel, struct snd_midi_channel *chan)
+// Level of a sounding voice changed (was/now: amp words before the limiter)
+static void zed_pl_limiter_add(struct zed_pl_card_data *prv, uint32_t was, uint32_t now)
 {
-    struct zed_pl_card_data *prv = p;
-    int unit_no = -1;
-    int ch = 0;
-    
-    if (!chan) {
+    typeof(prv->shadow_unit[0].amp_reg) a = { .amp_reg_all = was };
+    typeof(prv->shadow_unit[0].amp_reg) b = { .amp_reg_all = now };
+
+    if (was == now) {
         return ;
     }
+    atomic_add((int)b.bit.amp_l - (int)a.bit.amp_l, &prv->limiter.sum_l);
+    atomic_add((int)b.bit.amp_r - (int)a.bit.amp_r, &prv->limiter.sum_r);
+    zed_pl_limiter_check(prv);
+}
 
-    ch = chan->number;
-    if ((ch >= ZED_PL_SYNTH_MIDI_CH) || (ch < 0)) {
-        return ;
+// Amplitude word as written, with the limiter gain
+static uint32_t zed_pl_limiter_scale(struct zed_pl_card_data *prv, uint32_t level)
+{
+    typeof(prv->shadow_unit[0].amp_reg) amp = { .amp_reg_all = level };
+    int gain = READ_ONCE(prv->limiter.gain);
+
+    return ZED_PL_AMP_WORD((amp.bit.amp_l * gain) / ZED_PL_GAIN_ONE,
+                           (amp.bit.amp_r * gain) / ZED_PL_GAIN_ONE);
+}
+
+// Set the level of a sounding voice, returns the amplitude word to write
+// (caller holds the channel lock)
+static uint32_t zed_pl_synth_voice_amp(struct zed_pl_card_data *prv, int v, uint32_t level)
+{
+    zed_pl_limiter_add(prv, prv->voices.level[v], level);
+    prv->voices.level[v] = level;
+    return zed_pl_limiter_scale(prv, level);
+}
+
+// Append voice to the channel list (caller holds the channel lock)
+static void zed_pl_voice_link(struct zed_pl_card_data *prv, int ch, int v)
+{
+    struct zed_pl_voice_table  *vt   = &prv->voices;
+    struct zed_pl_channel_data *data = &zed_ch_data[ch];
+
+    vt->channel[v] = ch;
+    vt->next[v]    = ZED_PL_VOICE_NONE;
+    vt->prev[v]    = data->voice_tail;
+    if (data->voice_tail != ZED_PL_VOICE_NONE) {
+        vt->next[data->voice_tail] = v;
+    } else {
+        data->voice_head = v;
     }
+    data->voice_tail = v;
+    atomic_inc(&prv->policy.active[ch]);
+}
 
-    if ((note >= ZED_PL_NOTE_MAX) || (note < 0)) {
-        return ;
+static void zed_pl_voice_unlink(struct zed_pl_card_data *prv, int ch, int v)
+{
+    struct zed_pl_voice_table  *vt   = &prv->voices;
+    struct zed_pl_channel_data *data = &zed_ch_data[ch];
+
+    if (vt->prev[v] != ZED_PL_VOICE_NONE) {
+        vt->next[vt->prev[v]] = vt->next[v];
+    } else {
+        data->voice_head = vt->next[v];
     }
+    if (vt->next[v] != ZED_PL_VOICE_NONE) {
+        vt->prev[vt->next[v]] = vt->prev[v];
+    } else {
+        data->voice_tail = vt->prev[v];
+    }
+    if (data->mpe_voice == v) {
+        data->mpe_voice = ZED_PL_VOICE_NONE;
+    }
+    if (vt->state[v] == ZED_PL_VOICE_STACK) {
+        atomic_dec(&prv->policy.stacked);
+    }
+    vt->next[v]  = ZED_PL_VOICE_NONE;
+    vt->prev[v]  = ZED_PL_VOICE_NONE;
+    vt->state[v] = ZED_PL_VOICE_FREE;
+    atomic_dec(&prv->policy.active[ch]);
+
+    // Released voices are left out of the output level
+    zed_pl_limiter_add(prv, vt->level[v], 0);
+    vt->level[v] = 0;
+}
 
-    if (chan->drum_channel == 0) {
-        mutex_lock(&prv->access_mutex);
+#define for_each_channel_voice(vt, data, v) \
+    for ((v) = (data)->voice_head; (v) != ZED_PL_VOICE_NONE; (v) = (vt)->next[(v)])
 
-        // Program change
-        if (chan->midi_program != zed_ch_data[ch].midi_program) {
-            zed_pl_synth_program_change(prv, ch, chan->midi_program);
-        }
+// Frequency of a pitch (semitones with ZED_PL_TUNING_FRAC_BITS fraction)
+// (linear between the semitones of the table)
+static int zed_pl_synth_pitch_freq(int pitch)
+{
+    int n    = pitch >> ZED_PL_TUNING_FRAC_BITS;
+    int frac = pitch & (ZED_PL_TUNING_ONE - 1);
 
-        // Allocate unit and add entry to tracker
-        unit_no = alloc_free_unit(prv, ch, note, vel);
-        if (unit_no >= 0) {
-            struct zed_pl_unit_reg *regs = prv->addr_base;
+    if (pitch < 0) {
+        return note_freq[0];
+    }
+    if (n >= (int)ARRAY_SIZE(note_freq) - 1) {
+        return note_freq[ARRAY_SIZE(note_freq) - 1];
+    }
+    return note_freq[n] + (((note_freq[n + 1] - note_freq[n]) * frac) >> ZED_PL_TUNING_FRAC_BITS);
+}
 
-            // Calculate volume
-            zed_pl_synth_calc_vol(ch, vel);
+// Note frequency in the channel's tuning with a pitch offset in cents
+static int zed_pl_synth_calc_freq(struct zed_pl_channel_data *data, int note, int cents)
+{
+    const struct zed_pl_tuning *tun;
+    int freq;
+
+    rcu_read_lock();
+    tun = rcu_dereference(zed_tunings[data->tuning_prog]);
+    if (cents == 0) {
+        freq = tun ? tun->freq[note] : note_freq[note];
+    } else {
+        freq = zed_pl_synth_pitch_freq((tun ? tun->pitch[note] : note << ZED_PL_TUNING_FRAC_BITS) +
+                                       (cents * ZED_PL_TUNING_ONE) / 100);
+    }
+    rcu_read_unlock();
+    return freq;
+}
 
-            // Set data
-            zed_ch_data[ch].unit_reg.freq_reg.bit.freq   = note_freq[note];
-            zed_ch_data[ch].unit_reg.ctl_reg.bit.trigger = true;
-            zed_ch_data[ch].unit_reg.amp_reg.bit.amp_l   = zed_ch_data[ch].vol_l;
-            zed_ch_data[ch].unit_reg.amp_reg.bit.amp_r   = zed_ch_data[ch].vol_r;
+// Channel level from volume, expression, pan and pressure (caller holds the channel lock)
+// Done when one of them changes, so that a note only scales it by its velocity
+static void zed_pl_synth_calc_gain(struct zed_pl_channel_data *data)
+{
+    // 127 ^ 2 for vol and exp, 64 for pan
+    const uint32_t div = 32258 * ZED_PL_GAIN_ONE * 64;
+    u64 level = (u64)data->vol * data->exp * data->press_gain;
 
-            // Write to register
-            regs[unit_no] = zed_ch_data[ch].unit_reg;
-        }
-        mutex_unlock(&prv->access_mutex);
-    } //else {
-        // TODO
-    //}
+    data->gain_l   = div_u64((level * (128 - data->pan)) << 16, div);
+    data->gain_r   = div_u64((level * data->pan) << 16, div);
+    data->gain_pan = div_u64(level << 22, div);
 }
 
-static int free_unit(struct zed_pl_card_data *prv, int ch, int note)
+// Amplitude word of a voice with a gain on top (Q10), before the limiter
+static uint32_t zed_pl_synth_calc_amp(const struct zed_pl_channel_data *data, int vel, int gain)
 {
-    struct note_alloc_tracker *wp1, *wp2;
-    if (ch >= ZED_PL_SYNTH_MIDI_CH) {
-        return -1;
+    uint32_t amp_l = (((vel * data->gain_l) >> 16) * gain) / ZED_PL_GAIN_ONE;
+    uint32_t amp_r = (((vel * data->gain_r) >> 16) * gain) / ZED_PL_GAIN_ONE;
+
+    return ZED_PL_AMP_WORD(amp_l, amp_r);
+}
+
+// Amplitude word of a voice, panned by its place in the unison stack
+static uint32_t zed_pl_synth_voice_level(const struct zed_pl_channel_data *data,
+                                         const struct zed_pl_voice_table *vt, int v, int gain)
+{
+    uint32_t amp_l;
+    uint32_t amp_r;
+    int pan;
+
+    if (vt->spread[v] == 0) {
+        return zed_pl_synth_calc_amp(data, vt->vel[v], gain);
     }
+    pan   = clamp(data->pan + (vt->spread[v] * data->uni_spread) / 128, 0, 128);
+    amp_l = ((((uint32_t)vt->vel[v] * data->gain_pan * (128 - pan)) >> 22) * gain) / ZED_PL_GAIN_ONE;
+    amp_r = ((((uint32_t)vt->vel[v] * data->gain_pan * pan) >> 22) * gain) / ZED_PL_GAIN_ONE;
+    return ZED_PL_AMP_WORD(amp_l, amp_r);
+}
 
-    if (note >= ZED_PL_NOTE_MAX) {
-        return -1;
+// Pitch offset of the channel's voices in cents (caller holds the channel lock)
+static int zed_pl_synth_pitch_cents(struct zed_pl_channel_data *data)
+{
+    return data->tune_cents + data->bend_cents;
+}
+
+// Frequency of a voice, detuned by its place in the unison stack
+static int zed_pl_synth_voice_freq(struct zed_pl_channel_data *data,
+                                   const struct zed_pl_voice_table *vt, int v, int cents)
+{
+    return zed_pl_synth_calc_freq(data, vt->note[v], cents + (vt->spread[v] * data->uni_detune) / 128);
+}
+
+// Write one register word of a voice if its value changed (caller holds the channel lock)
+static void zed_pl_synth_update_reg(struct zed_pl_card_data *prv, int v, enum zed_pl_unit_word word, uint32_t val)
+{
+    if (((uint32_t *)&prv->shadow_unit[v])[word] != val) {
+        zed_pl_synth_write_reg(prv, v, word, val);
     }
-    list_for_each_entry_safe(wp1, wp2, &(zed_ch_data[ch].note_alloc.list), list) {
-        if (wp1->note == note) {
-            int unit_no = wp1->unit_no;
+}
 
-            // Return the free node to the pool
-            list_move_tail(&(wp1->list), &(prv->alloc_pool.list));
-            return unit_no;
-        }
+// LFO
+// Modulation is audible on the channel (caller holds the channel lock)
+static bool zed_pl_synth_mod_wanted(struct zed_pl_channel_data *data)
+{
+    return data->mod && (data->vib_depth || data->trem_depth);
+}
+
+static void zed_pl_synth_set_lfo_rate(struct zed_pl_channel_data *data, int rate)
+{
+    data->lfo_rate = rate;
+    data->lfo_inc  = div_u64((u64)rate << 32, 10 * ZED_PL_MOD_RATE_HZ);
+}
+
+// Set default values for channel data (caller holds the channel lock)
+static void zed_pl_synth_init_channel(struct zed_pl_channel_data *data)
+{
+    struct zed_pl_unit_reg *reg = &data->unit_reg;
+
+    memset(reg, 0, sizeof(*reg));
+    data->vol          = 100;
+    data->exp          = 0;
+    data->pan          = 0;
+    data->mod          = 0;
+    data->midi_program = 0;
+    data->voice_head   = ZED_PL_VOICE_NONE;
+    data->voice_tail   = ZED_PL_VOICE_NONE;
+    data->fine_cents   = 0;
+    data->coarse_semi  = 0;
+    data->tune_cents   = 0;
+    data->bend_range   = 200;
+    data->bend_cents   = 0;
+    data->tuning_prog  = 0;
+    data->live_update  = false;
+    data->mpe_member   = false;
+    data->mpe_voice    = ZED_PL_VOICE_NONE;
+    data->press_gain   = ZED_PL_GAIN_ONE;
+    data->lfo_phase    = 0;
+    data->vib_depth    = 50;
+    data->trem_depth   = 0;
+    data->unison       = 1;
+    data->uni_detune   = 20;
+    data->uni_spread   = 64;
+    zed_pl_synth_set_lfo_rate(data, 55);
+    zed_pl_synth_calc_gain(data);
+
+    reg->ctl_reg.bit.wave_type      = ZED_PL_WAVE_SAW;
+    reg->vca_eg_reg.bit.vca_attack  = 0x40;
+    reg->vca_eg_reg.bit.vca_decay   = 0x20;
+    reg->vca_eg_reg.bit.vca_sustain = 0x40;
+    reg->vca_eg_reg.bit.vca_release = 0x8;
+}
+
+// Called once at probe, before any event can arrive
+void zed_pl_synth_init_channels(void)
+{
+    int i;
+
+    for (i = 0; i < ZED_PL_SYNTH_NUM_PARTS; i++) {
+        spin_lock_init(&zed_ch_data[i].lock);
+        zed_pl_synth_init_channel(&zed_ch_data[i]);
     }
-    return -1;
 }
 
-void zed_pl_synth_note_off(void *p, int note, int vel, struct snd_midi_channel *chan)
+// Reset the channels of a port
+void zed_pl_synth_midi_init(struct zed_pl_port *port)
 {
-    struct zed_pl_card_data *prv = p;
-    int unit_no = -1;
+    unsigned long flags;
+    int i;
 
-    if (chan->number >= ZED_PL_SYNTH_MIDI_CH) {
-        return ;
+    for (i = port->part_base; i < port->part_base + ZED_PL_SYNTH_MIDI_CH; i++) {
+        spin_lock_irqsave(&zed_ch_data[i].lock, flags);
+        zed_pl_synth_init_channel(&zed_ch_data[i]);
+        spin_unlock_irqrestore(&zed_ch_data[i].lock, flags);
     }
+    port->mpe_lower = 0;
+    port->mpe_upper = 0;
+}
 
-    if (note >= ZED_PL_NOTE_MAX) {
-        return ;
+// Modulation engine
+// LFOs run per channel at ZED_PL_MOD_RATE_HZ. Each tick updates the
+// modulated voices in one pass, writing only registers whose value changed.
+// Start modulating a channel (caller holds the channel lock)
+static void zed_pl_synth_mod_start(struct zed_pl_card_data *prv, int ch)
+{
+    set_bit(ch, prv->mod_active);
+    if (!test_and_set_bit(0, &prv->mod_running)) {
+        hrtimer_start(&prv->mod_timer, ms_to_ktime(1000 / ZED_PL_MOD_RATE_HZ), HRTIMER_MODE_REL);
     }
+}
 
-    if (chan->drum_channel == 0) {
-        mutex_lock(&prv->access_mutex);
+// One control tick of a channel
+// When modulation stops, voices get their unmodulated values back once
+static void zed_pl_synth_modulate(struct zed_pl_card_data *prv, int ch)
+{
+    struct zed_pl_channel_data *data = &zed_ch_data[ch];
+    struct zed_pl_voice_table  *vt   = &prv->voices;
+    unsigned long flags;
+    bool active;
+    int vib  = 0;
+    int gain = ZED_PL_GAIN_ONE;
+    int v;
+
+    spin_lock_irqsave(&data->lock, flags);
+    active = zed_pl_synth_mod_wanted(data) && (data->voice_head != ZED_PL_VOICE_NONE);
+    if (active) {
+        int lfo;
+
+        data->lfo_phase += data->lfo_inc;
+        lfo = fixp_sin16(((data->lfo_phase >> 16) * 360) >> 16);    // Q15
+
+        // Vibrato: +-vib_depth cents, tremolo: down to (1 - trem_depth) at the trough
+        vib  = (lfo * data->mod * data->vib_depth) / (32767 * 127);
+        gain = ZED_PL_GAIN_ONE -
+               (((32767 - lfo) >> 6) * data->mod * data->trem_depth) / (127 * 127);
+    }
 
-        // Find target unit
-        unit_no = free_unit(prv, chan->number, note);
-        if (unit_no >= 0) {
-            struct zed_pl_unit_reg *regs = prv->addr_base;
-            const int ch = chan->number;
+    for_each_channel_voice(vt, data, v) {
+        struct zed_pl_unit_reg *cur = &prv->shadow_unit[v];
+        typeof(cur->freq_reg) freq = cur->freq_reg;
+        typeof(cur->amp_reg)  amp  = cur->amp_reg;
 
-            // Set data
-            zed_ch_data[ch].unit_reg.freq_reg.bit.freq = 0;
-            zed_ch_data[ch].unit_reg.ctl_reg.bit.trigger = false;
-            // NOTE: For release, don't touch amplitude
-            //zed_ch_data[ch].unit_reg.amp_reg.bit.amp_l = 0;
-            //zed_ch_data[ch].unit_reg.amp_reg.bit.amp_r = 0;
+        freq.bit.freq = zed_pl_synth_voice_freq(data, vt, v, zed_pl_synth_pitch_cents(data) + vib);
+        amp.amp_reg_all = zed_pl_synth_voice_amp(prv, v, zed_pl_synth_voice_level(data, vt, v, gain));
 
-            // Write to register
-            regs[unit_no] = zed_ch_data[ch].unit_reg;
+        if (freq.freq_reg_all != cur->freq_reg.freq_reg_all) {
+            zed_pl_synth_write_reg(prv, v, ZED_PL_REG_FREQ, freq.freq_reg_all);
+            prv->mod_writes++;
         }
-        mutex_unlock(&prv->access_mutex);
+        if (amp.amp_reg_all != cur->amp_reg.amp_reg_all) {
+            zed_pl_synth_write_reg(prv, v, ZED_PL_REG_AMP, amp.amp_reg_all);
+            prv->mod_writes++;
+        }
+        prv->mod_voices++;
     }
+
+    if (!active) {
+        clear_bit(ch, prv->mod_active);
+    }
+    spin_unlock_irqrestore(&data->lock, flags);
 }
 
-void zed_pl_synth_key_press(void *p, int note, int vel, struct snd_midi_channel *chan)
+static void zed_pl_synth_mod_work(struct work_struct *work)
 {
-    zed_pl_synth_note_on(p, note, vel, chan);
+    struct zed_pl_card_data *prv = container_of(work, struct zed_pl_card_data, mod_work);
+    int ch;
+
+    for_each_set_bit(ch, prv->mod_active, ZED_PL_SYNTH_NUM_PARTS) {
+        zed_pl_synth_modulate(prv, ch);
+    }
+    prv->mod_ticks++;
 }
 
-void zed_pl_synth_terminate_note(void *p, int note, struct snd_midi_channel *chan)
+static enum hrtimer_restart zed_pl_synth_mod_timer(struct hrtimer *timer)
 {
-    zed_pl_synth_note_off(p, note, 0, chan);
+    struct zed_pl_card_data *prv = container_of(timer, struct zed_pl_card_data, mod_timer);
+
+    // Stop when no channel is modulated; a channel starting meanwhile restarts the timer
+    if (bitmap_empty(prv->mod_active, ZED_PL_SYNTH_NUM_PARTS)) {
+        clear_bit(0, &prv->mod_running);
+        smp_mb__after_atomic();
+        if (bitmap_empty(prv->mod_active, ZED_PL_SYNTH_NUM_PARTS) ||
+            test_and_set_bit(0, &prv->mod_running)) {
+            return HRTIMER_NORESTART;
+        }
+    }
+
+    // Register writes don't belong in hard interrupt context
+    queue_work(system_highpri_wq, &prv->mod_work);
+    hrtimer_forward_now(timer, ms_to_ktime(1000 / ZED_PL_MOD_RATE_HZ));
+    return HRTIMER_RESTART;
 }
 
-// Program change
-void zed_pl_synth_program_change(struct zed_pl_card_data *prv, int ch, int pgm_num)
+void zed_pl_synth_init_mod(struct zed_pl_card_data *prv)
 {
-    if (!prv) {
-        return ;
-    }
+    bitmap_zero(prv->mod_active, ZED_PL_SYNTH_NUM_PARTS);
+    prv->mod_running = 0;
+    prv->mod_ticks   = 0;
+    prv->mod_voices  = 0;
+    prv->mod_writes  = 0;
+    INIT_WORK(&prv->mod_work, zed_pl_synth_mod_work);
+    hrtimer_init(&prv->mod_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    prv->mod_timer.function = zed_pl_synth_mod_timer;
+}
+
+void zed_pl_synth_release_mod(struct zed_pl_card_data *prv)
+{
+    hrtimer_cancel(&prv->mod_timer);
+    cancel_work_sync(&prv->mod_work);
+}
+
+ssize_t zed_pl_synth_show_mod_stats(struct zed_pl_card_data *prv, char *buf)
+{
+    return scnprintf(buf, PAGE_SIZE, "ticks %llu voices %llu writes %llu\n",
+                     prv->mod_ticks, prv->mod_voices, prv->mod_writes);
+}
 
-    if ((ch < 0) || (ch >= ZED_PL_SYNTH_MIDI_CH)) {
+// Gain pass: rescale every sounding voice once
+static void zed_pl_limiter_work(struct work_struct *work)
+{
+    struct zed_pl_card_data *prv = container_of(work, struct zed_pl_card_data, limiter.work);
+    struct zed_pl_limiter   *lim = &prv->limiter;
+    struct zed_pl_voice_table *vt = &prv->voices;
+    unsigned int limit = READ_ONCE(headroom);
+    unsigned long flags;
+    int level = zed_pl_limiter_level(lim);
+    int gain  = ZED_PL_GAIN_ONE;
+    int ch;
+    int v;
+
+    if (limit && (level > limit)) {
+        gain = max_t(int, (limit * ZED_PL_GAIN_ONE) / level, ZED_PL_LIMITER_MIN_GAIN);
+    }
+    if (gain == READ_ONCE(lim->gain)) {
         return ;
     }
+    WRITE_ONCE(lim->gain, gain);
+    lim->passes++;
 
-    if ((pgm_num < 0) || (pgm_num > 127)) {
-        return ;
+    for (ch = 0; ch < ZED_PL_SYNTH_NUM_PARTS; ch++) {
+        struct zed_pl_channel_data *data = &zed_ch_data[ch];
+
+        if (READ_ONCE(data->voice_head) == ZED_PL_VOICE_NONE) {
+            continue;
+        }
+        spin_lock_irqsave(&data->lock, flags);
+        for_each_channel_voice(vt, data, v) {
+            zed_pl_synth_update_reg(prv, v, ZED_PL_REG_AMP, zed_pl_limiter_scale(prv, vt->level[v]));
+        }
+        spin_unlock_irqrestore(&data->lock, flags);
     }
+}
 
-    zed_ch_data[ch].unit_reg.ctl_reg.ctl_reg_all       = zed_pl_synth_preset_tones[pgm_num].wave_type;
-    zed_ch_data[ch].unit_reg.vca_eg_reg.vca_eg_reg_all = zed_pl_synth_preset_tones[pgm_num].vca_eg.vca_eg_all;
-    zed_ch_data[ch].midi_program                       = pgm_num;
+void zed_pl_synth_init_limiter(struct zed_pl_card_data *prv)
+{
+    struct zed_pl_limiter *lim = &prv->limiter;
+
+    atomic_set(&lim->sum_l, 0);
+    atomic_set(&lim->sum_r, 0);
+    lim->gain   = ZED_PL_GAIN_ONE;
+    lim->peak   = 0;
+    lim->passes = 0;
+    INIT_WORK(&lim->work, zed_pl_limiter_work);
 }
 
-// Handle control change and program change
-void zed_pl_synth_control(void *p, int type, struct snd_midi_channel *chan)
+void zed_pl_synth_release_limiter(struct zed_pl_card_data *prv)
 {
-    struct zed_pl_card_data *prv  = p;
-    struct zed_pl_unit_reg  *regs = NULL;
-    int ch = chan->number;
-    struct note_alloc_tracker *wp;
+    cancel_work_sync(&prv->limiter.work);
+}
 
-    if (prv == NULL) {
-        return ;
-    }
-    regs = prv->addr_base;
+ssize_t zed_pl_synth_show_limiter(struct zed_pl_card_data *prv, char *buf)
+{
+    struct zed_pl_limiter *lim = &prv->limiter;
 
-    if ((ch >= ZED_PL_SYNTH_MIDI_CH) || (ch < 0)) {
-        return ;
-    }
+    return scnprintf(buf, PAGE_SIZE, "headroom %u sum_l %d sum_r %d gain %d peak %d passes %llu\n",
+                     READ_ONCE(headroom), atomic_read(&lim->sum_l), atomic_read(&lim->sum_r),
+                     READ_ONCE(lim->gain), READ_ONCE(lim->peak), lim->passes);
+}
 
-    // Control change
-    mutex_lock(&prv->access_mutex);
-    zed_ch_data[ch].vol = chan->gm_volume;
-    zed_ch_data[ch].exp = chan->gm_expression;
-    zed_ch_data[ch].pan = chan->gm_pan;
-    zed_ch_data[ch].mod = chan->gm_modulation_wheel_lsb;
+// Return the unit to the shared pool (after its release has been written)
+static void zed_pl_synth_put_unit(struct zed_pl_card_data *prv, int unit_no)
+{
+    clear_bit_unlock(unit_no, prv->voice_busy);
+}
+
+// Start the release of a voice: clear its frequency and trigger
+// Envelope and amplitude stay as the note left them
+static void zed_pl_synth_release_voice(struct zed_pl_card_data *prv, int v)
+{
+    zed_pl_synth_write_reg(prv, v, ZED_PL_REG_FREQ, 0);
+    zed_pl_synth_write_reg(prv, v, ZED_PL_REG_CTL, prv->shadow_unit[v].ctl_reg.ctl_reg_all & ~ZED_PL_CTL_TRIGGER);
+}
 
-    // Change volume (TODO: Frequency)
-    list_for_each_entry (wp, &zed_ch_data[ch].note_alloc.list, list) {
-        int unit_no = wp->unit_no;
+// Release all voices of a channel (caller holds the channel lock)
+// cut: silence them at once instead of letting the envelope ring out
+static void zed_pl_synth_release_channel(struct zed_pl_card_data *prv, int ch, bool cut)
+{
+    while (zed_ch_data[ch].voice_head != ZED_PL_VOICE_NONE) {
+        int unit_no = zed_ch_data[ch].voice_head;
+        zed_pl_voice_unlink(prv, ch, unit_no);
+
+        // Release unit
+        if (cut) {
+            zed_pl_synth_write_amp(prv, unit_no, 0);
+        }
+        zed_pl_synth_release_voice(prv, unit_no);
+        zed_pl_synth_put_unit(prv, unit_no);
+    }
+}
+
+// Release the voices of parts [first, first + count)
+static void zed_pl_synth_release_parts(struct zed_pl_card_data *prv, int first, int count)
+{
+    unsigned long flags;
+    int i;
 
-        zed_pl_synth_calc_vol(ch, wp->vel);
-        zed_ch_data[ch].unit_reg.amp_reg.bit.amp_l   = zed_ch_data[ch].vol_l;
-        zed_ch_data[ch].unit_reg.amp_reg.bit.amp_r   = zed_ch_data[ch].vol_r;
+    if (!prv) {
+        return ;
+    }
 
-        // Write volume
-        regs[unit_no].amp_reg.amp_reg_all = zed_ch_data[ch].unit_reg.amp_reg.amp_reg_all;
+    for (i = first; i < first + count; i++) {
+        spin_lock_irqsave(&zed_ch_data[i].lock, flags);
+        zed_pl_synth_release_channel(prv, i, false);
+        spin_unlock_irqrestore(&zed_ch_data[i].lock, flags);
     }
-    mutex_unlock(&prv->access_mutex);
 }
 
-void zed_pl_synth_nrpn(void *p, struct snd_midi_channel *chan, struct snd_midi_channel_set *chset)
+// Release all voices
+void zed_pl_synth_release(struct zed_pl_card_data *prv)
 {
+    zed_pl_synth_release_parts(prv, 0, ZED_PL_SYNTH_NUM_PARTS);
 }
 
-void zed_pl_synth_sysex(void *p, unsigned char *buf, int len, int parsed, struct snd_midi_channel_set *chset)
+// Release the voices of one port
+void zed_pl_synth_release_port(struct zed_pl_port *port)
 {
-    struct zed_pl_card_data *prv  = p;
+    zed_pl_synth_release_parts(port->prv, port->part_base, ZED_PL_SYNTH_MIDI_CH);
+}
+
+// Release the channels a subscriber that left played last, with the notes
+// it still held on or sustained (the emulation would keep them forever)
+// Runs under the emul_lock of each channel, like the events of the other subscribers
+void zed_pl_synth_release_client(struct zed_pl_port *port, int client)
+{
+    unsigned long flags;
+    int i;
+
+    for (i = 0; i < ZED_PL_SYNTH_MIDI_CH; i++) {
+        struct snd_midi_channel *chan = &port->chset->channels[i];
+
+        spin_lock_irqsave(&port->emul_lock[i], flags);
+        if (READ_ONCE(port->last_client[i]) == client) {
+            memset(chan->note, 0, sizeof(chan->note));
+            chan->control[MIDI_CTL_SUSTAIN] = 0;
+            zed_pl_synth_release_parts(port->prv, port->part_base + i, 1);
+        }
+        spin_unlock_irqrestore(&port->emul_lock[i], flags);
+    }
+}
+
+// MIDI reset event (GM/GS/XG reset)
+void zed_pl_synth_midi_reset_event(struct zed_pl_port *port)
+{
+    zed_pl_synth_release_port(port);
+    zed_pl_synth_midi_init(port);
+}
+
+// Part (global channel) of a MIDI channel on a port, -1 if out of range
+static int zed_pl_synth_part(struct zed_pl_port *port, struct snd_midi_channel *chan)
+{
+    if (!port || !chan || (chan->number < 0) || (chan->number >= ZED_PL_SYNTH_MIDI_CH)) {
+        return -1;
+    }
+    return port->part_base + chan->number;
+}
+
+// Voice policy defaults: no quota, no reservation, equal priority
+void zed_pl_synth_init_policy(struct zed_pl_card_data *prv)
+{
+    struct zed_pl_voice_policy *pol = &prv->policy;
+    int i;
+
+    for (i = 0; i < ZED_PL_SYNTH_NUM_PARTS; i++) {
+        pol->max_voices[i] = prv->num_voices;
+        pol->reserved[i]   = 0;
+        pol->priority[i]   = ZED_PL_PRIORITY_DEFAULT;
+        atomic_set(&pol->active[i], 0);
+    }
+    atomic_set(&pol->steals, 0);
+    atomic_set(&pol->dropped, 0);
+    atomic_set(&pol->stacked, 0);
+    atomic_set(&pol->degraded, 0);
+}
+
+// Units still owed to other channels' reservations
+static int zed_pl_synth_reserve_deficit(struct zed_pl_card_data *prv, int ch)
+{
+    struct zed_pl_voice_policy *pol = &prv->policy;
+    int deficit = 0;
+    int i;
+
+    for (i = 0; i < ZED_PL_SYNTH_NUM_PARTS; i++) {
+        int d;
+
+        if (i == ch) {
+            continue;
+        }
+        d = READ_ONCE(pol->reserved[i]) - atomic_read(&pol->active[i]);
+        if (d > 0) {
+            deficit += d;
+        }
+    }
+    return deficit;
+}
+
+// Take over a sounding voice for channel ch
+// Caller holds the lock of ch, and of the victim channel if different
+static void zed_pl_synth_steal_voice(struct zed_pl_card_data *prv, int victim_ch, int ch, int v)
+{
+    zed_pl_voice_unlink(prv, victim_ch, v);
+
+    // Release first, so that the new note triggers the envelope again
+    zed_pl_synth_release_voice(prv, v);
+    atomic_inc(&prv->policy.steals);
+}
+
+// Steal the oldest voice of a channel with lower priority than ch,
+// which is above its own reservation
+// Extra units of unison stacks go first, also from channels of the same priority:
+// the stack gets thinner rather than a note being dropped
+static int zed_pl_synth_steal_lower(struct zed_pl_card_data *prv, int ch)
+{
+    struct zed_pl_voice_policy *pol = &prv->policy;
+    struct zed_pl_voice_table  *vt  = &prv->voices;
+    int prio = READ_ONCE(pol->priority[ch]);
+    int best = -1;
+    int best_prio = prio;
+    bool best_stack = false;
+    uint32_t best_age = 0;
+    unsigned long flags;
+    int owner;
+    int v;
+
+    // Lock-free scan for a candidate; verified under the victim's lock
+    for (v = 0; v < prv->num_voices; v++) {
+        int state;
+        bool stack;
+        int p;
+
+        owner = READ_ONCE(vt->channel[v]);
+        state = READ_ONCE(vt->state[v]);
+
+        if (state == ZED_PL_VOICE_FREE || owner == ch) {
+            continue;
+        }
+        p     = READ_ONCE(pol->priority[owner]);
+        stack = (state == ZED_PL_VOICE_STACK);
+        if ((stack ? (p > prio) : (p >= prio)) ||
+            atomic_read(&pol->active[owner]) <= READ_ONCE(pol->reserved[owner])) {
+            continue;
+        }
+        if ((best < 0) || (stack && !best_stack) ||
+            ((stack == best_stack) && ((p < best_prio) ||
+             ((p == best_prio) && ((int32_t)(vt->age[v] - best_age) < 0))))) {
+            best       = v;
+            best_prio  = p;
+            best_stack = stack;
+            best_age   = vt->age[v];
+        }
+    }
+    if (best < 0) {
+        return -1;
+    }
+
+    // Never spin on another channel's lock while holding ours
+    owner = READ_ONCE(vt->channel[best]);
+    if (!spin_trylock_irqsave(&zed_ch_data[owner].lock, flags)) {
+        return -1;
+    }
+    if (vt->state[best] == ZED_PL_VOICE_FREE || vt->channel[best] != owner || owner == ch) {
+        spin_unlock_irqrestore(&zed_ch_data[owner].lock, flags);
+        return -1;
+    }
+    zed_pl_synth_steal_voice(prv, owner, ch, best);
+    spin_unlock_irqrestore(&zed_ch_data[owner].lock, flags);
+    return best;
+}
+
+// Oldest extra unit of the channel's unison stacks, -1 if none
+// (caller holds the channel lock)
+static int zed_pl_synth_stack_unit(struct zed_pl_card_data *prv, int ch)
+{
+    struct zed_pl_voice_table *vt = &prv->voices;
+    int v;
+
+    for_each_channel_voice(vt, &zed_ch_data[ch], v) {
+        if (vt->state[v] == ZED_PL_VOICE_STACK) {
+            return v;
+        }
+    }
+    return -1;
+}
+
+// Claim a unit that is free in the hardware and not claimed by the driver
+// Round robin: search from start to the last unit, then wrap around
+static int zed_pl_synth_claim_unit(struct zed_pl_card_data *prv, const unsigned long *claimed, int start)
+{
+    int end = prv->num_units;
+    int pass;
+    int u;
+
+    for (pass = 0; pass < 2; pass++) {
+        for (u = find_next_zero_bit(claimed, end, start); u < end;
+             u = find_next_zero_bit(claimed, end, u + 1)) {
+            // Another core may have taken it since the register was read
+            if (!test_and_set_bit_lock(u, prv->voice_busy)) {
+                return u;
+            }
+        }
+        end   = start;
+        start = 0;
+    }
+    return -1;
+}
+
+// Claim up to n free units for channel ch, returns the number claimed
+// (one pass over the free bitmap, whatever n is)
+// hw: read the free bitmap from the hardware, instead of the prediction
+static int zed_pl_synth_claim_free(struct zed_pl_card_data *prv, int ch, int active, bool hw,
+                                   int *units, int n)
+{
+    struct zed_pl_voice_policy *pol = &prv->policy;
+    DECLARE_BITMAP(claimed, ZED_PL_SYNTH_MAX_UNITS);
+    int reserved = READ_ONCE(pol->reserved[ch]);
+    int avail;
+    int unit_no;
+    int cur_pos;
+    int i;
+
+    // Units busy (or releasing), claimed by the driver, or owned by UIO clients
+    if (hw) {
+        zed_pl_synth_read_busy(prv, claimed);
+        zed_pl_predict_check(prv, claimed);
+    } else {
+        zed_pl_predict_busy(prv, claimed);
+    }
+    bitmap_or(claimed, claimed, prv->voice_busy, prv->num_units);
+    bitmap_or(claimed, claimed, prv->uio_units, prv->num_units);
+    cur_pos = atomic_read(&prv->alloc_cursor); // For round robin
+
+    // Free units beyond what other channels have reserved
+    // (units within the channel's own reservation are always available)
+    avail = prv->num_units - bitmap_weight(claimed, prv->num_units);
+    if (active + n > reserved) {
+        avail = max(avail - zed_pl_synth_reserve_deficit(prv, ch), reserved - active);
+    }
+    n = min(n, avail);
+
+    for (i = 0; i < n; i++) {
+        unit_no = zed_pl_synth_claim_unit(prv, claimed, (cur_pos + 1) % prv->num_units);
+        if (unit_no < 0) {
+            break;
+        }
+        __set_bit(unit_no, claimed);
+        units[i] = unit_no;
+        cur_pos  = unit_no;
+    }
+    if (i > 0) {
+        atomic_set(&prv->alloc_cursor, cur_pos);
+    }
+    return i;
+}
+
+// Allocate free synthesizer units for a note (n: unison stack size),
+// and add them to note tracker. Returns the number of units, 0 if the note is dropped.
+// Caller holds the channel lock. Units are claimed with an atomic
+// test-and-set on voice_busy, so channels on other cores can allocate
+// concurrently without a shared lock.
+// Channel quota, reservations of other channels and priority decide
+// whether a free unit may be used, or a sounding voice is taken over.
+// Only the first unit of a stack may take over a voice: without enough
+// free units the stack gets smaller, down to one unit.
+static int alloc_free_units(struct zed_pl_card_data *prv, int ch, int note, int vel, int *units, int n)
+{
+    struct zed_pl_voice_policy *pol = &prv->policy;
+    struct zed_pl_voice_table  *vt  = &prv->voices;
+    unsigned int verify = READ_ONCE(busy_verify);
+    uint32_t age;
+    bool hw;
+    int active;
+    int count;
+    int i;
+
+    if (!prv || !prv->addr_base) {
+        return 0;
+    }
+    active = atomic_read(&pol->active[ch]);
+
+    if (active >= READ_ONCE(pol->max_voices[ch])) {
+        // Over quota: reuse an extra unit of a stack, or the oldest voice of this channel
+        if (zed_ch_data[ch].voice_head == ZED_PL_VOICE_NONE) {
+            atomic_inc(&pol->dropped);
+            return 0;
+        }
+        units[0] = zed_pl_synth_stack_unit(prv, ch);
+        if (units[0] < 0) {
+            units[0] = zed_ch_data[ch].voice_head;
+        }
+        zed_pl_synth_steal_voice(prv, ch, ch, units[0]);
+        count = 1;
+        goto found;
+    }
+    n = min(n, READ_ONCE(pol->max_voices[ch]) - active);
+
+    // Predicted free units; the hardware is read every busy_verify allocations
+    hw = !verify || ((atomic_inc_return(&prv->predict.allocs) % verify) == 0);
+    count = zed_pl_synth_claim_free(prv, ch, active, hw, units, n);
+
+    // The prediction may be pessimistic: ask the hardware before giving up
+    if ((count == 0) && !hw) {
+        count = zed_pl_synth_claim_free(prv, ch, active, true, units, n);
+    }
+    if (count > 0) {
+        goto found;
+    }
+
+    // Units are full: render on the CPU, if enabled,
+    // then thin out a stack of this channel before taking from others
+    units[0] = zed_pl_overflow_alloc(prv);
+    if (units[0] < 0) {
+        units[0] = zed_pl_synth_stack_unit(prv, ch);
+        if (units[0] >= 0) {
+            zed_pl_synth_steal_voice(prv, ch, ch, units[0]);
+        }
+    }
+    if (units[0] < 0) {
+        units[0] = zed_pl_synth_steal_lower(prv, ch);
+    }
+    if (units[0] < 0) {
+        atomic_inc(&pol->dropped);
+        return 0;
+    }
+    count = 1;
+
+found:
+    if (count < n) {
+        atomic_inc(&pol->degraded);
+    }
+
+    // The units of a stack share the age of the note, and are linked one after the other
+    age = atomic_inc_return(&prv->voice_age);
+    for (i = 0; i < count; i++) {
+        int v = units[i];
+
+        vt->note[v]   = note;
+        vt->vel[v]    = vel;
+        vt->state[v]  = i ? ZED_PL_VOICE_STACK : ZED_PL_VOICE_ON;
+        vt->age[v]    = age;
+        vt->spread[v] = (count > 1) ? ((2 * i - (count - 1)) * 64) / (count - 1) : 0;
+
+        // Add voice to the channel
+        zed_pl_voice_link(prv, ch, v);
+    }
+    atomic_add(count - 1, &pol->stacked);
+    return count;
+}
+
+void zed_pl_synth_note_on(void *p, int note, int vel, struct snd_midi_channel *chan)
+{
+    struct zed_pl_port      *port = p;
+    struct zed_pl_card_data *prv  = port->prv;
+    struct zed_pl_channel_data *data;
+    struct zed_pl_unit_reg   reg;
+    unsigned long flags;
+    int units[ZED_PL_UNISON_MAX];
+    int count;
+    int ch = 0;
+    int i;
+
+    ch = zed_pl_synth_part(port, chan);
+    if (ch < 0) {
+        return ;
+    }
+
+    if ((note >= ZED_PL_NOTE_MAX) || (note < 0)) {
+        return ;
+    }
+
+    if (chan->drum_channel == 0) {
+        data = &zed_ch_data[ch];
+        spin_lock_irqsave(&data->lock, flags);
+
+        // Allocate units and add entries to tracker
+        // (MPE member notes are single voices, bend and pressure go to one unit)
+        count = alloc_free_units(prv, ch, note, vel, units, data->mpe_member ? 1 : data->unison);
+
+        // Whole words: the program template with the trigger, the note and its level
+        // (program changes are applied to the template when they arrive)
+        reg.ctl_reg.ctl_reg_all       = data->unit_reg.ctl_reg.ctl_reg_all | ZED_PL_CTL_TRIGGER;
+        reg.vca_eg_reg.vca_eg_reg_all = data->unit_reg.vca_eg_reg.vca_eg_reg_all;
+        for (i = 0; i < count; i++) {
+            reg.freq_reg.freq_reg_all = zed_pl_synth_voice_freq(data, &prv->voices, units[i], zed_pl_synth_pitch_cents(data));
+            reg.amp_reg.amp_reg_all   = zed_pl_synth_voice_amp(prv, units[i],
+                                                               zed_pl_synth_voice_level(data, &prv->voices, units[i], ZED_PL_GAIN_ONE));
+
+            // Write to register
+            zed_pl_synth_write_unit(prv, units[i], &reg);
+        }
+
+        if (count > 0) {
+            // Bend and pressure of a member channel go to its latest note
+            if (data->mpe_member) {
+                data->mpe_voice = units[0];
+            }
+            if (zed_pl_synth_mod_wanted(data)) {
+                zed_pl_synth_mod_start(prv, ch);
+            }
+        }
+        spin_unlock_irqrestore(&data->lock, flags);
+    } //else {
+        // TODO
+    //}
+}
+
+// Release the oldest note of this pitch, with the rest of its unison stack
+// Returns the number of units released (caller holds the channel lock)
+static int free_unit(struct zed_pl_card_data *prv, int ch, int note)
+{
+    struct zed_pl_voice_table *vt = &prv->voices;
+    uint32_t age;
+    int count = 0;
+    int v;
+
+    if (ch >= ZED_PL_SYNTH_NUM_PARTS) {
+        return 0;
+    }
+
+    if (note >= ZED_PL_NOTE_MAX) {
+        return 0;
+    }
+    for_each_channel_voice(vt, &zed_ch_data[ch], v) {
+        if (vt->note[v] == note) {
+            break;
+        }
+    }
+
+    // Units of a stack follow each other in the list, with the same age
+    age = (v != ZED_PL_VOICE_NONE) ? vt->age[v] : 0;
+    while ((v != ZED_PL_VOICE_NONE) && (vt->note[v] == note) && (vt->age[v] == age)) {
+        int next = vt->next[v];
+
+        // Detach from the channel; the unit bit is dropped after the write
+        zed_pl_voice_unlink(prv, ch, v);
+        zed_pl_synth_release_voice(prv, v);
+        zed_pl_synth_put_unit(prv, v);
+        v = next;
+        count++;
+    }
+    return count;
+}
+
+void zed_pl_synth_note_off(void *p, int note, int vel, struct snd_midi_channel *chan)
+{
+    struct zed_pl_port      *port = p;
+    struct zed_pl_card_data *prv  = port->prv;
+    unsigned long flags;
+    const int ch = zed_pl_synth_part(port, chan);
+
+    if (ch < 0) {
+        return ;
+    }
+
+    if (note >= ZED_PL_NOTE_MAX) {
+        return ;
+    }
+
+    if (chan->drum_channel == 0) {
+        spin_lock_irqsave(&zed_ch_data[ch].lock, flags);
+
+        // Find target units and release them
+        free_unit(prv, ch, note);
+        spin_unlock_irqrestore(&zed_ch_data[ch].lock, flags);
+    }
+}
+
+void zed_pl_synth_key_press(void *p, int note, int vel, struct snd_midi_channel *chan)
+{
+    zed_pl_synth_note_on(p, note, vel, chan);
+}
+
+void zed_pl_synth_terminate_note(void *p, int note, struct snd_midi_channel *chan)
+{
+    zed_pl_synth_note_off(p, note, 0, chan);
+}
+
+// Program change (caller holds the channel lock)
+void zed_pl_synth_program_change(struct zed_pl_card_data *prv, int ch, int pgm_num)
+{
+    if (!prv) {
+        return ;
+    }
+
+    if ((ch < 0) || (ch >= ZED_PL_SYNTH_NUM_PARTS)) {
+        return ;
+    }
+
+    BUILD_BUG_ON(ARRAY_SIZE(zed_pl_synth_preset_tones) != 128);
+    if ((pgm_num < 0) || (pgm_num > 127)) {
+        return ;
+    }
+
+    zed_ch_data[ch].unit_reg.ctl_reg.ctl_reg_all       = zed_pl_synth_preset_tones[pgm_num].wave_type;
+    zed_ch_data[ch].unit_reg.vca_eg_reg.vca_eg_reg_all = zed_pl_synth_preset_tones[pgm_num].vca_eg.vca_eg_all;
+    zed_ch_data[ch].unison                             = max_t(int, zed_pl_synth_preset_tones[pgm_num].unison, 1);
+    zed_ch_data[ch].midi_program                       = pgm_num;
+}
+
+// Program change event
+// Called from the event dispatcher, since the MIDI emulation only stores the program.
+// Loading it here keeps the preset lookup out of note-on.
+void zed_pl_synth_program(struct zed_pl_port *port, struct snd_midi_channel *chan)
+{
+    unsigned long flags;
+    int ch;
+
+    ch = zed_pl_synth_part(port, chan);
+    if (ch < 0) {
+        return ;
+    }
+
+    spin_lock_irqsave(&zed_ch_data[ch].lock, flags);
+    zed_pl_synth_program_change(port->prv, ch, chan->midi_program);
+    spin_unlock_irqrestore(&zed_ch_data[ch].lock, flags);
+}
+
+// Pitch bend (caller holds the channel lock)
+// On an MPE member channel only its voice is updated: no list walk, one register write
+static void zed_pl_synth_pitch_bend(struct zed_pl_card_data *prv, int ch, int bend)
+{
+    struct zed_pl_channel_data *data = &zed_ch_data[ch];
+    struct zed_pl_voice_table  *vt   = &prv->voices;
+    int v;
+
+    data->bend_cents = (bend * data->bend_range) / 8192;
+
+    if (data->mpe_member) {
+        v = data->mpe_voice;
+        if (v != ZED_PL_VOICE_NONE) {
+            typeof(prv->shadow_unit[v].freq_reg) freq = prv->shadow_unit[v].freq_reg;
+
+            freq.bit.freq = zed_pl_synth_voice_freq(data, vt, v, zed_pl_synth_pitch_cents(data));
+            zed_pl_synth_update_reg(prv, v, ZED_PL_REG_FREQ, freq.freq_reg_all);
+        }
+        return ;
+    }
+
+    for_each_channel_voice(vt, data, v) {
+        typeof(prv->shadow_unit[v].freq_reg) freq = prv->shadow_unit[v].freq_reg;
+
+        freq.bit.freq = zed_pl_synth_voice_freq(data, vt, v, zed_pl_synth_pitch_cents(data));
+        zed_pl_synth_update_reg(prv, v, ZED_PL_REG_FREQ, freq.freq_reg_all);
+    }
+}
+
+// Channel pressure (caller holds the channel lock)
+// MPE member channels only: raises the level of the voice from half (no pressure) to full
+static void zed_pl_synth_pressure(struct zed_pl_card_data *prv, int ch, int pressure)
+{
+    struct zed_pl_channel_data *data = &zed_ch_data[ch];
+    struct zed_pl_voice_table  *vt   = &prv->voices;
+    int v;
+
+    if (!data->mpe_member) {
+        return ;
+    }
+    data->press_gain = ZED_PL_GAIN_ONE / 2 + (pressure * ZED_PL_GAIN_ONE) / 254;
+    zed_pl_synth_calc_gain(data);
+
+    v = data->mpe_voice;
+    if (v == ZED_PL_VOICE_NONE) {
+        return ;
+    }
+    zed_pl_synth_update_reg(prv, v, ZED_PL_REG_AMP,
+                            zed_pl_synth_voice_amp(prv, v, zed_pl_synth_voice_level(data, vt, v, ZED_PL_GAIN_ONE)));
+}
+
+// MPE configuration message (RPN 6 on a manager channel)
+// Sets the member channels of the zone; the other zone shrinks if they overlap
+static void zed_pl_synth_mpe_config(struct zed_pl_port *port, int manager, int members)
+{
+    unsigned long flags;
+    int i;
+
+    members = min(members, ZED_PL_SYNTH_MIDI_CH - 1);
+    if (manager == 0) {
+        port->mpe_lower = members;
+        port->mpe_upper = min(port->mpe_upper, max(ZED_PL_SYNTH_MIDI_CH - 2 - members, 0));
+    } else if (manager == ZED_PL_SYNTH_MIDI_CH - 1) {
+        port->mpe_upper = members;
+        port->mpe_lower = min(port->mpe_lower, max(ZED_PL_SYNTH_MIDI_CH - 2 - members, 0));
+    } else {
+        return ;
+    }
+
+    for (i = 0; i < ZED_PL_SYNTH_MIDI_CH; i++) {
+        struct zed_pl_channel_data *data = &zed_ch_data[port->part_base + i];
+        bool member = ((i >= 1) && (i <= port->mpe_lower)) ||
+                      ((i <= ZED_PL_SYNTH_MIDI_CH - 2) && (i >= ZED_PL_SYNTH_MIDI_CH - 1 - port->mpe_upper));
+
+        spin_lock_irqsave(&data->lock, flags);
+        if (member != data->mpe_member) {
+            data->mpe_member = member;
+            data->mpe_voice  = ZED_PL_VOICE_NONE;
+            data->press_gain = ZED_PL_GAIN_ONE;
+            data->bend_cents = 0;
+            zed_pl_synth_calc_gain(data);
+        }
+        if (member) {
+            data->bend_range = ZED_PL_MPE_MEMBER_BEND;
+        } else if (i == manager) {
+            data->bend_range = ZED_PL_MPE_MANAGER_BEND;
+        }
+        spin_unlock_irqrestore(&data->lock, flags);
+    }
+}
+
+// Handle control change and program change
+void zed_pl_synth_control(void *p, int type, struct snd_midi_channel *chan)
+{
+    struct zed_pl_port      *port = p;
+    struct zed_pl_card_data *prv  = port->prv;
+    struct zed_pl_voice_table *vt = &prv->voices;
+    unsigned long flags;
+    int ch;
+    int v;
+
+    ch = zed_pl_synth_part(port, chan);
+    if (ch < 0) {
+        return ;
+    }
+
+    // Scene switch on any channel, takes the locks of the port's channels itself
+    if (type == ZED_PL_CC_SCENE) {
+        zed_pl_synth_scene_recall(port, chan->control[type] & ZED_PL_SCENE_MASK,
+                                  chan->control[type] & ZED_PL_SCENE_CUT);
+        return ;
+    }
+
+    spin_lock_irqsave(&zed_ch_data[ch].lock, flags);
+    switch (type) {
+    case MIDI_CTL_PITCHBEND:
+        zed_pl_synth_pitch_bend(prv, ch, chan->midi_pitchbend);
+        spin_unlock_irqrestore(&zed_ch_data[ch].lock, flags);
+        return ;
+    case MIDI_CTL_CHAN_PRESSURE:
+        zed_pl_synth_pressure(prv, ch, chan->midi_pressure);
+        spin_unlock_irqrestore(&zed_ch_data[ch].lock, flags);
+        return ;
+    default:
+        break;
+    }
+
+    // Control change
+    zed_ch_data[ch].vol = chan->gm_volume;
+    zed_ch_data[ch].exp = chan->gm_expression;
+    zed_ch_data[ch].pan = chan->gm_pan;
+    zed_ch_data[ch].mod = chan->gm_modulation;
+    zed_pl_synth_calc_gain(&zed_ch_data[ch]);
+
+    // Change volume (modulation follows on the next control tick)
+    for_each_channel_voice(vt, &zed_ch_data[ch], v) {
+        zed_pl_synth_update_reg(prv, v, ZED_PL_REG_AMP,
+                                zed_pl_synth_voice_amp(prv, v, zed_pl_synth_voice_level(&zed_ch_data[ch], vt, v, ZED_PL_GAIN_ONE)));
+    }
+    if (zed_pl_synth_mod_wanted(&zed_ch_data[ch])) {
+        zed_pl_synth_mod_start(prv, ch);
+    }
+    spin_unlock_irqrestore(&zed_ch_data[ch].lock, flags);
+}
+
+// Push channel parameters to its sounding voices in one pass
+// Only words that differ from the shadow are written
+static void zed_pl_synth_apply_params(struct zed_pl_card_data *prv, int ch)
+{
+    struct zed_pl_voice_table *vt   = &prv->voices;
+    struct zed_pl_unit_reg    *tmpl = &zed_ch_data[ch].unit_reg;
+    unsigned long flags;
+    int v;
+
+    spin_lock_irqsave(&zed_ch_data[ch].lock, flags);
+    for_each_channel_voice(vt, &zed_ch_data[ch], v) {
+        struct zed_pl_unit_reg *cur = &prv->shadow_unit[v];
+        typeof(cur->ctl_reg)  ctl  = tmpl->ctl_reg;
+        typeof(cur->freq_reg) freq = cur->freq_reg;
+
+        ctl.bit.trigger = cur->ctl_reg.bit.trigger;
+        freq.bit.freq   = zed_pl_synth_voice_freq(&zed_ch_data[ch], vt, v, zed_pl_synth_pitch_cents(&zed_ch_data[ch]));
+
+        if (freq.freq_reg_all != cur->freq_reg.freq_reg_all) {
+            zed_pl_synth_write_reg(prv, v, ZED_PL_REG_FREQ, freq.freq_reg_all);
+        }
+        if (ctl.ctl_reg_all != cur->ctl_reg.ctl_reg_all) {
+            zed_pl_synth_write_reg(prv, v, ZED_PL_REG_CTL, ctl.ctl_reg_all);
+        }
+        if (tmpl->vca_eg_reg.vca_eg_reg_all != cur->vca_eg_reg.vca_eg_reg_all) {
+            zed_pl_synth_write_reg(prv, v, ZED_PL_REG_VCA_EG, tmpl->vca_eg_reg.vca_eg_reg_all);
+        }
+    }
+    spin_unlock_irqrestore(&zed_ch_data[ch].lock, flags);
+}
+
+// Deferred, so that a burst of data entry messages costs one pass
+static void zed_pl_synth_params_work(struct work_struct *work)
+{
+    struct zed_pl_card_data *prv = container_of(work, struct zed_pl_card_data, params_work);
+    int ch;
+
+    for_each_set_bit(ch, prv->params_dirty, ZED_PL_SYNTH_NUM_PARTS) {
+        if (test_and_clear_bit(ch, prv->params_dirty)) {
+            zed_pl_synth_apply_params(prv, ch);
+        }
+    }
+}
+
+void zed_pl_synth_init_params(struct zed_pl_card_data *prv)
+{
+    bitmap_zero(prv->params_dirty, ZED_PL_SYNTH_NUM_PARTS);
+    INIT_WORK(&prv->params_work, zed_pl_synth_params_work);
+}
+
+void zed_pl_synth_release_params(struct zed_pl_card_data *prv)
+{
+    cancel_work_sync(&prv->params_work);
+}
+
+// Mark channel parameters changed (caller holds the channel lock)
+static void zed_pl_synth_params_changed(struct zed_pl_card_data *prv, int ch)
+{
+    if (!zed_ch_data[ch].live_update || (zed_ch_data[ch].voice_head == ZED_PL_VOICE_NONE)) {
+        return ;
+    }
+    set_bit(ch, prv->params_dirty);
+    schedule_work(&prv->params_work);
+}
+
+// NRPN: edit the channel's tone parameters
+// New notes pick them up from the channel template
+void zed_pl_synth_nrpn(void *p, struct snd_midi_channel *chan, struct snd_midi_channel_set *chset)
+{
+    struct zed_pl_port      *port = p;
+    struct zed_pl_card_data *prv  = port->prv;
+    struct zed_pl_unit_reg  *reg;
+    unsigned long flags;
+    int ch;
+    int param;
+    int data;
+    int val8;
+
+    ch = zed_pl_synth_part(port, chan);
+    if (ch < 0) {
+        return ;
+    }
+
+    if (chan->control[MIDI_CTL_NONREG_PARM_NUM_MSB] != ZED_PL_NRPN_MSB) {
+        return ;
+    }
+    param = chan->control[MIDI_CTL_NONREG_PARM_NUM_LSB];
+    data  = chan->control[MIDI_CTL_MSB_DATA_ENTRY];
+    val8  = (data << 1) | (chan->control[MIDI_CTL_LSB_DATA_ENTRY] >> 6);
+    reg   = &zed_ch_data[ch].unit_reg;
+
+    spin_lock_irqsave(&zed_ch_data[ch].lock, flags);
+    switch (param) {
+    case ZED_PL_NRPN_WAVE_TYPE:
+        if (data < ZED_PL_WAVE_RSVD) {
+            reg->ctl_reg.bit.wave_type = data;
+        }
+        break;
+    case ZED_PL_NRPN_VCA_ATTACK:
+        reg->vca_eg_reg.bit.vca_attack = val8;
+        break;
+    case ZED_PL_NRPN_VCA_DECAY:
+        reg->vca_eg_reg.bit.vca_decay = val8;
+        break;
+    case ZED_PL_NRPN_VCA_SUSTAIN:
+        reg->vca_eg_reg.bit.vca_sustain = val8;
+        break;
+    case ZED_PL_NRPN_VCA_RELEASE:
+        reg->vca_eg_reg.bit.vca_release = val8;
+        break;
+    case ZED_PL_NRPN_LFO_RATE:
+        zed_pl_synth_set_lfo_rate(&zed_ch_data[ch], data);
+        break;
+    case ZED_PL_NRPN_VIB_DEPTH:
+        zed_ch_data[ch].vib_depth = data;
+        break;
+    case ZED_PL_NRPN_TREM_DEPTH:
+        zed_ch_data[ch].trem_depth = data;
+        break;
+    case ZED_PL_NRPN_UNISON:
+        zed_ch_data[ch].unison = clamp(data, 1, ZED_PL_UNISON_MAX);
+        break;
+    case ZED_PL_NRPN_UNI_DETUNE:
+        zed_ch_data[ch].uni_detune = data;
+        break;
+    case ZED_PL_NRPN_UNI_SPREAD:
+        zed_ch_data[ch].uni_spread = data;
+        break;
+    case ZED_PL_NRPN_LIVE_UPDATE:
+        zed_ch_data[ch].live_update = (data >= 64);
+        break;
+    default:
+        break;
+    }
+    zed_pl_synth_params_changed(prv, ch);
+    if (zed_pl_synth_mod_wanted(&zed_ch_data[ch])) {
+        zed_pl_synth_mod_start(prv, ch);
+    }
+    spin_unlock_irqrestore(&zed_ch_data[ch].lock, flags);
+}
+
+// RPN: pitch bend range and tuning
+// Called from the event dispatcher, since the MIDI emulation has no RPN callback
+void zed_pl_synth_rpn(struct zed_pl_port *port, struct snd_midi_channel *chan)
+{
+    struct zed_pl_card_data *prv = port->prv;
+    unsigned long flags;
+    int ch;
+    int param;
+    int val;
+
+    ch = zed_pl_synth_part(port, chan);
+    if (ch < 0) {
+        return ;
+    }
+
+    param = (chan->control[MIDI_CTL_REGIST_PARM_NUM_MSB] << 7) | chan->control[MIDI_CTL_REGIST_PARM_NUM_LSB];
+    val   = (chan->control[MIDI_CTL_MSB_DATA_ENTRY] << 7) | chan->control[MIDI_CTL_LSB_DATA_ENTRY];
+
+    // Touches several channels, so it takes their locks itself
+    if (param == ZED_PL_RPN_MPE_CONFIG) {
+        zed_pl_synth_mpe_config(port, chan->number, chan->control[MIDI_CTL_MSB_DATA_ENTRY]);
+        return ;
+    }
+
+    spin_lock_irqsave(&zed_ch_data[ch].lock, flags);
+    switch (param) {
+    case ZED_PL_RPN_BEND_RANGE:
+        // MSB: semitones, LSB: cents
+        zed_ch_data[ch].bend_range = chan->control[MIDI_CTL_MSB_DATA_ENTRY] * 100 +
+                                     chan->control[MIDI_CTL_LSB_DATA_ENTRY];
+        break;
+    case ZED_PL_RPN_FINE_TUNE:
+        // 8192 = center, +/- 100 cents
+        zed_ch_data[ch].fine_cents = ((val - 8192) * 100) / 8192;
+        break;
+    case ZED_PL_RPN_COARSE_TUNE:
+        // MSB only, 64 = center, semitones
+        zed_ch_data[ch].coarse_semi = chan->control[MIDI_CTL_MSB_DATA_ENTRY] - 64;
+        break;
+    case ZED_PL_RPN_TUNING_PROG:
+        // MSB only
+        zed_ch_data[ch].tuning_prog = chan->control[MIDI_CTL_MSB_DATA_ENTRY] % ZED_PL_NUM_TUNINGS;
+        break;
+    default:
+        spin_unlock_irqrestore(&zed_ch_data[ch].lock, flags);
+        return ;
+    }
+    zed_ch_data[ch].tune_cents = zed_ch_data[ch].coarse_semi * 100 + zed_ch_data[ch].fine_cents;
+    zed_pl_synth_params_changed(prv, ch);
+    spin_unlock_irqrestore(&zed_ch_data[ch].lock, flags);
+}
+
+// Register burst sysex
+// F0 7D 5A <cmd> <count> <record> * count <checksum> F7
+// Register words are packed into 5 data bytes, 7 bits each, LSB first.
+// checksum: (cmd + count + records + checksum) & 0x7F == 0
+// Scene commands carry the scene number before their arguments:
+// load: F0 7D 5A 02 <scene> <count> <record> * count <checksum> F7
+// capture the current setup: F0 7D 5A 03 <scene> <checksum> F7
+// recall: F0 7D 5A 04 <scene> <cut> <checksum> F7
+#define ZED_PL_SYSEX_HDR_LEN     5
+#define ZED_PL_SYSEX_WORD_LEN    5
+#define ZED_PL_SYSEX_CMD_CHANNEL 0x01
+#define ZED_PL_SYSEX_CMD_SCENE_LOAD    0x02
+#define ZED_PL_SYSEX_CMD_SCENE_CAPTURE 0x03
+#define ZED_PL_SYSEX_CMD_SCENE_RECALL  0x04
+
+// Channel setup record
+// ch, program, volume, expression, pan, ctl word, vca_eg word
+#define ZED_PL_SYSEX_CH_REC_LEN  (5 + 2 * ZED_PL_SYSEX_WORD_LEN)
+
+struct zed_pl_sysex_ch_rec {
+    uint8_t  ch;
+    uint8_t  program;
+    uint8_t  vol;
+    uint8_t  exp;
+    uint8_t  pan;
+    uint32_t ctl;
+    uint32_t vca_eg;
+};
+
+// Scenes: preloaded channel setups of a port
+struct zed_pl_scene {
+    uint16_t                   mask;    // Channels set in the scene
+    struct zed_pl_sysex_ch_rec ch[ZED_PL_SYNTH_MIDI_CH];
+};
+
+static struct zed_pl_scene zed_scenes[ZED_PL_MAX_PORTS][ZED_PL_NUM_SCENES];
+static DEFINE_SPINLOCK(zed_scene_lock);
+
+static const unsigned char zed_pl_sysex_id[] = { 0xF0, 0x7D, 0x5A };
+
+bool zed_pl_synth_is_burst(const unsigned char *buf, int len)
+{
+    return (len >= sizeof(zed_pl_sysex_id)) &&
+           (memcmp(buf, zed_pl_sysex_id, sizeof(zed_pl_sysex_id)) == 0);
+}
+
+static int zed_pl_sysex_word(const unsigned char *buf, uint32_t *word)
+{
+    uint64_t val = 0;
+    int i;
+
+    for (i = ZED_PL_SYSEX_WORD_LEN - 1; i >= 0; i--) {
+        val = (val << 7) | buf[i];
+    }
+    if (val > U32_MAX) {
+        return -EINVAL;
+    }
+    *word = val;
+    return 0;
+}
+
+// Apply one channel record (caller holds the channel lock)
+// voices: also update the sounding voices, otherwise only new notes get the setup
+static void zed_pl_sysex_apply_channel(struct zed_pl_port *port, const struct zed_pl_sysex_ch_rec *rec, bool voices)
+{
+    struct zed_pl_card_data     *prv  = port->prv;
+    struct zed_pl_voice_table   *vt   = &prv->voices;
+    struct zed_pl_channel_data  *data = &zed_ch_data[port->part_base + rec->ch];
+    struct snd_midi_channel     *chan = &port->chset->channels[rec->ch];
+    int v;
+
+    // Keep the MIDI emulation in sync with the channel
+    chan->midi_program  = rec->program;
+    chan->gm_volume     = rec->vol;
+    chan->gm_expression = rec->exp;
+    chan->gm_pan        = rec->pan;
+
+    data->midi_program                  = rec->program;
+    data->vol                           = rec->vol;
+    data->exp                           = rec->exp;
+    data->pan                           = rec->pan;
+    data->unit_reg.ctl_reg.ctl_reg_all       = rec->ctl;
+    data->unit_reg.vca_eg_reg.vca_eg_reg_all = rec->vca_eg;
+    data->unison                        = max_t(int, zed_pl_synth_preset_tones[rec->program].unison, 1);
+    zed_pl_synth_calc_gain(data);
+
+    if (!voices) {
+        return ;
+    }
+    for_each_channel_voice(vt, data, v) {
+        zed_pl_synth_write_amp(prv, v, zed_pl_synth_voice_amp(prv, v, zed_pl_synth_voice_level(data, vt, v, ZED_PL_GAIN_ONE)));
+    }
+    zed_pl_synth_params_changed(prv, port->part_base + rec->ch);
+}
+
+// Switch the port to a scene, one lock acquisition per channel
+// Sounding voices keep their tone and level until they end, unless cut
+int zed_pl_synth_scene_recall(struct zed_pl_port *port, int scene, bool cut)
+{
+    struct zed_pl_scene snap;
+    unsigned long flags;
+    int i;
+
+    if ((scene < 0) || (scene >= ZED_PL_NUM_SCENES)) {
+        return -EINVAL;
+    }
+
+    spin_lock_irqsave(&zed_scene_lock, flags);
+    snap = zed_scenes[port->index][scene];
+    spin_unlock_irqrestore(&zed_scene_lock, flags);
+    if (!snap.mask) {
+        return -ENOENT;
+    }
+
+    for (i = 0; i < ZED_PL_SYNTH_MIDI_CH; i++) {
+        int part = port->part_base + i;
+
+        if (!(snap.mask & BIT(i))) {
+            continue;
+        }
+        spin_lock_irqsave(&zed_ch_data[part].lock, flags);
+        if (cut) {
+            zed_pl_synth_release_channel(port->prv, part, true);
+        }
+        zed_pl_sysex_apply_channel(port, &snap.ch[i], false);
+        spin_unlock_irqrestore(&zed_ch_data[part].lock, flags);
+    }
+    return 0;
+}
+
+// Store the current setup of the port's channels in a scene
+static void zed_pl_synth_scene_capture(struct zed_pl_port *port, int scene)
+{
+    struct zed_pl_scene snap;
+    unsigned long flags;
+    int i;
+
+    snap.mask = BIT(ZED_PL_SYNTH_MIDI_CH) - 1;
+    for (i = 0; i < ZED_PL_SYNTH_MIDI_CH; i++) {
+        struct zed_pl_channel_data *data = &zed_ch_data[port->part_base + i];
+        struct zed_pl_sysex_ch_rec *rec  = &snap.ch[i];
+
+        spin_lock_irqsave(&data->lock, flags);
+        rec->ch      = i;
+        rec->program = data->midi_program;
+        rec->vol     = data->vol;
+        rec->exp     = data->exp;
+        rec->pan     = data->pan;
+        rec->ctl     = data->unit_reg.ctl_reg.ctl_reg_all;
+        rec->vca_eg  = data->unit_reg.vca_eg_reg.vca_eg_reg_all;
+        spin_unlock_irqrestore(&data->lock, flags);
+    }
+
+    spin_lock_irqsave(&zed_scene_lock, flags);
+    zed_scenes[port->index][scene] = snap;
+    spin_unlock_irqrestore(&zed_scene_lock, flags);
+}
+
+// Replace a scene with the channel records of a message
+static void zed_pl_synth_scene_load(struct zed_pl_port *port, int scene,
+                                    const struct zed_pl_sysex_ch_rec *recs, int count)
+{
+    struct zed_pl_scene snap;
+    unsigned long flags;
+    int i;
+
+    memset(&snap, 0, sizeof(snap));
+    for (i = 0; i < count; i++) {
+        snap.mask |= BIT(recs[i].ch);
+        snap.ch[recs[i].ch] = recs[i];
+    }
+
+    spin_lock_irqsave(&zed_scene_lock, flags);
+    zed_scenes[port->index][scene] = snap;
+    spin_unlock_irqrestore(&zed_scene_lock, flags);
+}
+
+// Parse the channel records of a message
+static int zed_pl_sysex_parse_recs(const unsigned char *rec, int count, struct zed_pl_sysex_ch_rec *recs)
+{
+    int i;
+
+    for (i = 0; i < count; i++, rec += ZED_PL_SYSEX_CH_REC_LEN) {
+        struct zed_pl_sysex_ch_rec *r = &recs[i];
+        typeof(zed_ch_data[0].unit_reg.ctl_reg) ctl;
+
+        r->ch      = rec[0];
+        r->program = rec[1];
+        r->vol     = rec[2];
+        r->exp     = rec[3];
+        r->pan     = rec[4];
+        if ((r->ch >= ZED_PL_SYNTH_MIDI_CH) || (r->program >= ARRAY_SIZE(zed_pl_synth_preset_tones)) ||
+            zed_pl_sysex_word(rec + 5, &r->ctl) ||
+            zed_pl_sysex_word(rec + 5 + ZED_PL_SYSEX_WORD_LEN, &r->vca_eg)) {
+            return -EINVAL;
+        }
+
+        // Only the wave type may be set, trigger is owned by the driver
+        ctl.ctl_reg_all = r->ctl;
+        if ((ctl.bit.wave_type >= ZED_PL_WAVE_RSVD) || ctl.bit.trigger || ctl.bit.rsvd) {
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+// Validate the whole message first, nothing is applied on error
+int zed_pl_synth_sysex_burst(struct zed_pl_port *port, const unsigned char *buf, int len)
+{
+    struct zed_pl_sysex_ch_rec recs[ZED_PL_SYNTH_MIDI_CH];
+    unsigned long flags;
+    uint8_t sum = 0;
+    int scene;
+    int count;
+    int i;
+
+    if (!zed_pl_synth_is_burst(buf, len) || (len < ZED_PL_SYSEX_HDR_LEN + 2) || (buf[len - 1] != 0xF7)) {
+        return -EINVAL;
+    }
+
+    for (i = 1; i < len - 1; i++) {
+        if (buf[i] & 0x80) {
+            return -EINVAL;
+        }
+    }
+    for (i = sizeof(zed_pl_sysex_id); i < len - 1; i++) {
+        sum += buf[i];
+    }
+    if (sum & 0x7F) {
+        dev_dbg(port->prv->dev, "Sysex checksum error.\n");
+        return -EBADMSG;
+    }
+
+    switch (buf[3]) {
+    case ZED_PL_SYSEX_CMD_CHANNEL:
+        count = buf[4];
+        if ((count == 0) || (count > ZED_PL_SYNTH_MIDI_CH) ||
+            (len != ZED_PL_SYSEX_HDR_LEN + count * ZED_PL_SYSEX_CH_REC_LEN + 2) ||
+            zed_pl_sysex_parse_recs(buf + ZED_PL_SYSEX_HDR_LEN, count, recs)) {
+            return -EINVAL;
+        }
+
+        for (i = 0; i < count; i++) {
+            int part = port->part_base + recs[i].ch;
+
+            spin_lock_irqsave(&zed_ch_data[part].lock, flags);
+            zed_pl_sysex_apply_channel(port, &recs[i], true);
+            spin_unlock_irqrestore(&zed_ch_data[part].lock, flags);
+        }
+        return 0;
+    case ZED_PL_SYSEX_CMD_SCENE_LOAD:
+        scene = buf[4];
+        count = (len > ZED_PL_SYSEX_HDR_LEN + 2) ? buf[5] : 0;
+        if ((scene >= ZED_PL_NUM_SCENES) || (count == 0) || (count > ZED_PL_SYNTH_MIDI_CH) ||
+            (len != ZED_PL_SYSEX_HDR_LEN + 1 + count * ZED_PL_SYSEX_CH_REC_LEN + 2) ||
+            zed_pl_sysex_parse_recs(buf + ZED_PL_SYSEX_HDR_LEN + 1, count, recs)) {
+            return -EINVAL;
+        }
+        zed_pl_synth_scene_load(port, scene, recs, count);
+        return 0;
+    case ZED_PL_SYSEX_CMD_SCENE_CAPTURE:
+        scene = buf[4];
+        if ((scene >= ZED_PL_NUM_SCENES) || (len != ZED_PL_SYSEX_HDR_LEN + 2)) {
+            return -EINVAL;
+        }
+        zed_pl_synth_scene_capture(port, scene);
+        return 0;
+    case ZED_PL_SYSEX_CMD_SCENE_RECALL:
+        if (len != ZED_PL_SYSEX_HDR_LEN + 3) {
+            return -EINVAL;
+        }
+        return zed_pl_synth_scene_recall(port, buf[4], buf[5]);
+    default:
+        return -EOPNOTSUPP;
+    }
+}
+
+// MIDI Tuning Standard messages
+// F0 7E <dev> 08 01 <prog> <name:16> <128 x xx yy zz> <checksum> F7: bulk dump
+// F0 7F <dev> 08 02 <prog> <count> <count x kk xx yy zz> F7: single note change
+#define ZED_PL_MTS_NON_RT      0x7E
+#define ZED_PL_MTS_RT          0x7F
+#define ZED_PL_MTS_SUB_ID      0x08
+#define ZED_PL_MTS_BULK_DUMP   0x01
+#define ZED_PL_MTS_NOTE_CHANGE 0x02
+#define ZED_PL_MTS_NAME_LEN    16
+#define ZED_PL_MTS_BULK_LEN    (8 + ZED_PL_MTS_NAME_LEN + 3 * ARRAY_SIZE(note_freq))
+
+// Only messages for this device or for all devices (7F)
+bool zed_pl_synth_is_mts(const unsigned char *buf, int len)
+{
+    return (len >= 4) && (buf[0] == 0xF0) && ((buf[1] == ZED_PL_MTS_NON_RT) || (buf[1] == ZED_PL_MTS_RT)) &&
+           ((buf[2] == 0x7F) || (buf[2] == READ_ONCE(sysex_dev_id))) && (buf[3] == ZED_PL_MTS_SUB_ID);
+}
+
+// Set the pitch of one note, xx yy zz: semitone and 14 bit fraction
+// (7F 7F 7F: no change)
+static void zed_pl_tuning_set(struct zed_pl_tuning *tun, int note, const unsigned char *xyz)
+{
+    int pitch;
+
+    if ((note >= ARRAY_SIZE(note_freq)) || ((xyz[0] == 0x7F) && (xyz[1] == 0x7F) && (xyz[2] == 0x7F))) {
+        return ;
+    }
+    pitch = ((xyz[0] & 0x7F) << ZED_PL_TUNING_FRAC_BITS) | ((xyz[1] & 0x7F) << 7) | (xyz[2] & 0x7F);
+    tun->pitch[note] = pitch;
+    tun->freq[note]  = zed_pl_synth_pitch_freq(pitch);
+}
+
+// Publish an edited copy of a tuning program
+// keyed: records are kk xx yy zz, otherwise xx yy zz from note 0
+static int zed_pl_tuning_edit(int prog, const unsigned char *rec, int count, bool keyed)
+{
+    struct zed_pl_tuning *old;
+    struct zed_pl_tuning *tun;
+    unsigned long flags;
+    int i;
+
+    tun = kmalloc(sizeof(*tun), GFP_ATOMIC);
+    if (!tun) {
+        return -ENOMEM;
+    }
+
+    spin_lock_irqsave(&zed_tuning_lock, flags);
+    old = rcu_dereference_protected(zed_tunings[prog], lockdep_is_held(&zed_tuning_lock));
+    for (i = 0; i < ARRAY_SIZE(note_freq); i++) {
+        tun->pitch[i] = old ? old->pitch[i] : i << ZED_PL_TUNING_FRAC_BITS;
+        tun->freq[i]  = old ? old->freq[i]  : note_freq[i];
+    }
+    for (i = 0; i < count; i++) {
+        if (keyed) {
+            zed_pl_tuning_set(tun, rec[0], &rec[1]);
+            rec += 4;
+        } else {
+            zed_pl_tuning_set(tun, i, rec);
+            rec += 3;
+        }
+    }
+    rcu_assign_pointer(zed_tunings[prog], tun);
+    spin_unlock_irqrestore(&zed_tuning_lock, flags);
+
+    if (old) {
+        kfree_rcu(old, rcu);
+    }
+    return 0;
+}
+
+// Retune the sounding voices of the channels on a tuning program
+static void zed_pl_synth_retune(struct zed_pl_card_data *prv, int prog)
+{
+    struct zed_pl_voice_table *vt = &prv->voices;
+    unsigned long flags;
+    int i;
+    int ch;
+    int v;
+
+    for (i = 0; i < prv->num_ports; i++) {
+        for (ch = prv->ports[i].part_base; ch < prv->ports[i].part_base + ZED_PL_SYNTH_MIDI_CH; ch++) {
+            struct zed_pl_channel_data *data = &zed_ch_data[ch];
+
+            spin_lock_irqsave(&data->lock, flags);
+            if (data->tuning_prog == prog) {
+                for_each_channel_voice(vt, data, v) {
+                    typeof(prv->shadow_unit[v].freq_reg) freq = prv->shadow_unit[v].freq_reg;
+
+                    freq.bit.freq = zed_pl_synth_voice_freq(data, vt, v, zed_pl_synth_pitch_cents(data));
+                    zed_pl_synth_update_reg(prv, v, ZED_PL_REG_FREQ, freq.freq_reg_all);
+                }
+            }
+            spin_unlock_irqrestore(&data->lock, flags);
+        }
+    }
+}
+
+// Only the pairs MTS defines: non-realtime bulk dump, realtime single note change
+// (which also retunes the sounding notes)
+int zed_pl_synth_mts(struct zed_pl_port *port, const unsigned char *buf, int len)
+{
+    unsigned char sum = 0;
+    int prog;
+    int ret;
+    int i;
+
+    if (!zed_pl_synth_is_mts(buf, len) || (len < 8) || (buf[len - 1] != 0xF7)) {
+        return -EINVAL;
+    }
+    prog = buf[5];
+    if (prog >= ZED_PL_NUM_TUNINGS) {
+        return -EINVAL;
+    }
+
+    switch (buf[4]) {
+    case ZED_PL_MTS_BULK_DUMP:
+        if (buf[1] != ZED_PL_MTS_NON_RT) {
+            return -EOPNOTSUPP;
+        }
+        if (len != ZED_PL_MTS_BULK_LEN) {
+            return -EINVAL;
+        }
+        // XOR of the bytes from 7E to the last data byte
+        for (i = 1; i < len - 2; i++) {
+            sum ^= buf[i];
+        }
+        if ((sum & 0x7F) != buf[len - 2]) {
+            return -EBADMSG;
+        }
+        ret = zed_pl_tuning_edit(prog, &buf[6 + ZED_PL_MTS_NAME_LEN], ARRAY_SIZE(note_freq), false);
+        break;
+    case ZED_PL_MTS_NOTE_CHANGE:
+        if (buf[1] != ZED_PL_MTS_RT) {
+            return -EOPNOTSUPP;
+        }
+        if (len != 8 + 4 * buf[6]) {
+            return -EINVAL;
+        }
+        ret = zed_pl_tuning_edit(prog, &buf[7], buf[6], true);
+        if (ret == 0) {
+            zed_pl_synth_retune(port->prv, prog);
+        }
+        break;
+    default:
+        return -EOPNOTSUPP;
+    }
+    return ret;
+}
+
+// Back to equal temperament, called at remove
+void zed_pl_synth_release_tunings(void)
+{
+    struct zed_pl_tuning *tun;
+    unsigned long flags;
+    int i;
+
+    for (i = 0; i < ZED_PL_NUM_TUNINGS; i++) {
+        spin_lock_irqsave(&zed_tuning_lock, flags);
+        tun = rcu_dereference_protected(zed_tunings[i], lockdep_is_held(&zed_tuning_lock));
+        RCU_INIT_POINTER(zed_tunings[i], NULL);
+        spin_unlock_irqrestore(&zed_tuning_lock, flags);
+        if (tun) {
+            kfree_rcu(tun, rcu);
+        }
+    }
+}
+
+void zed_pl_synth_sysex(void *p, unsigned char *buf, int len, int parsed, struct snd_midi_channel_set *chset)
+{
+    struct zed_pl_port      *port = p;
+    struct zed_pl_card_data *prv  = port->prv;
+    int ret;
+
+    // Tuning messages that fit the emulation's buffer (longer ones are taken before it)
+    if (!parsed && zed_pl_synth_is_mts(buf, len)) {
+        ret = zed_pl_synth_mts(port, buf, len);
+        if (ret < 0) {
+            dev_dbg(prv->dev, "Invalid tuning message (%d).\n", ret);
+        }
+        return ;
+    }
 
     // Handle GM/GS/XG resets only
+    // Sysex runs in process context: deliveries in atomic context are
+    // deferred to the ordered MIDI worker (zed_pl_synth_event_input)
     switch (parsed) {
     case SNDRV_MIDI_SYSEX_GM_ON:
     case SNDRV_MIDI_MODE_GS:
     case SNDRV_MIDI_MODE_XG:
+        might_sleep();
         mutex_lock(&prv->access_mutex);
-        zed_pl_synth_midi_reset_event(p);
+        zed_pl_synth_midi_reset_event(port);
         mutex_unlock(&prv->access_mutex);
         break;
     }
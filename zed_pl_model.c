@@ -0,0 +1,102 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Zedboard PL synthesizer software model
+ *
+ * @author Yuhei Horibe
+ * Oscillator: 32-bit phase accumulator, freq register is in Hz
+ *   square: +/-32767, saw: top 16 bits of the phase,
+ *   triangle: folded top 17 bits of the phase
+ * VCA envelope: linear segments, 2 ms per step of the 8-bit A/D/R values,
+ *   sustain level is sustain / 255, triggered by ctl.trigger edges
+ * Output: (osc * env >> 15) * amp >> 7 per channel, mixed and saturated
+ *
+ * Rendering is in zed_pl_model_render.c.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under  the terms of the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the License, or (at your
+ * option) any later version.
+ */
+
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/math64.h>
+#else
+#include <string.h>
+#endif
+#include "zed_pl_model.h"
+
+static uint32_t zed_pl_model_phase_inc(uint32_t freq, unsigned int rate)
+{
+#ifdef __KERNEL__
+    return div_u64((uint64_t)freq << 32, rate);
+#else
+    return ((uint64_t)freq << 32) / rate;
+#endif
+}
+
+// Per-sample step of a segment from 0 to full scale
+static int32_t zed_pl_model_eg_step(unsigned int val, unsigned int rate)
+{
+    uint32_t samples = val * ZED_PL_EG_MS_STEP * rate / 1000;
+
+    return samples ? (ZED_PL_MODEL_EG_ONE / samples) : ZED_PL_MODEL_EG_ONE;
+}
+
+static void zed_pl_model_update_unit(struct zed_pl_model *m, struct zed_pl_model_unit *u)
+{
+    uint32_t eg = u->regs[2];
+
+    u->inc    = zed_pl_model_phase_inc(u->regs[0] & 0xFFFF, m->rate);
+    u->step_a = zed_pl_model_eg_step(eg & 0xFF, m->rate);
+    u->step_d = zed_pl_model_eg_step((eg >> 8) & 0xFF, m->rate);
+    u->sus    = ((eg >> 16) & 0xFF) * 0x10101;
+    u->step_r = zed_pl_model_eg_step((eg >> 24) & 0xFF, m->rate);
+}
+
+void zed_pl_model_init(struct zed_pl_model *m, struct zed_pl_model_unit *units, int num_units)
+{
+    int i;
+
+    memset(units, 0, num_units * sizeof(*units));
+    m->num_units = num_units;
+    m->units     = units;
+    m->audio_ctl = 0;
+    m->rate      = ZED_PL_MODEL_RATE_48K;
+    for (i = 0; i < num_units; i++) {
+        zed_pl_model_update_unit(m, &units[i]);
+    }
+}
+
+void zed_pl_model_write_unit(struct zed_pl_model *m, int unit_no, int word, uint32_t val)
+{
+    struct zed_pl_model_unit *u = &m->units[unit_no];
+    uint32_t old = u->regs[word];
+
+    u->regs[word] = val;
+    zed_pl_model_update_unit(m, u);
+
+    // ctl.trigger edges start and release the envelope
+    if (word == 1) {
+        bool was = (old >> 2) & 1;
+        bool now = (val >> 2) & 1;
+
+        if (now && !was) {
+            u->state = ZED_PL_EG_ATTACK;
+        } else if (!now && was && (u->state != ZED_PL_EG_IDLE)) {
+            u->state = ZED_PL_EG_RELEASE;
+        }
+    }
+}
+
+void zed_pl_model_write_audio_ctl(struct zed_pl_model *m, uint32_t val)
+{
+    int i;
+
+    m->audio_ctl = val;
+    m->rate      = (val & 1) ? ZED_PL_MODEL_RATE_96K : ZED_PL_MODEL_RATE_48K;
+    for (i = 0; i < m->num_units; i++) {
+        zed_pl_model_update_unit(m, &m->units[i]);
+    }
+}
@@ -0,0 +1,93 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Zedboard PL synthesizer software model
+ *
+ * @author Yuhei Horibe
+ * Software model of the synth units.
+ * Takes the same register writes as the PL block and renders stereo PCM.
+ * Plain C with fixed point arithmetic, so that it builds in the kernel
+ * and in the userspace tools.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under  the terms of the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the License, or (at your
+ * option) any later version.
+ */
+
+#ifndef ZED_PL_MODEL_H
+#define ZED_PL_MODEL_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdint.h>
+#include <stdbool.h>
+#endif
+
+// Envelope time per step of vca_attack/decay/release, as in the PL block
+// (also used by the driver to predict unit release)
+#define ZED_PL_EG_MS_STEP 2
+
+// Envelope full scale (Q24)
+#define ZED_PL_MODEL_EG_ONE (1 << 24)
+
+// Frames rendered per inner loop pass
+#define ZED_PL_MODEL_BLOCK 64
+
+// Sample rate selected by audio_ctl.aud_clk_sel
+#define ZED_PL_MODEL_RATE_48K 48000
+#define ZED_PL_MODEL_RATE_96K 96000
+
+enum zed_pl_model_eg_state {
+    ZED_PL_EG_IDLE = 0,
+    ZED_PL_EG_ATTACK,
+    ZED_PL_EG_DECAY,
+    ZED_PL_EG_SUSTAIN,
+    ZED_PL_EG_RELEASE,
+};
+
+struct zed_pl_model_unit {
+    uint32_t regs[4];       // freq, ctl, vca_eg, amp
+
+    // Oscillator
+    uint32_t phase;
+    uint32_t inc;
+
+    // VCA envelope (Q24)
+    int32_t  env;
+    int32_t  sus;
+    int32_t  step_a;
+    int32_t  step_d;
+    int32_t  step_r;
+    uint8_t  state;
+};
+
+struct zed_pl_model {
+    int                       num_units;
+    unsigned int              rate;
+    uint32_t                  audio_ctl;
+    struct zed_pl_model_unit *units;
+
+    // Block buffers
+    int32_t env[ZED_PL_MODEL_BLOCK] __attribute__((aligned(16)));
+    int32_t mix_l[ZED_PL_MODEL_BLOCK] __attribute__((aligned(16)));
+    int32_t mix_r[ZED_PL_MODEL_BLOCK] __attribute__((aligned(16)));
+};
+
+void zed_pl_model_init(struct zed_pl_model *m, struct zed_pl_model_unit *units, int num_units);
+void zed_pl_model_write_unit(struct zed_pl_model *m, int unit_no, int word, uint32_t val);
+void zed_pl_model_write_audio_ctl(struct zed_pl_model *m, uint32_t val);
+
+// Unit is still sounding (the unit_free_reg bit)
+static inline bool zed_pl_model_unit_busy(const struct zed_pl_model *m, int unit_no)
+{
+    return m->units[unit_no].state != ZED_PL_EG_IDLE;
+}
+
+// Render interleaved stereo frames
+void zed_pl_model_render(struct zed_pl_model *m, int16_t *out, int frames);
+
+// Same output without the vector inner loops (reference for the SIMD path)
+void zed_pl_model_render_scalar(struct zed_pl_model *m, int16_t *out, int frames);
+
+#endif
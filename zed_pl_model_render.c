@@ -0,0 +1,212 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Zedboard PL synthesizer software model (rendering)
+ *
+ * @author Yuhei Horibe
+ * The inner loops use GCC vector extensions, which map to NEON on the
+ * Cortex-A9 and SSE2 on x86. Both paths give identical output.
+ * In the kernel this file is built with NEON enabled, so rendering
+ * must run between kernel_neon_begin() and kernel_neon_end().
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under  the terms of the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the License, or (at your
+ * option) any later version.
+ */
+
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/string.h>
+#else
+#include <string.h>
+#endif
+#include "zed_pl_model.h"
+
+typedef int32_t  zed_v4si __attribute__((vector_size(16)));
+typedef uint32_t zed_v4su __attribute__((vector_size(16)));
+
+// Envelope of one block in Q15
+static void zed_pl_model_eg_block(struct zed_pl_model_unit *u, int32_t *env, int frames)
+{
+    int i;
+
+    // Held notes are the common case
+    if (u->state == ZED_PL_EG_SUSTAIN) {
+        u->env = u->sus;
+        for (i = 0; i < frames; i++) {
+            env[i] = u->sus >> 9;
+        }
+        return ;
+    }
+
+    for (i = 0; i < frames; i++) {
+        env[i] = u->env >> 9;
+
+        switch (u->state) {
+        case ZED_PL_EG_ATTACK:
+            u->env += u->step_a;
+            if (u->env >= ZED_PL_MODEL_EG_ONE) {
+                u->env   = ZED_PL_MODEL_EG_ONE - 1;
+                u->state = ZED_PL_EG_DECAY;
+            }
+            break;
+        case ZED_PL_EG_DECAY:
+            u->env -= u->step_d;
+            if (u->env <= u->sus) {
+                u->env   = u->sus;
+                u->state = ZED_PL_EG_SUSTAIN;
+            }
+            break;
+        case ZED_PL_EG_SUSTAIN:
+            u->env = u->sus;
+            break;
+        case ZED_PL_EG_RELEASE:
+            u->env -= u->step_r;
+            if (u->env <= 0) {
+                u->env   = 0;
+                u->state = ZED_PL_EG_IDLE;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+static inline int32_t zed_pl_model_osc(uint32_t wave, uint32_t p)
+{
+    uint32_t t;
+
+    switch (wave) {
+    case 0:
+        return (p & 0x80000000) ? -32767 : 32767;
+    case 1:
+        return (int32_t)p >> 16;
+    case 2:
+        t = p >> 15;
+        return (int32_t)((t < 0x10000) ? t : (0x1FFFF - t)) - 32768;
+    default:
+        return 0;
+    }
+}
+
+// Samples are halved before the amp scaling: a full-scale sample times
+// a full-scale amp (16 bits each) would not fit in 32 bits
+static void zed_pl_model_unit_scalar(struct zed_pl_model *m, struct zed_pl_model_unit *u, int frames)
+{
+    uint32_t wave  = u->regs[1] & 0x3;
+    int32_t  amp_l = u->regs[3] & 0xFFFF;
+    int32_t  amp_r = u->regs[3] >> 16;
+    int i;
+
+    for (i = 0; i < frames; i++) {
+        int32_t s = (zed_pl_model_osc(wave, u->phase) * m->env[i]) >> 15;
+
+        m->mix_l[i] += ((s >> 1) * amp_l) >> 6;
+        m->mix_r[i] += ((s >> 1) * amp_r) >> 6;
+        u->phase    += u->inc;
+    }
+}
+
+// 4 frames per step, frames is a multiple of 4
+static void zed_pl_model_unit_vector(struct zed_pl_model *m, struct zed_pl_model_unit *u, int frames)
+{
+    const zed_v4si amp_l = (zed_v4si){ 1, 1, 1, 1 } * (int32_t)(u->regs[3] & 0xFFFF);
+    const zed_v4si amp_r = (zed_v4si){ 1, 1, 1, 1 } * (int32_t)(u->regs[3] >> 16);
+    const zed_v4su step  = (zed_v4su){ 4, 4, 4, 4 } * u->inc;
+    zed_v4su p = (zed_v4su){ 0, 1, 2, 3 } * u->inc + u->phase;
+    zed_v4si *env = (zed_v4si *)m->env;
+    zed_v4si *l   = (zed_v4si *)m->mix_l;
+    zed_v4si *r   = (zed_v4si *)m->mix_r;
+    int n = frames / 4;
+    int i;
+
+    // One loop per wave type keeps the loop bodies branch free
+    switch (u->regs[1] & 0x3) {
+    case 0:
+        for (i = 0; i < n; i++, p += step) {
+            zed_v4si s = (((zed_v4si)p >> 31) | 1) * 32767;
+
+            s     = (s * env[i]) >> 15;
+            l[i] += ((s >> 1) * amp_l) >> 6;
+            r[i] += ((s >> 1) * amp_r) >> 6;
+        }
+        break;
+    case 1:
+        for (i = 0; i < n; i++, p += step) {
+            zed_v4si s = (zed_v4si)p >> 16;
+
+            s     = (s * env[i]) >> 15;
+            l[i] += ((s >> 1) * amp_l) >> 6;
+            r[i] += ((s >> 1) * amp_r) >> 6;
+        }
+        break;
+    case 2:
+        for (i = 0; i < n; i++, p += step) {
+            zed_v4si t    = (zed_v4si)(p >> 15);
+            zed_v4si fold = (t << 15) >> 31;
+            zed_v4si s    = ((t ^ fold) & 0xFFFF) - 32768;
+
+            s     = (s * env[i]) >> 15;
+            l[i] += ((s >> 1) * amp_l) >> 6;
+            r[i] += ((s >> 1) * amp_r) >> 6;
+        }
+        break;
+    default:
+        break;
+    }
+    u->phase += u->inc * frames;
+}
+
+static inline int16_t zed_pl_model_sat16(int32_t v)
+{
+    return (v > 32767) ? 32767 : ((v < -32768) ? -32768 : v);
+}
+
+static void zed_pl_model_render_block(struct zed_pl_model *m, int16_t *out, int frames, bool vector)
+{
+    int i;
+
+    memset(m->mix_l, 0, sizeof(m->mix_l));
+    memset(m->mix_r, 0, sizeof(m->mix_r));
+
+    for (i = 0; i < m->num_units; i++) {
+        struct zed_pl_model_unit *u = &m->units[i];
+
+        if (u->state == ZED_PL_EG_IDLE) {
+            continue;
+        }
+        zed_pl_model_eg_block(u, m->env, frames);
+        if (vector && !(frames & 3)) {
+            zed_pl_model_unit_vector(m, u, frames);
+        } else {
+            zed_pl_model_unit_scalar(m, u, frames);
+        }
+    }
+
+    for (i = 0; i < frames; i++) {
+        out[2 * i]     = zed_pl_model_sat16(m->mix_l[i]);
+        out[2 * i + 1] = zed_pl_model_sat16(m->mix_r[i]);
+    }
+}
+
+static void zed_pl_model_render_frames(struct zed_pl_model *m, int16_t *out, int frames, bool vector)
+{
+    while (frames > 0) {
+        int n = (frames > ZED_PL_MODEL_BLOCK) ? ZED_PL_MODEL_BLOCK : frames;
+
+        zed_pl_model_render_block(m, out, n, vector);
+        out    += 2 * n;
+        frames -= n;
+    }
+}
+
+void zed_pl_model_render(struct zed_pl_model *m, int16_t *out, int frames)
+{
+    zed_pl_model_render_frames(m, out, frames, true);
+}
+
+void zed_pl_model_render_scalar(struct zed_pl_model *m, int16_t *out, int frames)
+{
+    zed_pl_model_render_frames(m, out, frames, false);
+}
@@ -0,0 +1,409 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Zedboard PL synthesizer overflow voices
+ *
+ * @author Yuhei Horibe
+ * When all PL units are busy, extra voices are rendered on the CPU
+ * with the software model, and streamed to the "zed-synth-overflow"
+ * capture PCM of the sound card.
+ * Overflow voices are only handed out while that stream is running.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under  the terms of the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the License, or (at your
+ * option) any later version.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <sound/pcm.h>
+#include <sound/pcm_params.h>
+#include <sound/soc.h>
+#if IS_ENABLED(CONFIG_KERNEL_MODE_NEON)
+#include <asm/neon.h>
+#endif
+#include "zed_pl_synth.h"
+#include "zed_pl_model.h"
+
+// Number of overflow voices
+static unsigned int overflow_voices = ZED_PL_OVERFLOW_VOICES;
+module_param(overflow_voices, uint, 0444);
+MODULE_PARM_DESC(overflow_voices, "Number of software overflow voices (0: disabled)");
+
+#define ZED_PL_OVERFLOW_BUFFER_BYTES (64 * 1024)
+
+struct zed_pl_overflow {
+    struct zed_pl_card_data  *prv;
+    int                       num_voices;
+
+    // Model state, shared by the MIDI handlers and the renderer
+    spinlock_t                lock;
+    struct zed_pl_model       model;
+    struct zed_pl_model_unit  units[ZED_PL_OVERFLOW_VOICES];
+
+    // Capture stream
+    struct snd_pcm_substream *substream;
+    bool                      running;
+    snd_pcm_uframes_t         hw_ptr;
+    ktime_t                   period;
+    struct hrtimer            timer;
+    struct work_struct        work;
+
+    // Statistics
+    atomic_t                  handoffs;
+    u64                       frames;
+    u64                       voice_frames;
+    u64                       render_ns;
+};
+
+static const struct snd_pcm_hardware zed_pl_overflow_hw = {
+    .info             = SNDRV_PCM_INFO_MMAP |
+                        SNDRV_PCM_INFO_MMAP_VALID |
+                        SNDRV_PCM_INFO_INTERLEAVED |
+                        SNDRV_PCM_INFO_BLOCK_TRANSFER,
+    .formats          = SNDRV_PCM_FMTBIT_S16_LE,
+    .rates            = SNDRV_PCM_RATE_48000 | SNDRV_PCM_RATE_96000,
+    .rate_min         = 48000,
+    .rate_max         = 96000,
+    .channels_min     = 2,
+    .channels_max     = 2,
+    .buffer_bytes_max = ZED_PL_OVERFLOW_BUFFER_BYTES,
+    .period_bytes_min = ZED_PL_MODEL_BLOCK * 4,
+    .period_bytes_max = ZED_PL_OVERFLOW_BUFFER_BYTES / 2,
+    .periods_min      = 2,
+    .periods_max      = 32,
+};
+
+// Voice allocation
+// Called by the allocator when no unit is free
+int zed_pl_overflow_alloc(struct zed_pl_card_data *prv)
+{
+    struct zed_pl_overflow *ovf = prv->overflow;
+    int i;
+
+    if (!ovf || !READ_ONCE(ovf->running)) {
+        return -1;
+    }
+
+    for (i = 0; i < ovf->num_voices; i++) {
+        int v = prv->num_units + i;
+
+        // Like unit_free_reg, a released voice is busy until its envelope ends
+        if (READ_ONCE(ovf->units[i].state) != ZED_PL_EG_IDLE) {
+            continue;
+        }
+        if (test_and_set_bit_lock(v, prv->voice_busy)) {
+            continue;
+        }
+        atomic_inc(&ovf->handoffs);
+        return v;
+    }
+    return -1;
+}
+
+void zed_pl_overflow_write(struct zed_pl_card_data *prv, int voice, enum zed_pl_unit_word word, uint32_t val)
+{
+    struct zed_pl_overflow *ovf = prv->overflow;
+    unsigned long flags;
+
+    if (!ovf) {
+        return ;
+    }
+    spin_lock_irqsave(&ovf->lock, flags);
+    zed_pl_model_write_unit(&ovf->model, voice - prv->num_units, word, val);
+    spin_unlock_irqrestore(&ovf->lock, flags);
+}
+
+void zed_pl_overflow_write_unit(struct zed_pl_card_data *prv, int voice, const struct zed_pl_unit_reg *reg)
+{
+    struct zed_pl_overflow *ovf = prv->overflow;
+    int unit_no = voice - prv->num_units;
+    unsigned long flags;
+
+    if (!ovf) {
+        return ;
+    }
+
+    // Same order as the PL registers: ctl (trigger) comes after freq
+    spin_lock_irqsave(&ovf->lock, flags);
+    zed_pl_model_write_unit(&ovf->model, unit_no, ZED_PL_REG_FREQ, reg->freq_reg.freq_reg_all);
+    zed_pl_model_write_unit(&ovf->model, unit_no, ZED_PL_REG_CTL, reg->ctl_reg.ctl_reg_all);
+    zed_pl_model_write_unit(&ovf->model, unit_no, ZED_PL_REG_VCA_EG, reg->vca_eg_reg.vca_eg_reg_all);
+    zed_pl_model_write_unit(&ovf->model, unit_no, ZED_PL_REG_AMP, reg->amp_reg.amp_reg_all);
+    spin_unlock_irqrestore(&ovf->lock, flags);
+}
+
+// Rendering
+// Runs in a work item, since NEON can't be used in interrupt context
+static void zed_pl_overflow_render_period(struct work_struct *work)
+{
+    struct zed_pl_overflow *ovf = container_of(work, struct zed_pl_overflow, work);
+    struct snd_pcm_substream *substream = ovf->substream;
+    struct snd_pcm_runtime *runtime;
+    snd_pcm_uframes_t frames;
+    snd_pcm_uframes_t done;
+    int16_t *out;
+    u64 start;
+    int active = 0;
+    int i;
+
+    if (!substream || !READ_ONCE(ovf->running)) {
+        return ;
+    }
+    runtime = substream->runtime;
+    frames  = runtime->period_size;
+    out     = (int16_t *)(runtime->dma_area + frames_to_bytes(runtime, ovf->hw_ptr));
+
+    for (i = 0; i < ovf->num_voices; i++) {
+        active += (ovf->units[i].state != ZED_PL_EG_IDLE);
+    }
+
+    start = ktime_get_ns();
+#if IS_ENABLED(CONFIG_KERNEL_MODE_NEON)
+    kernel_neon_begin();
+#endif
+    // Lock per block, so that note events aren't held off for a whole period
+    for (done = 0; done < frames; done += ZED_PL_MODEL_BLOCK) {
+        int n = min_t(snd_pcm_uframes_t, frames - done, ZED_PL_MODEL_BLOCK);
+        unsigned long flags;
+
+        spin_lock_irqsave(&ovf->lock, flags);
+        zed_pl_model_render(&ovf->model, out + 2 * done, n);
+        spin_unlock_irqrestore(&ovf->lock, flags);
+    }
+#if IS_ENABLED(CONFIG_KERNEL_MODE_NEON)
+    kernel_neon_end();
+#endif
+    ovf->render_ns    += ktime_get_ns() - start;
+    ovf->frames       += frames;
+    ovf->voice_frames += (u64)active * frames;
+
+    ovf->hw_ptr = (ovf->hw_ptr + frames) % runtime->buffer_size;
+    snd_pcm_period_elapsed(substream);
+}
+
+static enum hrtimer_restart zed_pl_overflow_timer(struct hrtimer *timer)
+{
+    struct zed_pl_overflow *ovf = container_of(timer, struct zed_pl_overflow, timer);
+
+    if (!READ_ONCE(ovf->running)) {
+        return HRTIMER_NORESTART;
+    }
+    queue_work(system_highpri_wq, &ovf->work);
+    hrtimer_forward_now(timer, ovf->period);
+    return HRTIMER_RESTART;
+}
+
+// PCM operations
+static struct zed_pl_overflow *zed_pl_overflow_get(struct snd_pcm_substream *substream)
+{
+    struct snd_soc_pcm_runtime *rtd = substream->private_data;
+    struct zed_pl_card_data *prv = snd_soc_card_get_drvdata(rtd->card);
+
+    return prv->overflow;
+}
+
+static int zed_pl_overflow_open(struct snd_pcm_substream *substream)
+{
+    struct zed_pl_overflow *ovf = zed_pl_overflow_get(substream);
+
+    if (ovf->substream) {
+        return -EBUSY;
+    }
+    substream->runtime->hw = zed_pl_overflow_hw;
+    ovf->substream = substream;
+
+    // Periods are rendered in place, so the buffer has to be whole periods
+    return snd_pcm_hw_constraint_integer(substream->runtime, SNDRV_PCM_HW_PARAM_PERIODS);
+}
+
+static int zed_pl_overflow_close(struct snd_pcm_substream *substream)
+{
+    struct zed_pl_overflow *ovf = zed_pl_overflow_get(substream);
+
+    WRITE_ONCE(ovf->running, false);
+    hrtimer_cancel(&ovf->timer);
+    cancel_work_sync(&ovf->work);
+    ovf->substream = NULL;
+    return 0;
+}
+
+static int zed_pl_overflow_hw_params(struct snd_pcm_substream *substream,
+                                     struct snd_pcm_hw_params *params)
+{
+    return snd_pcm_lib_malloc_pages(substream, params_buffer_bytes(params));
+}
+
+static int zed_pl_overflow_hw_free(struct snd_pcm_substream *substream)
+{
+    return snd_pcm_lib_free_pages(substream);
+}
+
+static int zed_pl_overflow_prepare(struct snd_pcm_substream *substream)
+{
+    struct zed_pl_overflow *ovf = zed_pl_overflow_get(substream);
+    struct snd_pcm_runtime *runtime = substream->runtime;
+    unsigned long flags;
+
+    ovf->hw_ptr = 0;
+    ovf->period = ns_to_ktime(div_u64((u64)runtime->period_size * NSEC_PER_SEC, runtime->rate));
+
+    spin_lock_irqsave(&ovf->lock, flags);
+    zed_pl_model_write_audio_ctl(&ovf->model, runtime->rate == ZED_PL_MODEL_RATE_96K);
+    spin_unlock_irqrestore(&ovf->lock, flags);
+    return 0;
+}
+
+static int zed_pl_overflow_trigger(struct snd_pcm_substream *substream, int cmd)
+{
+    struct zed_pl_overflow *ovf = zed_pl_overflow_get(substream);
+
+    switch (cmd) {
+    case SNDRV_PCM_TRIGGER_START:
+    case SNDRV_PCM_TRIGGER_RESUME:
+        WRITE_ONCE(ovf->running, true);
+        hrtimer_start(&ovf->timer, ovf->period, HRTIMER_MODE_REL);
+        return 0;
+    case SNDRV_PCM_TRIGGER_STOP:
+    case SNDRV_PCM_TRIGGER_SUSPEND:
+        // The timer stops itself; sounding overflow voices are kept until note off
+        WRITE_ONCE(ovf->running, false);
+        return 0;
+    default:
+        return -EINVAL;
+    }
+}
+
+static snd_pcm_uframes_t zed_pl_overflow_pointer(struct snd_pcm_substream *substream)
+{
+    struct zed_pl_overflow *ovf = zed_pl_overflow_get(substream);
+
+    return ovf->hw_ptr;
+}
+
+static const struct snd_pcm_ops zed_pl_overflow_pcm_ops = {
+    .open      = zed_pl_overflow_open,
+    .close     = zed_pl_overflow_close,
+    .ioctl     = snd_pcm_lib_ioctl,
+    .hw_params = zed_pl_overflow_hw_params,
+    .hw_free   = zed_pl_overflow_hw_free,
+    .prepare   = zed_pl_overflow_prepare,
+    .trigger   = zed_pl_overflow_trigger,
+    .pointer   = zed_pl_overflow_pointer,
+};
+
+static int zed_pl_overflow_pcm_new(struct snd_soc_pcm_runtime *rtd)
+{
+    snd_pcm_lib_preallocate_pages_for_all(rtd->pcm, SNDRV_DMA_TYPE_CONTINUOUS,
+                                          snd_dma_continuous_data(GFP_KERNEL),
+                                          ZED_PL_OVERFLOW_BUFFER_BYTES,
+                                          ZED_PL_OVERFLOW_BUFFER_BYTES);
+    return 0;
+}
+
+static const struct snd_soc_component_driver zed_pl_overflow_component = {
+    .name    = "zed-pl-overflow",
+    .ops     = &zed_pl_overflow_pcm_ops,
+    .pcm_new = zed_pl_overflow_pcm_new,
+};
+
+// Capture only link, the PCM data comes from the overflow renderer
+SND_SOC_DAILINK_DEFS(zed_synth_overflow,
+             DAILINK_COMP_ARRAY(COMP_DUMMY()),
+             DAILINK_COMP_ARRAY(COMP_DUMMY()),
+             DAILINK_COMP_ARRAY(COMP_PLATFORM(NULL)));
+
+static struct snd_soc_dai_link zed_pl_overflow_dai = {
+        .name         = "zed-synth-overflow",
+        .stream_name  = "zed-synth_overflow",
+        .capture_only = 1,
+        SND_SOC_DAILINK_REG(zed_synth_overflow),
+};
+
+// Statistics (CPU cost per overflow voice)
+ssize_t zed_pl_overflow_show_stats(struct zed_pl_card_data *prv, char *buf)
+{
+    struct zed_pl_overflow *ovf = prv->overflow;
+    u64 ns_per_voice_frame = 0;
+    u64 cpu_ppm = 0;
+    int active = 0;
+    int i;
+
+    if (!ovf) {
+        return sprintf(buf, "disabled\n");
+    }
+
+    for (i = 0; i < ovf->num_voices; i++) {
+        active += (READ_ONCE(ovf->units[i].state) != ZED_PL_EG_IDLE);
+    }
+
+    // ppm of one core per sounding voice
+    if (ovf->voice_frames) {
+        ns_per_voice_frame = div64_u64(ovf->render_ns, ovf->voice_frames);
+        cpu_ppm = div64_u64(ovf->render_ns * ovf->model.rate, ovf->voice_frames) / 1000;
+    }
+
+    return sprintf(buf,
+                   "voices %d\nrunning %d\nactive %d\nhandoffs %d\n"
+                   "frames %llu\nvoice_frames %llu\nrender_ns %llu\n"
+                   "ns_per_voice_frame %llu\ncpu_ppm_per_voice %llu\n",
+                   ovf->num_voices, READ_ONCE(ovf->running), active,
+                   atomic_read(&ovf->handoffs),
+                   ovf->frames, ovf->voice_frames, ovf->render_ns,
+                   ns_per_voice_frame, cpu_ppm);
+}
+
+// Called before the card is registered: adds the capture link
+int zed_pl_overflow_init(struct zed_pl_card_data *prv)
+{
+    struct snd_soc_card *card = prv->card;
+    struct zed_pl_overflow *ovf;
+    struct snd_soc_dai_link *dai;
+    int ret;
+
+    if (overflow_voices == 0) {
+        return 0;
+    }
+
+    ovf = devm_kzalloc(prv->dev, sizeof(*ovf), GFP_KERNEL);
+    if (!ovf) {
+        return -ENOMEM;
+    }
+    ovf->prv        = prv;
+    ovf->num_voices = min_t(unsigned int, overflow_voices, ZED_PL_OVERFLOW_VOICES);
+    spin_lock_init(&ovf->lock);
+    zed_pl_model_init(&ovf->model, ovf->units, ovf->num_voices);
+    hrtimer_init(&ovf->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    ovf->timer.function = zed_pl_overflow_timer;
+    INIT_WORK(&ovf->work, zed_pl_overflow_render_period);
+    atomic_set(&ovf->handoffs, 0);
+
+    ret = devm_snd_soc_register_component(prv->dev, &zed_pl_overflow_component, NULL, 0);
+    if (ret) {
+        dev_err(prv->dev, "Failed to register overflow PCM.\n");
+        return ret;
+    }
+
+    dai  = &card->dai_link[card->num_links];
+    *dai = zed_pl_overflow_dai;
+    dai->platforms->name = dev_name(prv->dev);
+    card->num_links++;
+
+    prv->overflow = ovf;
+    return 0;
+}
+
+void zed_pl_overflow_release(struct zed_pl_card_data *prv)
+{
+    struct zed_pl_overflow *ovf = prv->overflow;
+
+    if (!ovf) {
+        return ;
+    }
+    WRITE_ONCE(ovf->running, false);
+    hrtimer_cancel(&ovf->timer);
+    cancel_work_sync(&ovf->work);
+}
@@ -0,0 +1,432 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Zedboard PL synthesizer Standard MIDI File player
+ *
+ * @author Yuhei Horibe
+ * A Standard MIDI File loaded with request_firmware is parsed once
+ * into a time-sorted event array, and played from an hrtimer
+ * into the MIDI handlers of one sequencer port, without going
+ * through userspace and the sequencer queue.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under  the terms of the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the License, or (at your
+ * option) any later version.
+ */
+
+#include <linux/module.h>
+#include <linux/firmware.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/pm_runtime.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <sound/asoundef.h>
+#include "zed_pl_synth.h"
+
+#define ZED_PL_PLAYER_MAX_FILE  (1024 * 1024)
+#define ZED_PL_PLAYER_NAME_LEN  64
+#define ZED_PL_PLAYER_TEMPO_MIN 10
+#define ZED_PL_PLAYER_TEMPO_MAX 1000
+
+struct zed_pl_player {
+    struct zed_pl_card_data    *prv;
+    struct mutex                lock;
+
+    // Loaded file
+    char                        name[ZED_PL_PLAYER_NAME_LEN];
+    struct zed_pl_smf_event    *events;
+    int                         num_events;
+    uint32_t                    length_us;
+    uint16_t                    channels;   // Channels used by the file
+
+    // Playback
+    struct zed_pl_port         *port;
+    bool                        playing;
+    bool                        loop;
+    int                         tempo;      // Percent of the file tempo
+    int                         next;
+    uint32_t                    origin_us;  // File position at origin_ns
+    ktime_t                     origin_ns;
+    struct hrtimer              timer;
+    struct work_struct          work;
+
+    // Statistics
+    u64                         loops;
+    u64                         late_max_ns;
+};
+
+// Playback
+static void zed_pl_player_send(struct zed_pl_player *pl, uint8_t status, uint8_t d0, uint8_t d1, int atomic)
+{
+    struct snd_seq_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    switch (status & 0xF0) {
+    case 0x80:
+    case 0x90:
+    case 0xA0:
+        ev.type = ((status & 0xF0) == 0xA0) ? SNDRV_SEQ_EVENT_KEYPRESS :
+                  (((status & 0xF0) == 0x90) && d1) ? SNDRV_SEQ_EVENT_NOTEON : SNDRV_SEQ_EVENT_NOTEOFF;
+        ev.data.note.channel  = status & 0x0F;
+        ev.data.note.note     = d0;
+        ev.data.note.velocity = d1;
+        break;
+    case 0xB0:
+        ev.type = SNDRV_SEQ_EVENT_CONTROLLER;
+        ev.data.control.channel = status & 0x0F;
+        ev.data.control.param   = d0;
+        ev.data.control.value   = d1;
+        break;
+    case 0xC0:
+        ev.type = SNDRV_SEQ_EVENT_PGMCHANGE;
+        ev.data.control.channel = status & 0x0F;
+        ev.data.control.value   = d0;
+        break;
+    case 0xD0:
+        ev.type = SNDRV_SEQ_EVENT_CHANPRESS;
+        ev.data.control.channel = status & 0x0F;
+        ev.data.control.value   = d0;
+        break;
+    case 0xE0:
+        ev.type = SNDRV_SEQ_EVENT_PITCHBEND;
+        ev.data.control.channel = status & 0x0F;
+        ev.data.control.value   = ((d1 << 7) | d0) - 8192;
+        break;
+    default:
+        return ;
+    }
+
+    // Same path as sequencer events (keeps the per-channel worker order)
+    zed_pl_synth_event_input(&ev, 1, pl->port, atomic, 0);
+}
+
+// Release the notes of the channels used by the file
+static void zed_pl_player_notes_off(struct zed_pl_player *pl)
+{
+    int ch;
+
+    for (ch = 0; ch < ZED_PL_SYNTH_MIDI_CH; ch++) {
+        if (pl->channels & BIT(ch)) {
+            zed_pl_player_send(pl, 0xB0 | ch, MIDI_CTL_SUSTAIN, 0, 0);
+            zed_pl_player_send(pl, 0xB0 | ch, MIDI_CTL_ALL_NOTES_OFF, 0, 0);
+        }
+    }
+}
+
+// Monotonic time of a file position (tempo scaled)
+static ktime_t zed_pl_player_due(struct zed_pl_player *pl, uint32_t time_us)
+{
+    s64 us = (s64)time_us - pl->origin_us;
+
+    return ktime_add(pl->origin_ns, ns_to_ktime(div_s64(us * NSEC_PER_USEC * 100, pl->tempo)));
+}
+
+// File position at a monotonic time
+static uint32_t zed_pl_player_pos(struct zed_pl_player *pl, ktime_t now)
+{
+    s64 ns = ktime_to_ns(ktime_sub(now, pl->origin_ns));
+
+    if (ns <= 0) {
+        return pl->origin_us;
+    }
+    return pl->origin_us + div_u64((u64)ns * pl->tempo, NSEC_PER_USEC * 100);
+}
+
+// Playback ended (caller holds the lock, and has cleared playing)
+static void zed_pl_player_finish(struct zed_pl_player *pl)
+{
+    struct zed_pl_card_data *prv = pl->prv;
+
+    zed_pl_player_notes_off(pl);
+
+    mutex_lock(&prv->access_mutex);
+    pl->port->player = false;
+    mutex_unlock(&prv->access_mutex);
+
+    pm_runtime_mark_last_busy(prv->dev);
+    pm_runtime_put_autosuspend(prv->dev);
+}
+
+// Send the events due straight from the timer, and rearm it for the next one
+// The end of the file (loop or finish) is left to the work item
+static enum hrtimer_restart zed_pl_player_timer(struct hrtimer *timer)
+{
+    struct zed_pl_player *pl = container_of(timer, struct zed_pl_player, timer);
+    ktime_t now = ktime_get();
+    uint32_t pos;
+    s64 late;
+
+    if (!READ_ONCE(pl->playing)) {
+        return HRTIMER_NORESTART;
+    }
+
+    if (pl->next < pl->num_events) {
+        late = ktime_to_ns(ktime_sub(now, zed_pl_player_due(pl, pl->events[pl->next].time_us)));
+        if (late > (s64)pl->late_max_ns) {
+            pl->late_max_ns = late;
+        }
+    }
+
+    pos = zed_pl_player_pos(pl, now);
+    while ((pl->next < pl->num_events) && (pl->events[pl->next].time_us <= pos)) {
+        const struct zed_pl_smf_event *pe = &pl->events[pl->next++];
+
+        zed_pl_player_send(pl, pe->status, pe->data[0], pe->data[1], 1);
+    }
+    if (pl->next < pl->num_events) {
+        hrtimer_set_expires(timer, zed_pl_player_due(pl, pl->events[pl->next].time_us));
+        return HRTIMER_RESTART;
+    }
+    if (pos < pl->length_us) {
+        hrtimer_set_expires(timer, zed_pl_player_due(pl, pl->length_us));
+        return HRTIMER_RESTART;
+    }
+
+    queue_work(system_highpri_wq, &pl->work);
+    return HRTIMER_NORESTART;
+}
+
+// End of the file: start the next loop, or finish
+static void zed_pl_player_work(struct work_struct *work)
+{
+    struct zed_pl_player *pl = container_of(work, struct zed_pl_player, work);
+
+    mutex_lock(&pl->lock);
+    if (!pl->playing) {
+        mutex_unlock(&pl->lock);
+        return ;
+    }
+
+    // A tempo change may have rearmed the timer meanwhile
+    hrtimer_cancel(&pl->timer);
+    if (!pl->loop || !pl->length_us) {
+        pl->playing = false;
+        zed_pl_player_finish(pl);
+        mutex_unlock(&pl->lock);
+        return ;
+    }
+
+    // Next loop starts at the end of this one (no drift)
+    zed_pl_player_notes_off(pl);
+    pl->origin_ns = zed_pl_player_due(pl, pl->length_us);
+    pl->origin_us = 0;
+    pl->next      = 0;
+    pl->loops++;
+    hrtimer_start(&pl->timer, pl->origin_ns, HRTIMER_MODE_ABS);
+    mutex_unlock(&pl->lock);
+}
+
+// Commands
+static int zed_pl_player_load(struct zed_pl_player *pl, const char *name)
+{
+    const struct firmware *fw;
+    struct zed_pl_smf smf;
+    int ret;
+
+    if (pl->playing) {
+        return -EBUSY;
+    }
+    ret = request_firmware(&fw, name, pl->prv->dev);
+    if (ret) {
+        dev_err(pl->prv->dev, "Failed to load %s (%d).\n", name, ret);
+        return ret;
+    }
+
+    if (fw->size > ZED_PL_PLAYER_MAX_FILE) {
+        ret = -EFBIG;
+    } else {
+        ret = zed_pl_smf_parse(&smf, fw->data, fw->size);
+    }
+    release_firmware(fw);
+    if (ret) {
+        dev_err(pl->prv->dev, "Invalid MIDI file %s (%d).\n", name, ret);
+        return ret;
+    }
+
+    kvfree(pl->events);
+    pl->events     = smf.events;
+    pl->num_events = smf.num_events;
+    pl->channels   = smf.channels;
+    pl->length_us  = smf.length_us;
+    strlcpy(pl->name, name, sizeof(pl->name));
+    return 0;
+}
+
+static int zed_pl_player_start(struct zed_pl_player *pl)
+{
+    struct zed_pl_card_data *prv = pl->prv;
+    struct zed_pl_port *port = pl->port;
+
+    if (pl->playing) {
+        return 0;
+    }
+    if (!pl->num_events) {
+        return -ENODATA;
+    }
+
+    // The player owns the port while playing
+    mutex_lock(&prv->access_mutex);
+    if (port->users || port->player) {
+        mutex_unlock(&prv->access_mutex);
+        return -EBUSY;
+    }
+    if (pm_runtime_get_sync(prv->dev) < 0) {
+        pm_runtime_put_noidle(prv->dev);
+        mutex_unlock(&prv->access_mutex);
+        dev_err(prv->dev, "Failed to resume device.\n");
+        return -EIO;
+    }
+    port->player = true;
+    zed_pl_synth_midi_init(port);
+    mutex_unlock(&prv->access_mutex);
+
+    pl->origin_ns = ktime_get();
+    pl->origin_us = 0;
+    pl->next      = 0;
+    pl->playing   = true;
+    hrtimer_start(&pl->timer, pl->origin_ns, HRTIMER_MODE_ABS);
+    return 0;
+}
+
+static void zed_pl_player_stop(struct zed_pl_player *pl)
+{
+    mutex_lock(&pl->lock);
+    if (!pl->playing) {
+        mutex_unlock(&pl->lock);
+        return ;
+    }
+    pl->playing = false;
+    mutex_unlock(&pl->lock);
+
+    hrtimer_cancel(&pl->timer);
+    cancel_work_sync(&pl->work);
+
+    mutex_lock(&pl->lock);
+    zed_pl_player_finish(pl);
+    mutex_unlock(&pl->lock);
+}
+
+// Change the tempo from the current position on
+static void zed_pl_player_set_tempo(struct zed_pl_player *pl, int tempo)
+{
+    if (pl->playing) {
+        ktime_t now;
+
+        // The timer callback reads the origin and tempo
+        hrtimer_cancel(&pl->timer);
+        now = ktime_get();
+        pl->origin_us = min(zed_pl_player_pos(pl, now), pl->length_us);
+        pl->origin_ns = now;
+        pl->tempo     = tempo;
+        hrtimer_start(&pl->timer, now, HRTIMER_MODE_ABS);
+        return ;
+    }
+    pl->tempo = tempo;
+}
+
+// "load <file>", "start", "stop", "loop <0|1>", "tempo <percent>", "port <n>"
+int zed_pl_player_command(struct zed_pl_card_data *prv, const char *buf)
+{
+    struct zed_pl_player *pl = prv->player;
+    char name[ZED_PL_PLAYER_NAME_LEN];
+    int val;
+    int ret = 0;
+
+    if (!pl) {
+        return -ENODEV;
+    }
+
+    if (sysfs_streq(buf, "stop")) {
+        zed_pl_player_stop(pl);
+        return 0;
+    }
+
+    mutex_lock(&pl->lock);
+    if (sysfs_streq(buf, "start")) {
+        ret = zed_pl_player_start(pl);
+    } else if (sscanf(buf, "load %63s", name) == 1) {
+        ret = zed_pl_player_load(pl, name);
+    } else if (sscanf(buf, "loop %d", &val) == 1) {
+        pl->loop = !!val;
+    } else if (sscanf(buf, "tempo %d", &val) == 1) {
+        if ((val < ZED_PL_PLAYER_TEMPO_MIN) || (val > ZED_PL_PLAYER_TEMPO_MAX)) {
+            ret = -EINVAL;
+        } else {
+            zed_pl_player_set_tempo(pl, val);
+        }
+    } else if (sscanf(buf, "port %d", &val) == 1) {
+        if (pl->playing) {
+            ret = -EBUSY;
+        } else if ((val < 0) || (val >= prv->num_ports)) {
+            ret = -EINVAL;
+        } else {
+            pl->port = &prv->ports[val];
+        }
+    } else {
+        ret = -EINVAL;
+    }
+    mutex_unlock(&pl->lock);
+    return ret;
+}
+
+ssize_t zed_pl_player_show(struct zed_pl_card_data *prv, char *buf)
+{
+    struct zed_pl_player *pl = prv->player;
+    uint32_t pos = 0;
+    ssize_t len;
+
+    if (!pl) {
+        return sprintf(buf, "disabled\n");
+    }
+
+    mutex_lock(&pl->lock);
+    if (pl->playing) {
+        pos = min(zed_pl_player_pos(pl, ktime_get()), pl->length_us);
+    }
+    len = sprintf(buf,
+                  "file %s\nplaying %d\nport %d\nloop %d\ntempo %d\n"
+                  "events %d\nlength_ms %u\npos_ms %u\nloops %llu\nlate_max_us %llu\n",
+                  pl->name[0] ? pl->name : "-", pl->playing, pl->port->index, pl->loop, pl->tempo,
+                  pl->num_events, (uint32_t)(pl->length_us / USEC_PER_MSEC), (uint32_t)(pos / USEC_PER_MSEC),
+                  pl->loops, div_u64(pl->late_max_ns, NSEC_PER_USEC));
+    mutex_unlock(&pl->lock);
+    return len;
+}
+
+// Called after the sequencer ports are created
+int zed_pl_player_init(struct zed_pl_card_data *prv)
+{
+    struct zed_pl_player *pl;
+
+    pl = devm_kzalloc(prv->dev, sizeof(*pl), GFP_KERNEL);
+    if (!pl) {
+        return -ENOMEM;
+    }
+    pl->prv   = prv;
+    pl->port  = &prv->ports[0];
+    pl->loop  = true;
+    pl->tempo = 100;
+    mutex_init(&pl->lock);
+    hrtimer_init(&pl->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    pl->timer.function = zed_pl_player_timer;
+    INIT_WORK(&pl->work, zed_pl_player_work);
+
+    prv->player = pl;
+    return 0;
+}
+
+void zed_pl_player_release(struct zed_pl_card_data *prv)
+{
+    struct zed_pl_player *pl = prv->player;
+
+    if (!pl) {
+        return ;
+    }
+    zed_pl_player_stop(pl);
+    kvfree(pl->events);
+    pl->events     = NULL;
+    pl->num_events = 0;
+}
@@ -14,10 +14,20 @@
 
 #include <linux/moduleparam.h>
 #include <linux/module.h>
+#include <linux/pm_runtime.h>
+#include <linux/cpumask.h>
+#include <linux/topology.h>
+#include <linux/slab.h>
 #include <sound/initval.h>
 #include <sound/asoundef.h>
+#include <sound/seq_kernel.h>
 #include "zed_pl_synth.h"
 
+// Number of per-CPU MIDI workers (0: process events in the sequencer context)
+static unsigned int midi_workers;
+module_param(midi_workers, uint, 0444);
+MODULE_PARM_DESC(midi_workers, "Number of per-CPU MIDI workers, channels are sharded across them (0: disabled)");
+
 // MIDI event handlers
 static struct snd_midi_op zed_pl_synth_ops = {
     .note_on        = zed_pl_synth_note_on,
@@ -29,61 +39,398 @@ static struct snd_midi_op zed_pl_synth_ops = {
 };
 
 // Sequencer callbacks
+// Any number of clients may subscribe at once. Channel state is kept while
+// nobody is subscribed, so a client reconnecting finds its setup in place.
 int zed_pl_synth_use(void *private_data, struct snd_seq_port_subscribe *info)
 {
-    struct zed_pl_card_data *prv = (struct zed_pl_card_data*)private_data;
-    int ret = 0;
+    struct zed_pl_port      *port = private_data;
+    struct zed_pl_card_data *prv  = port->prv;
+    bool system = (info->sender.client == SNDRV_SEQ_CLIENT_SYSTEM);
 
     mutex_lock(&prv->access_mutex);
 
-    if (prv->busy) {
+    if (port->player) {
         mutex_unlock(&prv->access_mutex);
-        dev_err(prv->dev, "Device is busy.\n");
+        dev_err(prv->dev, "Port %d is busy.\n", port->index);
         return -EBUSY;
     }
-    prv->busy = 1;
 
-    if (!try_module_get(prv->card->snd_card->module)) {
+    // Wake up the synth block (register state is restored on resume)
+    if (pm_runtime_get_sync(prv->dev) < 0) {
+        pm_runtime_put_noidle(prv->dev);
+        mutex_unlock(&prv->access_mutex);
+        dev_err(prv->dev, "Failed to resume device.\n");
+        return -EIO;
+    }
+
+    if (!system && !try_module_get(prv->card->snd_card->module)) {
+        pm_runtime_put_autosuspend(prv->dev);
+        mutex_unlock(&prv->access_mutex);
         dev_err(prv->dev, "Failed to get module.\n");
-        ret = -EFAULT;
+        return -EFAULT;
     }
-    zed_pl_synth_midi_init();
+    port->users++;
 
     mutex_unlock(&prv->access_mutex);
-    return ret;
+    return 0;
 }
 
 int zed_pl_synth_unuse(void *private_data, struct snd_seq_port_subscribe *info)
 {
-    struct zed_pl_card_data *prv = (struct zed_pl_card_data*)private_data;
-    int ret = 0;
+    struct zed_pl_port      *port = private_data;
+    struct zed_pl_card_data *prv  = port->prv;
+
+    zed_pl_synth_flush_workers(prv);
+    flush_work(&prv->params_work);
 
     mutex_lock(&prv->access_mutex);
-    zed_pl_synth_release(prv);
-    prv->busy = 0;
+    // Sounding notes are released with the last subscriber, or
+    // on the channels the leaving one played last
+    if (!--port->users) {
+        zed_pl_synth_release_port(port);
+    } else {
+        zed_pl_synth_release_client(port, info->sender.client);
+    }
     if (info->sender.client != SNDRV_SEQ_CLIENT_SYSTEM) {
         module_put(prv->card->snd_card->module);
     }
     mutex_unlock(&prv->access_mutex);
-    return ret;
+
+    // Let the synth block idle when nobody is attached
+    pm_runtime_mark_last_busy(prv->dev);
+    pm_runtime_put_autosuspend(prv->dev);
+    return 0;
 }
 
 void zed_pl_synth_free_port(void *private_data)
 {
-    struct zed_pl_card_data *prv = (struct zed_pl_card_data*)private_data;
+    struct zed_pl_port      *port = private_data;
+    struct zed_pl_card_data *prv  = port->prv;
+
+    zed_pl_synth_flush_workers(prv);
 
     mutex_lock(&prv->access_mutex);
-    zed_pl_synth_release(prv);
+    zed_pl_synth_release_port(port);
     mutex_unlock(&prv->access_mutex);
-    snd_midi_channel_free_set(prv->chset);
+    snd_midi_channel_free_set(port->chset);
+    port->chset = NULL;
+}
+
+// Sysex the MIDI emulation would truncate
+#define ZED_PL_SEQ_SYSEX_LEN 64
+
+// Register burst sysex, and tuning messages longer than the emulation's buffer
+// (tuning bulk dumps), are taken here
+static bool zed_pl_synth_burst(struct zed_pl_port *port, struct snd_seq_event *ev)
+{
+    unsigned char hdr[4];
+    unsigned char *buf;
+    bool burst;
+    int len;
+    int ret;
+
+    if ((ev->flags & SNDRV_SEQ_EVENT_LENGTH_MASK) != SNDRV_SEQ_EVENT_LENGTH_VARIABLE) {
+        return false;
+    }
+
+    len = ev->data.ext.len & ~SNDRV_SEQ_EXT_MASK;
+    if ((len < sizeof(hdr)) ||
+        (snd_seq_expand_var_event(ev, sizeof(hdr), (char *)hdr, 1, 0) < (int)sizeof(hdr))) {
+        return false;
+    }
+    burst = zed_pl_synth_is_burst(hdr, sizeof(hdr));
+    if (!burst && !(zed_pl_synth_is_mts(hdr, sizeof(hdr)) && (len > ZED_PL_SEQ_SYSEX_LEN))) {
+        return false;
+    }
+
+    buf = kmalloc(len, GFP_ATOMIC);
+    if (!buf) {
+        return true;
+    }
+    len = snd_seq_expand_var_event(ev, len, (char *)buf, 1, 0);
+    ret = burst ? zed_pl_synth_sysex_burst(port, buf, len) : zed_pl_synth_mts(port, buf, len);
+    if (ret < 0) {
+        dev_dbg(port->prv->dev, "Invalid %s (%d).\n", burst ? "register burst" : "tuning message", ret);
+    }
+    kfree(buf);
+    return true;
+}
+
+static int zed_pl_synth_event_channel(const struct snd_seq_event *ev)
+{
+    if (snd_seq_ev_is_note_type(ev)) {
+        return ev->data.note.channel;
+    }
+    return ev->data.control.channel;
+}
+
+// Process one event through the MIDI emulation
+static void zed_pl_synth_process(struct zed_pl_port *port, struct snd_seq_event *ev)
+{
+    struct snd_midi_channel_set *chset = port->chset;
+    struct snd_midi_channel *chan;
+    int ch;
+
+    if ((ev->type == SNDRV_SEQ_EVENT_SYSEX) && zed_pl_synth_burst(port, ev)) {
+        return ;
+    }
+
+    snd_midi_process_event(&zed_pl_synth_ops, ev, chset);
+
+    // The emulation stores program changes and RPNs but has no callback for them
+    switch (ev->type) {
+    case SNDRV_SEQ_EVENT_PGMCHANGE:
+        break;
+    case SNDRV_SEQ_EVENT_CONTROLLER:
+        switch (ev->data.control.param) {
+        case MIDI_CTL_MSB_DATA_ENTRY:
+        case MIDI_CTL_LSB_DATA_ENTRY:
+            break;
+        default:
+            return ;
+        }
+        break;
+    case SNDRV_SEQ_EVENT_REGPARAM:
+        break;
+    default:
+        return ;
+    }
+
+    ch = ev->data.control.channel;
+    if (ch >= chset->max_channels) {
+        return ;
+    }
+    chan = &chset->channels[ch];
+    if (ev->type == SNDRV_SEQ_EVENT_PGMCHANGE) {
+        zed_pl_synth_program(port, chan);
+    } else if (chan->param_type == SNDRV_MIDI_PARAM_TYPE_REGISTERED) {
+        zed_pl_synth_rpn(port, chan);
+    }
+}
+
+// Subscribers are merged, so events of one channel may arrive from several
+// senders (or workers) at once: the emulation state of a channel is only
+// touched under its emul_lock
+static void zed_pl_synth_dispatch(struct zed_pl_port *port, struct snd_seq_event *ev)
+{
+    unsigned long flags;
+    int ch;
+
+    if (!snd_seq_ev_is_channel_type(ev) || (zed_pl_synth_event_channel(ev) >= ZED_PL_SYNTH_MIDI_CH)) {
+        zed_pl_synth_process(port, ev);
+        return ;
+    }
+    ch = zed_pl_synth_event_channel(ev);
+    spin_lock_irqsave(&port->emul_lock[ch], flags);
+    zed_pl_synth_process(port, ev);
+    spin_unlock_irqrestore(&port->emul_lock[ch], flags);
+}
+
+// MIDI workers
+static void zed_pl_synth_worker_fn(struct work_struct *work)
+{
+    struct zed_pl_midi_worker *wk = container_of(work, struct zed_pl_midi_worker, work);
+    struct zed_pl_midi_event me;
+    ktime_t start = ktime_get();
+
+    while (kfifo_out_spinlocked(&wk->fifo, &me, 1, &wk->lock)) {
+        zed_pl_synth_dispatch(me.port, &me.ev);
+        wk->events++;
+    }
+    wk->busy_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+}
+
+// Wait until all queued channel events have been processed
+static void zed_pl_synth_flush_channels(struct zed_pl_card_data *prv)
+{
+    int i;
+
+    for (i = 0; i < prv->num_workers; i++) {
+        flush_work(&prv->workers[i].work);
+    }
+}
+
+// Variable length data of a queued event is a kernel copy
+static void zed_pl_synth_free_event(struct zed_pl_midi_event *me)
+{
+    if ((me->ev.flags & SNDRV_SEQ_EVENT_LENGTH_MASK) == SNDRV_SEQ_EVENT_LENGTH_VARIABLE) {
+        kfree(me->ev.data.ext.ptr);
+    }
+}
+
+// Ordered worker: events queued before the first of its events are run first
+static void zed_pl_synth_ordered_fn(struct work_struct *work)
+{
+    struct zed_pl_midi_worker *wk  = container_of(work, struct zed_pl_midi_worker, work);
+    struct zed_pl_card_data   *prv = wk->prv;
+    struct zed_pl_midi_event me;
+    ktime_t start = ktime_get();
+
+    zed_pl_synth_flush_channels(prv);
+    while (kfifo_out_spinlocked(&wk->fifo, &me, 1, &wk->lock)) {
+        zed_pl_synth_dispatch(me.port, &me.ev);
+        zed_pl_synth_free_event(&me);
+        wk->events++;
+        atomic_dec(&prv->ordered_pending);
+    }
+    wk->busy_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+}
+
+static void zed_pl_synth_init_worker(struct zed_pl_midi_worker *wk, struct zed_pl_card_data *prv,
+                                     work_func_t fn, int cpu)
+{
+    INIT_WORK(&wk->work, fn);
+    spin_lock_init(&wk->lock);
+    INIT_KFIFO(wk->fifo);
+    wk->prv     = prv;
+    wk->cpu     = cpu;
+    wk->events  = 0;
+    wk->busy_ns = 0;
+    atomic64_set(&wk->dropped, 0);
+}
+
+void zed_pl_synth_init_workers(struct zed_pl_card_data *prv)
+{
+    int i;
+
+    prv->num_workers = min_t(int, midi_workers, min_t(int, ZED_PL_MAX_WORKERS, num_online_cpus()));
+    atomic64_set(&prv->inline_events, 0);
+
+    for (i = 0; i < prv->num_workers; i++) {
+        zed_pl_synth_init_worker(&prv->workers[i], prv, zed_pl_synth_worker_fn,
+                                 cpumask_local_spread(i, NUMA_NO_NODE));
+    }
+    zed_pl_synth_init_worker(&prv->ordered, prv, zed_pl_synth_ordered_fn, WORK_CPU_UNBOUND);
+    atomic_set(&prv->ordered_pending, 0);
+}
+
+// Wait until all queued events have been processed
+void zed_pl_synth_flush_workers(struct zed_pl_card_data *prv)
+{
+    flush_work(&prv->ordered.work);
+    zed_pl_synth_flush_channels(prv);
+}
+
+void zed_pl_synth_release_workers(struct zed_pl_card_data *prv)
+{
+    struct zed_pl_midi_event me;
+    int i;
+
+    cancel_work_sync(&prv->ordered.work);
+    while (kfifo_out(&prv->ordered.fifo, &me, 1)) {
+        zed_pl_synth_free_event(&me);
+    }
+    for (i = 0; i < prv->num_workers; i++) {
+        cancel_work_sync(&prv->workers[i].work);
+    }
+    prv->num_workers = 0;
+}
+
+ssize_t zed_pl_synth_show_worker_stats(struct zed_pl_card_data *prv, char *buf)
+{
+    ssize_t len = 0;
+    int i;
+
+    len += scnprintf(buf + len, PAGE_SIZE - len, "inline events %lld\n",
+                     (long long)atomic64_read(&prv->inline_events));
+    len += scnprintf(buf + len, PAGE_SIZE - len, "ordered events %llu busy_ns %llu dropped %lld\n",
+                     prv->ordered.events, prv->ordered.busy_ns,
+                     (long long)atomic64_read(&prv->ordered.dropped));
+    for (i = 0; i < prv->num_workers; i++) {
+        struct zed_pl_midi_worker *wk = &prv->workers[i];
+
+        len += scnprintf(buf + len, PAGE_SIZE - len,
+                         "worker %d cpu %d events %llu busy_ns %llu dropped %lld\n",
+                         i, wk->cpu, wk->events, wk->busy_ns,
+                         (long long)atomic64_read(&wk->dropped));
+    }
+    return len;
+}
+
+static int zed_pl_synth_queue_event(struct zed_pl_midi_worker *wk, struct zed_pl_midi_event *me)
+{
+    if (!kfifo_in_spinlocked(&wk->fifo, me, 1, &wk->lock)) {
+        atomic64_inc(&wk->dropped);
+        return -ENOSPC;
+    }
+    queue_work_on(wk->cpu, system_highpri_wq, &wk->work);
+    return 0;
+}
+
+// Queue an event behind the channel workers
+// (variable length data is copied, the sender's buffer doesn't outlive the call)
+static int zed_pl_synth_queue_ordered(struct zed_pl_port *port, struct snd_seq_event *ev)
+{
+    struct zed_pl_card_data *prv = port->prv;
+    struct zed_pl_midi_event me = { .ev = *ev, .port = port };
+    int ret;
+
+    if ((ev->flags & SNDRV_SEQ_EVENT_LENGTH_MASK) == SNDRV_SEQ_EVENT_LENGTH_VARIABLE) {
+        int len = ev->data.ext.len & ~SNDRV_SEQ_EXT_MASK;
+        char *buf = kmalloc(len, GFP_ATOMIC);
+
+        if (!buf) {
+            atomic64_inc(&prv->ordered.dropped);
+            return -ENOMEM;
+        }
+        len = snd_seq_expand_var_event(ev, len, buf, 1, 0);
+        if (len < 0) {
+            kfree(buf);
+            return len;
+        }
+        me.ev.data.ext.len = len;
+        me.ev.data.ext.ptr = buf;
+    }
+
+    atomic_inc(&prv->ordered_pending);
+    ret = zed_pl_synth_queue_event(&prv->ordered, &me);
+    if (ret) {
+        atomic_dec(&prv->ordered_pending);
+        zed_pl_synth_free_event(&me);
+    }
+    return ret;
+}
+
+static bool zed_pl_synth_event_is_scene(const struct snd_seq_event *ev)
+{
+    return (ev->type == SNDRV_SEQ_EVENT_CONTROLLER) && (ev->data.control.param == ZED_PL_CC_SCENE);
 }
 
 // MIDI event handler
 int zed_pl_synth_event_input(struct snd_seq_event *ev, int direct, void *private_data, int atomic, int hop)
 {
-    struct zed_pl_card_data *prv = (struct zed_pl_card_data*)private_data;
+    struct zed_pl_port      *port = private_data;
+    struct zed_pl_card_data *prv  = port->prv;
+    bool channel = snd_seq_ev_is_channel_type(ev);
+
+    // Events for more than one channel: sysex etc., and with workers the scene
+    // switch, which would otherwise race the workers owning the other channels
+    bool global = !channel || (prv->num_workers && zed_pl_synth_event_is_scene(ev));
+
+    // Remember who played each channel last, for zed_pl_synth_unuse()
+    if (channel && (zed_pl_synth_event_channel(ev) < ZED_PL_SYNTH_MIDI_CH)) {
+        WRITE_ONCE(port->last_client[zed_pl_synth_event_channel(ev)], ev->source.client);
+    }
 
-    snd_midi_process_event(&zed_pl_synth_ops, ev, prv->chset);
+    // They may touch every channel (and sysex may sleep): in atomic context they
+    // wait for the ordered worker, and so does everything after them
+    if ((atomic && global) || atomic_read(&prv->ordered_pending)) {
+        return zed_pl_synth_queue_ordered(port, ev);
+    }
+
+    // Channel events go to the worker owning the channel (part)
+    if (prv->num_workers && !global) {
+        int part = port->part_base + zed_pl_synth_event_channel(ev);
+        struct zed_pl_midi_event me = { .ev = *ev, .port = port };
+
+        return zed_pl_synth_queue_event(&prv->workers[part % prv->num_workers], &me);
+    }
+
+    // Keep the order of these events against channel events already queued
+    if (global) {
+        zed_pl_synth_flush_workers(prv);
+    }
+    zed_pl_synth_dispatch(port, ev);
+    atomic64_inc(&prv->inline_events);
     return 0;
 }
-
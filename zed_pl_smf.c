@@ -0,0 +1,282 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Zedboard PL synthesizer Standard MIDI File parser
+ *
+ * @author Yuhei Horibe
+ * A Standard MIDI File (format 0 or 1) is parsed once into
+ * a time-sorted array of channel messages, with the tempo map applied.
+ * Shared by the MIDI file player and the userspace MIDI benchmark.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under  the terms of the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the License, or (at your
+ * option) any later version.
+ */
+
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/string.h>
+#include <asm/unaligned.h>
+#include "zed_pl_synth.h"
+
+// Default SMF tempo (us per quarter note)
+#define ZED_PL_SMF_TEMPO 500000
+
+// SMF parser
+// Events are collected with their tick, then sorted by (tick, order in file),
+// so that events of one tick keep the order of the tracks
+struct zed_pl_smf_raw {
+    uint32_t tick;
+    uint32_t seq;
+    uint32_t tempo;     // Set tempo (status 0xFF)
+    uint8_t  status;
+    uint8_t  data[2];
+};
+
+static int zed_pl_smf_vlq(const u8 **p, const u8 *end, uint32_t *val)
+{
+    uint32_t v = 0;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        if (*p >= end) {
+            return -EINVAL;
+        }
+        v = (v << 7) | (**p & 0x7F);
+        if (!(*(*p)++ & 0x80)) {
+            *val = v;
+            return 0;
+        }
+    }
+    return -EINVAL;
+}
+
+// Data bytes of a channel message
+static int zed_pl_smf_data_len(uint8_t status)
+{
+    switch (status & 0xF0) {
+    case 0xC0:
+    case 0xD0:
+        return 1;
+    default:
+        return 2;
+    }
+}
+
+// Parse one track, returns the number of events added
+static int zed_pl_smf_track(const u8 *p, const u8 *end, struct zed_pl_smf_raw *raw, int max_raw,
+                            uint32_t *seq, uint32_t *end_tick)
+{
+    uint32_t tick = 0;
+    uint8_t  running = 0;
+    int n = 0;
+
+    while (p < end) {
+        struct zed_pl_smf_raw *r;
+        uint32_t delta;
+        uint32_t len;
+        uint8_t  status;
+        int i;
+
+        if (zed_pl_smf_vlq(&p, end, &delta) || (p >= end)) {
+            return -EINVAL;
+        }
+        tick += delta;
+
+        status = *p;
+        if (status == 0xFF) {
+            // Meta event
+            uint8_t type;
+
+            if (end - p < 2) {
+                return -EINVAL;
+            }
+            type = p[1];
+            p += 2;
+            if (zed_pl_smf_vlq(&p, end, &len) || (len > end - p)) {
+                return -EINVAL;
+            }
+            if (type == 0x2F) {
+                break;
+            }
+            if ((type == 0x51) && (len == 3)) {
+                if (n >= max_raw) {
+                    return -EINVAL;
+                }
+                r = &raw[n++];
+                r->tick   = tick;
+                r->seq    = (*seq)++;
+                r->status = 0xFF;
+                r->tempo  = (p[0] << 16) | (p[1] << 8) | p[2];
+            }
+            p += len;
+            continue;
+        }
+        if ((status == 0xF0) || (status == 0xF7)) {
+            // Sysex is not played
+            p++;
+            if (zed_pl_smf_vlq(&p, end, &len) || (len > end - p)) {
+                return -EINVAL;
+            }
+            p += len;
+            running = 0;
+            continue;
+        }
+
+        if (status & 0x80) {
+            if (status >= 0xF0) {
+                return -EINVAL;
+            }
+            running = status;
+            p++;
+        } else if (!running) {
+            return -EINVAL;
+        }
+        if (end - p < zed_pl_smf_data_len(running)) {
+            return -EINVAL;
+        }
+        if (n >= max_raw) {
+            return -EINVAL;
+        }
+        r = &raw[n++];
+        r->tick    = tick;
+        r->seq     = (*seq)++;
+        r->status  = running;
+        r->data[1] = 0;
+        for (i = 0; i < zed_pl_smf_data_len(running); i++) {
+            r->data[i] = *p++ & 0x7F;
+        }
+    }
+
+    *end_tick = max(*end_tick, tick);
+    return n;
+}
+
+static int zed_pl_smf_cmp(const void *a, const void *b)
+{
+    const struct zed_pl_smf_raw *ra = a;
+    const struct zed_pl_smf_raw *rb = b;
+
+    if (ra->tick != rb->tick) {
+        return (ra->tick < rb->tick) ? -1 : 1;
+    }
+    return (ra->seq < rb->seq) ? -1 : (ra->seq > rb->seq);
+}
+
+// Parse a Standard MIDI File (format 0 or 1) into smf
+// smf->events is allocated with kvmalloc_array, and freed by the caller
+int zed_pl_smf_parse(struct zed_pl_smf *smf, const u8 *buf, size_t size)
+{
+    const u8 *p   = buf;
+    const u8 *end = buf + size;
+    struct zed_pl_smf_raw *raw;
+    struct zed_pl_smf_event *events;
+    uint32_t seq = 0;
+    uint32_t end_tick = 0;
+    uint32_t last_tick = 0;
+    uint32_t us_per_tick_num = ZED_PL_SMF_TEMPO;    // us per tick = num / div
+    uint32_t div;
+    uint16_t channels = 0;
+    uint16_t format;
+    uint16_t tracks;
+    bool smpte;
+    u64 acc = 0;
+    int max_raw = size / 2;
+    int num_raw = 0;
+    int ret = 0;
+    int n = 0;
+    int i;
+
+    if ((size < 14) || memcmp(p, "MThd", 4) ||
+        (get_unaligned_be32(p + 4) < 6) || (get_unaligned_be32(p + 4) > size - 8)) {
+        return -EINVAL;
+    }
+    format = get_unaligned_be16(p + 8);
+    tracks = get_unaligned_be16(p + 10);
+    div    = get_unaligned_be16(p + 12);
+    if ((format > 1) || (tracks == 0) || (div == 0)) {
+        return -EINVAL;
+    }
+
+    // SMPTE time division: frames per second * ticks per frame
+    smpte = div & 0x8000;
+    if (smpte) {
+        div = (uint32_t)(-(int8_t)(div >> 8)) * (div & 0xFF);
+        us_per_tick_num = USEC_PER_SEC;
+        if (div == 0) {
+            return -EINVAL;
+        }
+    }
+    p += 8 + get_unaligned_be32(p + 4);
+
+    // Every event takes at least 2 bytes
+    raw = kvmalloc_array(max_raw, sizeof(*raw), GFP_KERNEL);
+    if (!raw) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; (i < tracks) && (end - p >= 8); i++) {
+        uint32_t len = get_unaligned_be32(p + 4);
+
+        if (len > end - p - 8) {
+            ret = -EINVAL;
+            goto out;
+        }
+        if (!memcmp(p, "MTrk", 4)) {
+            ret = zed_pl_smf_track(p + 8, p + 8 + len, raw + num_raw, max_raw - num_raw, &seq, &end_tick);
+            if (ret < 0) {
+                goto out;
+            }
+            num_raw += ret;
+        }
+        p += 8 + len;
+    }
+    sort(raw, num_raw, sizeof(*raw), zed_pl_smf_cmp, NULL);
+
+    events = kvmalloc_array(max(num_raw, 1), sizeof(*events), GFP_KERNEL);
+    if (!events) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    // Ticks to us through the tempo map
+    for (i = 0; i < num_raw; i++) {
+        struct zed_pl_smf_raw *r = &raw[i];
+
+        acc += (u64)(r->tick - last_tick) * us_per_tick_num;
+        last_tick = r->tick;
+        if (div_u64(acc, div) > U32_MAX) {
+            kvfree(events);
+            ret = -EFBIG;
+            goto out;
+        }
+
+        if (r->status == 0xFF) {
+            if (!smpte && r->tempo) {
+                us_per_tick_num = r->tempo;
+            }
+            continue;
+        }
+        events[n].time_us = div_u64(acc, div);
+        events[n].status  = r->status;
+        events[n].data[0] = r->data[0];
+        events[n].data[1] = r->data[1];
+        events[n].pad     = 0;
+        channels |= BIT(r->status & 0x0F);
+        n++;
+    }
+    acc += (u64)(max(end_tick, last_tick) - last_tick) * us_per_tick_num;
+
+    smf->events     = events;
+    smf->num_events = n;
+    smf->channels   = channels;
+    smf->length_us  = min_t(u64, div_u64(acc, div), U32_MAX);
+    ret = 0;
+
+out:
+    kvfree(raw);
+    return ret;
+}
@@ -21,6 +21,7 @@
 #include <linux/module.h>
 #include <linux/of.h>
 #include <linux/of_device.h>
+#include <linux/pm_runtime.h>
 #include <sound/pcm_params.h>
 #include <sound/soc.h>
 #include <asm/io.h>
@@ -55,6 +56,11 @@ static const struct snd_soc_dapm_route zed_snd_routes[] = {
 
 static const char *zed_snd_card_name = "zed-pl-snd-card";
 
+// Number of sequencer ports (16 MIDI channels each)
+static unsigned int midi_ports = 1;
+module_param(midi_ports, uint, 0444);
+MODULE_PARM_DESC(midi_ports, "Number of sequencer ports, 16 MIDI channels each (1-" __stringify(ZED_PL_MAX_PORTS) ")");
+
 // Audio CODEC hardware parameter
 static int zed_snd_card_hw_params(struct snd_pcm_substream *substream,
                    struct snd_pcm_hw_params *params)
@@ -127,8 +133,16 @@ static int zed_snd_card_hw_params(struct snd_pcm_substream *substream,
         return -EINVAL;
     }
     // Change clock settings
-    // TODO: Clean up
-    *(uint32_t*)(prv->addr_base + ZED_PL_SYNTH_NUM_UNITS * 4 / sizeof(uint32_t)) = (pll_rate == 96000 * I2S_CLOCK_RATIO) ? 1 : 0;
+    ret = pm_runtime_get_sync(prv->dev);
+    if (ret < 0) {
+        pm_runtime_put_noidle(prv->dev);
+        return ret;
+    }
+    mutex_lock(&prv->access_mutex);
+    zed_pl_synth_set_clk_sel(prv, pll_rate == 96000 * I2S_CLOCK_RATIO);
+    mutex_unlock(&prv->access_mutex);
+    pm_runtime_mark_last_busy(prv->dev);
+    pm_runtime_put_autosuspend(prv->dev);
 
     ret = snd_soc_dai_set_pll(codec_dai, ADAU17X1_PLL,
             ADAU17X1_PLL_SRC_MCLK, clk_get_rate(prv->mclk), pll_rate);
@@ -173,16 +187,266 @@ static struct snd_soc_dai_link zed_snd_dai = {
         .ops = &zed_snd_card_ops,
 };
 
+// Power management
+// The synth block is kept active while a sequencer subscriber
+// or a UIO user exists, and restored from the shadow on resume
+static int __maybe_unused zed_snd_runtime_suspend(struct device *dev)
+{
+    struct zed_pl_card_data *prv = dev_get_drvdata(dev);
+
+    clk_disable_unprepare(prv->mclk);
+    return 0;
+}
+
+static int __maybe_unused zed_snd_runtime_resume(struct device *dev)
+{
+    struct zed_pl_card_data *prv = dev_get_drvdata(dev);
+    ktime_t start = ktime_get();
+    int ret;
+
+    ret = clk_prepare_enable(prv->mclk);
+    if (ret) {
+        dev_err(dev, "Failed to enable aud_mclk.\n");
+        return ret;
+    }
+
+    // Unit and common registers may have been lost (FPGA power-gate)
+    zed_pl_synth_restore_regs(prv);
+
+    prv->resume_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    dev_dbg(dev, "Register state restored in %lld ns\n", prv->resume_ns);
+    return 0;
+}
+
+static int __maybe_unused zed_snd_suspend(struct device *dev)
+{
+    struct zed_pl_card_data *prv = dev_get_drvdata(dev);
+
+    // Stop sounding notes, so that resume doesn't re-trigger them
+    mutex_lock(&prv->access_mutex);
+    zed_pl_synth_release(prv);
+    mutex_unlock(&prv->access_mutex);
+
+    return pm_runtime_force_suspend(dev);
+}
+
+static int __maybe_unused zed_snd_resume(struct device *dev)
+{
+    return pm_runtime_force_resume(dev);
+}
+
+static const struct dev_pm_ops zed_snd_pm_ops = {
+    SET_SYSTEM_SLEEP_PM_OPS(zed_snd_suspend, zed_snd_resume)
+    SET_RUNTIME_PM_OPS(zed_snd_runtime_suspend, zed_snd_runtime_resume, NULL)
+};
+
+// UIO users keep the synth block powered
+static int zed_snd_uio_open(struct uio_info *info, struct inode *inode)
+{
+    struct zed_pl_card_data *prv = info->priv;
+    int ret;
+
+    ret = pm_runtime_get_sync(prv->dev);
+    if (ret < 0) {
+        pm_runtime_put_noidle(prv->dev);
+        return ret;
+    }
+
+    // Runtime resume restores the shadow state if the block was off. No restore
+    // here: UIO units are not shadowed, and MIDI writes are under the part locks
+    return 0;
+}
+
+static int zed_snd_uio_release(struct uio_info *info, struct inode *inode)
+{
+    struct zed_pl_card_data *prv = info->priv;
+
+    pm_runtime_mark_last_busy(prv->dev);
+    pm_runtime_put_autosuspend(prv->dev);
+    return 0;
+}
+
+// Sysfs attributes
+static ssize_t resume_time_us_show(struct device *dev,
+                                   struct device_attribute *attr, char *buf)
+{
+    struct zed_pl_card_data *prv = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%lld\n", div_s64(prv->resume_ns, NSEC_PER_USEC));
+}
+static DEVICE_ATTR_RO(resume_time_us);
+
+static ssize_t midi_stats_show(struct device *dev,
+                               struct device_attribute *attr, char *buf)
+{
+    struct zed_pl_card_data *prv = dev_get_drvdata(dev);
+
+    return zed_pl_synth_show_worker_stats(prv, buf);
+}
+static DEVICE_ATTR_RO(midi_stats);
+
+static ssize_t overflow_stats_show(struct device *dev,
+                                   struct device_attribute *attr, char *buf)
+{
+    struct zed_pl_card_data *prv = dev_get_drvdata(dev);
+
+    return zed_pl_overflow_show_stats(prv, buf);
+}
+static DEVICE_ATTR_RO(overflow_stats);
+
+static ssize_t mod_stats_show(struct device *dev,
+                              struct device_attribute *attr, char *buf)
+{
+    struct zed_pl_card_data *prv = dev_get_drvdata(dev);
+
+    return zed_pl_synth_show_mod_stats(prv, buf);
+}
+static DEVICE_ATTR_RO(mod_stats);
+
+static ssize_t predict_stats_show(struct device *dev,
+                                  struct device_attribute *attr, char *buf)
+{
+    struct zed_pl_card_data *prv = dev_get_drvdata(dev);
+
+    return zed_pl_synth_show_predict_stats(prv, buf);
+}
+static DEVICE_ATTR_RO(predict_stats);
+
+static ssize_t limiter_show(struct device *dev,
+                            struct device_attribute *attr, char *buf)
+{
+    struct zed_pl_card_data *prv = dev_get_drvdata(dev);
+
+    return zed_pl_synth_show_limiter(prv, buf);
+}
+static DEVICE_ATTR_RO(limiter);
+
+// MIDI file player: state, or a command ("load <file>", "start", "stop", ...)
+static ssize_t player_show(struct device *dev,
+                           struct device_attribute *attr, char *buf)
+{
+    struct zed_pl_card_data *prv = dev_get_drvdata(dev);
+
+    return zed_pl_player_show(prv, buf);
+}
+
+static ssize_t player_store(struct device *dev,
+                            struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct zed_pl_card_data *prv = dev_get_drvdata(dev);
+    int ret;
+
+    ret = zed_pl_player_command(prv, buf);
+    return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(player);
+
+static ssize_t num_units_show(struct device *dev,
+                              struct device_attribute *attr, char *buf)
+{
+    struct zed_pl_card_data *prv = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%d\n", prv->num_units);
+}
+static DEVICE_ATTR_RO(num_units);
+
+// Units owned by UIO clients: "<first> <count>"
+static ssize_t uio_units_show(struct device *dev,
+                              struct device_attribute *attr, char *buf)
+{
+    struct zed_pl_card_data *prv = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%d %d\n", prv->uio_first, prv->uio_count);
+}
+
+static ssize_t uio_units_store(struct device *dev,
+                               struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct zed_pl_card_data *prv = dev_get_drvdata(dev);
+    int first;
+    int num;
+    int ret;
+    int i;
+
+    if (sscanf(buf, "%d %d", &first, &num) != 2) {
+        return -EINVAL;
+    }
+
+    // Kernel voices may sound on the units while a port is in use
+    mutex_lock(&prv->access_mutex);
+    for (i = 0; i < prv->num_ports; i++) {
+        if (prv->ports[i].users || prv->ports[i].player) {
+            mutex_unlock(&prv->access_mutex);
+            return -EBUSY;
+        }
+    }
+    ret = zed_pl_synth_set_uio_units(prv, first, num);
+    mutex_unlock(&prv->access_mutex);
+
+    return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(uio_units);
+
+static struct attribute *zed_snd_attrs[] = {
+    &dev_attr_num_units.attr,
+    &dev_attr_uio_units.attr,
+    &dev_attr_resume_time_us.attr,
+    &dev_attr_midi_stats.attr,
+    &dev_attr_overflow_stats.attr,
+    &dev_attr_mod_stats.attr,
+    &dev_attr_predict_stats.attr,
+    &dev_attr_limiter.attr,
+    &dev_attr_player.attr,
+    NULL,
+};
+
+static const struct attribute_group zed_snd_attr_group = {
+    .attrs = zed_snd_attrs,
+};
+
 // MIDI initialization
 
+// Number of synthesizer units in the bitstream (default: 32)
+static int zed_snd_parse_units(struct platform_device *pdev, struct zed_pl_card_data *prv)
+{
+    u32 units = ZED_PL_SYNTH_DEFAULT_UNITS;
+
+    of_property_read_u32(pdev->dev.of_node, "xlnx,num-units", &units);
+    if ((units == 0) || (units > ZED_PL_SYNTH_MAX_UNITS)) {
+        dev_err(&pdev->dev, "Invalid number of units (%u).\n", units);
+        return -EINVAL;
+    }
+    prv->num_units  = units;
+    prv->num_voices = units + ZED_PL_SYNTH_OVERFLOW_SLOTS;
+    return 0;
+}
+
+// Units owned by UIO clients ("xlnx,uio-units" = <first count>, default: none)
+static int zed_snd_parse_uio_units(struct platform_device *pdev, struct zed_pl_card_data *prv)
+{
+    u32 range[2];
+    int ret;
+
+    if (of_property_read_u32_array(pdev->dev.of_node, "xlnx,uio-units", range, 2)) {
+        return 0;
+    }
+    ret = zed_pl_synth_set_uio_units(prv, range[0], range[1]);
+    if (ret) {
+        dev_err(&pdev->dev, "Invalid UIO unit range (%u %u).\n", range[0], range[1]);
+    }
+    return ret;
+}
+
 // Register this device as both sound card, and UIO
 static int zed_snd_probe(struct platform_device *pdev)
 {
     size_t sz;
     char *buf;
     int ret;
+    int i;
+    int ch;
     struct snd_soc_dai_link *dai;
-    struct zed_pl_card_data *prv;
+    struct zed_pl_card_data *prv = NULL;
     struct resource*         res = platform_get_resource(pdev, IORESOURCE_MEM, 0);
 
     struct snd_soc_card *card;
@@ -199,7 +463,8 @@ static int zed_snd_probe(struct platform_device *pdev)
         return -ENOMEM;
 
     card->dev = &pdev->dev;
-    card->dai_link = devm_kzalloc(card->dev,
+    // Synth output, and the overflow voice capture (optional)
+    card->dai_link = devm_kcalloc(card->dev, 2,
                       sizeof(*dai),
                       GFP_KERNEL);
     if (!card->dai_link) {
@@ -220,6 +485,16 @@ static int zed_snd_probe(struct platform_device *pdev)
     // MUTEX
     mutex_init(&prv->access_mutex);
 
+    // Units and voice structures
+    ret = zed_snd_parse_units(pdev, prv);
+    if (ret) {
+        return ret;
+    }
+    ret = zed_pl_synth_alloc_voices(prv);
+    if (ret) {
+        return ret;
+    }
+
     card->num_links = 0;
 
     // Audio CODEC device node
@@ -270,6 +545,14 @@ static int zed_snd_probe(struct platform_device *pdev)
          prv->zed_pl_snd_dev_id);
     card->name = buf;
 
+    // Software overflow voices
+    ret = zed_pl_overflow_init(prv);
+    if (ret) {
+        ida_simple_remove(&zed_snd_card_dev,
+                  prv->zed_pl_snd_dev_id);
+        return ret;
+    }
+
     // Widgets and routes
     card->dapm_widgets     = zed_snd_widgets;
     card->num_dapm_widgets = ARRAY_SIZE(zed_snd_widgets);
@@ -304,6 +587,13 @@ static int zed_snd_probe(struct platform_device *pdev)
         prv->addr_base = (void __iomem*)ioremap(res->start, prv->size);
     }
 
+    // Register window has to cover all units and the free bitmap
+    if (prv->size < ZED_PL_REG_WINDOW_SIZE(prv->num_units)) {
+        dev_err(&pdev->dev, "Register window too small for %d units.\n", prv->num_units);
+        ret = -EINVAL;
+        goto unreg_class;
+    }
+
     // UIO info
 	prv->info = kzalloc(sizeof(struct uio_info), GFP_KERNEL);
 	if (!prv->info) {
@@ -321,6 +611,15 @@ static int zed_snd_probe(struct platform_device *pdev)
 	prv->info->irq       = UIO_IRQ_NONE;
 	prv->info->irq_flags = 0;
 	prv->info->handler   = NULL;
+	prv->info->open      = zed_snd_uio_open;
+	prv->info->release   = zed_snd_uio_release;
+	prv->info->priv      = prv;
+
+    // Runtime PM (device stays suspended until the first user)
+    dev_set_drvdata(card->dev, prv);
+    pm_runtime_set_autosuspend_delay(&pdev->dev, ZED_PL_AUTOSUSPEND_MS);
+    pm_runtime_use_autosuspend(&pdev->dev);
+    pm_runtime_enable(&pdev->dev);
 
     // Register device as UIO device
 	if (uio_register_device(&pdev->dev, prv->info)) {
@@ -329,78 +628,130 @@ static int zed_snd_probe(struct platform_device *pdev)
         goto unreg_class;
     }
 
+    zed_pl_journal_init(prv);
+
     // MIDI setup
-    // Channel allocation
-	prv->chset = snd_midi_channel_alloc_set(ZED_PL_SYNTH_MIDI_CH);
-    if (!prv->chset) {
-        dev_err(&pdev->dev, "Failed to allocate midi channel.\n");
-        ret = -EINVAL;
+    zed_pl_synth_init_channels();
+    zed_pl_synth_init_voice_table(prv);
+    ret = zed_snd_parse_uio_units(pdev, prv);
+    if (ret) {
         goto unreg_class;
     }
-    prv->chset->private_data = prv;
+    zed_pl_synth_init_limiter(prv);
+    zed_pl_synth_init_params(prv);
+    zed_pl_synth_init_mod(prv);
+    zed_pl_synth_init_workers(prv);
 
     // Kernel sequencer client
     prv->seq_client = snd_seq_create_kernel_client(prv->card->snd_card, prv->zed_pl_snd_dev_id, "Zedbaord PL synth");
     if (prv->seq_client < 0) {
         dev_err(&pdev->dev, "Failed to create sequencer client.\n");
-        goto unreg_class;
+        ret = prv->seq_client;
+        goto release_midi;
     }
 
-    // Registration of sequencer callback operations
-	memset(&callbacks, 0, sizeof(callbacks));
-	callbacks.owner        = THIS_MODULE;
-	callbacks.use          = zed_pl_synth_use;
-	callbacks.unuse        = zed_pl_synth_unuse;
-	callbacks.event_input  = zed_pl_synth_event_input;
-	callbacks.private_free = zed_pl_synth_free_port;
-	callbacks.private_data = prv;
-
-    // Create port
-    prv->chset->client = prv->seq_client;
-	prv->chset->port   = snd_seq_event_port_attach(prv->seq_client, &callbacks,
-						      SNDRV_SEQ_PORT_CAP_WRITE |
-						      SNDRV_SEQ_PORT_CAP_SUBS_WRITE,
-						      SNDRV_SEQ_PORT_TYPE_MIDI_GENERIC |
-						      SNDRV_SEQ_PORT_TYPE_MIDI_GM |
-						      SNDRV_SEQ_PORT_TYPE_DIRECT_SAMPLE |
-						      SNDRV_SEQ_PORT_TYPE_HARDWARE |
-						      SNDRV_SEQ_PORT_TYPE_SYNTHESIZER,
-						      ZED_PL_SYNTH_MIDI_CH,
-                              ZED_PL_SYNTH_NUM_UNITS,
-						      "Zedboard PL synth port");
-
-    if (prv->chset->port < 0) {
-        dev_err(&pdev->dev, "Failed to attach sequencer port.");
-        goto unreg_class;
+    // One port per 16 parts, all of them share the voice allocator
+    prv->num_ports = clamp_t(int, midi_ports, 1, ZED_PL_MAX_PORTS);
+    for (i = 0; i < prv->num_ports; i++) {
+        struct zed_pl_port *port = &prv->ports[i];
+        char name[64];
+
+        port->prv       = prv;
+        port->index     = i;
+        port->part_base = i * ZED_PL_SYNTH_MIDI_CH;
+        memset(port->last_client, -1, sizeof(port->last_client));
+        for (ch = 0; ch < ZED_PL_SYNTH_MIDI_CH; ch++) {
+            spin_lock_init(&port->emul_lock[ch]);
+        }
+
+        // Channel allocation
+        port->chset = snd_midi_channel_alloc_set(ZED_PL_SYNTH_MIDI_CH);
+        if (!port->chset) {
+            dev_err(&pdev->dev, "Failed to allocate midi channel.\n");
+            ret = -EINVAL;
+            goto release_midi;
+        }
+        port->chset->private_data = port;
+
+        // Registration of sequencer callback operations
+        memset(&callbacks, 0, sizeof(callbacks));
+        callbacks.owner        = THIS_MODULE;
+        callbacks.use          = zed_pl_synth_use;
+        callbacks.unuse        = zed_pl_synth_unuse;
+        callbacks.event_input  = zed_pl_synth_event_input;
+        callbacks.private_free = zed_pl_synth_free_port;
+        callbacks.private_data = port;
+
+        // Create port
+        if (prv->num_ports > 1) {
+            snprintf(name, sizeof(name), "Zedboard PL synth port %d", i);
+        } else {
+            strlcpy(name, "Zedboard PL synth port", sizeof(name));
+        }
+        port->chset->client = prv->seq_client;
+        port->chset->port   = snd_seq_event_port_attach(prv->seq_client, &callbacks,
+                                  SNDRV_SEQ_PORT_CAP_WRITE |
+                                  SNDRV_SEQ_PORT_CAP_SUBS_WRITE,
+                                  SNDRV_SEQ_PORT_TYPE_MIDI_GENERIC |
+                                  SNDRV_SEQ_PORT_TYPE_MIDI_GM |
+                                  SNDRV_SEQ_PORT_TYPE_DIRECT_SAMPLE |
+                                  SNDRV_SEQ_PORT_TYPE_HARDWARE |
+                                  SNDRV_SEQ_PORT_TYPE_SYNTHESIZER,
+                                  ZED_PL_SYNTH_MIDI_CH,
+                                  prv->num_voices,
+                                  name);
+
+        if (port->chset->port < 0) {
+            dev_err(&pdev->dev, "Failed to attach sequencer port %d.", i);
+            ret = port->chset->port;
+            // Not attached, so free_port won't free it
+            snd_midi_channel_free_set(port->chset);
+            port->chset = NULL;
+            goto release_midi;
+        }
     }
 
-    if (zed_pl_synth_init_alloc_pool(prv) < 0) {
-        dev_err(&pdev->dev, "Failed to allocate note tracker pool.");
-        goto unreg_class;
+    ret = zed_pl_player_init(prv);
+    if (ret) {
+        dev_err(&pdev->dev, "Failed to initialize MIDI file player.");
+        goto release_midi;
     }
 
-    dev_info(&pdev->dev, "Zedboard PL synthesizer midi module registered");
+    ret = zed_pl_synth_add_controls(prv);
+    if (ret) {
+        dev_err(&pdev->dev, "Failed to add synthesizer controls.");
+        goto release_midi;
+    }
 
-    dev_set_drvdata(card->dev, prv);
+    ret = devm_device_add_group(&pdev->dev, &zed_snd_attr_group);
+    if (ret) {
+        dev_err(&pdev->dev, "Failed to create sysfs attributes.");
+        goto release_midi;
+    }
+
+    dev_info(&pdev->dev, "Zedboard PL synthesizer midi module registered");
 
     return 0;
 
+release_midi:
+    // No more events once the client is gone, then stop what they may have armed
+    zed_pl_player_release(prv);
+    if (prv->seq_client > 0) {
+        snd_seq_delete_kernel_client(prv->seq_client);
+    }
+    zed_pl_synth_release_workers(prv);
+    zed_pl_synth_release_params(prv);
+    zed_pl_synth_release_mod(prv);
+    zed_pl_synth_release_limiter(prv);
+    zed_pl_synth_release(prv);
 unreg_class:
-    if (card) {
-        kfree(card->dai_link);
-        kfree(card->name);
-        kfree(card);
+    if (pm_runtime_enabled(&pdev->dev)) {
+        pm_runtime_dont_use_autosuspend(&pdev->dev);
+        pm_runtime_disable(&pdev->dev);
     }
+    // Card and prv are device managed, channel sets are freed with their ports
     if (prv) {
-        zed_pl_synth_release_alloc_pool(prv);
         kfree(prv->info);
-        kfree(prv);
-        if (prv->chset) {
-            snd_midi_channel_free_set(prv->chset);
-        }
-    }
-    if (prv->seq_client) {
-        snd_seq_delete_kernel_client(prv->seq_client);
     }
     return ret;
 }
@@ -411,25 +762,32 @@ static int zed_snd_remove(struct platform_device *pdev)
 
     ida_simple_remove(&zed_snd_card_dev, prv->zed_pl_snd_dev_id);
 
+    zed_pl_player_release(prv);
+
+    // No more events once the client is gone (its ports free the channel sets),
+    // so nothing re-arms the timers and work items cancelled below
+    if (prv->seq_client > 0) {
+        snd_seq_delete_kernel_client(prv->seq_client);
+    }
+
+    pm_runtime_dont_use_autosuspend(&pdev->dev);
+    pm_runtime_disable(&pdev->dev);
+
+    zed_pl_synth_release_workers(prv);
+    zed_pl_synth_release_params(prv);
+    zed_pl_synth_release_mod(prv);
+    zed_pl_synth_release_limiter(prv);
+    zed_pl_synth_release_tunings();
+    zed_pl_overflow_release(prv);
+    zed_pl_synth_release(prv);
+    zed_pl_journal_release(prv);
+
     // Unregister UIO device
 	uio_unregister_device(prv->info);
 	iounmap(prv->addr_base);
 
-    // Free up MIDI resources
+    // Card and prv are device managed, channel sets were freed with their ports
     kfree(prv->info);
-    kfree(prv);
-    zed_pl_synth_release_alloc_pool(prv);
-    if (prv->chset) {
-        snd_midi_channel_free_set(prv->chset);
-    }
-    if (prv->seq_client) {
-        snd_seq_delete_kernel_client(prv->seq_client);
-    }
-
-    // Release sound card device data
-    kfree(prv->card->dai_link);
-    kfree(prv->card->name);
-    kfree(prv->card);
     return 0;
 }
 
@@ -445,6 +803,7 @@ static struct platform_driver zed_snd_driver = {
         .name           = "zed_synth",
         .of_match_table = zed_synth_of_ids,
         .owner          = THIS_MODULE,
+        .pm             = &zed_snd_pm_ops,
     },
     .probe          = zed_snd_probe,
     .remove         = zed_snd_remove,
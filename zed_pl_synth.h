@@ -18,21 +18,232 @@
 
 #include <linux/mutex.h>
 #include <linux/types.h>
+#include <linux/ktime.h>
+#include <linux/atomic.h>
+#include <linux/bitmap.h>
+#include <linux/hrtimer.h>
+#include <linux/kfifo.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
 #include <sound/soc.h>
 #include <sound/asequencer.h>
 #include <sound/seq_midi_emul.h>
+#include "zed_pl_model.h"
 
 #define I2S_CLOCK_RATIO 1024
 #define ZED_MAX_PL_SND_DEV 5
-#define ZED_PL_SYNTH_NUM_UNITS 32
 #define ZED_PL_SYNTH_MIDI_CH 16
 
-// Linked list is for dynamic unit allocation
-struct note_alloc_tracker {
-    int8_t note;
-    int8_t vel;
-    int8_t unit_no;
-    struct list_head list;
+// Number of synthesizer units ("xlnx,num-units" in the device tree)
+// Structures depending on it are allocated at probe
+#define ZED_PL_SYNTH_DEFAULT_UNITS 32
+#define ZED_PL_SYNTH_MAX_UNITS     256
+
+// Sequencer ports, each with its own set of MIDI channels
+// Channels of all ports ("parts") share one voice allocator
+#define ZED_PL_MAX_PORTS 4
+#define ZED_PL_SYNTH_NUM_PARTS (ZED_PL_SYNTH_MIDI_CH * ZED_PL_MAX_PORTS)
+
+// Software overflow voices (rendered on the CPU when all units are busy)
+// Voice numbers past the units are overflow voices
+#define ZED_PL_OVERFLOW_VOICES 32
+#if IS_ENABLED(CONFIG_SND_SOC_ZED_SND_OVERFLOW)
+#define ZED_PL_SYNTH_OVERFLOW_SLOTS ZED_PL_OVERFLOW_VOICES
+#else
+#define ZED_PL_SYNTH_OVERFLOW_SLOTS 0
+#endif
+
+// Optional per-CPU MIDI workers (channels are sharded across them)
+#define ZED_PL_MAX_WORKERS  4
+#define ZED_PL_WORKER_FIFO  256
+
+// Scene switch controller (CC 102, undefined in GM)
+// It rewrites every channel of the port, so the workers order it like sysex
+#define ZED_PL_CC_SCENE 0x66
+
+// Modulation engine: LFO vibrato/tremolo update rate
+#define ZED_PL_MOD_RATE_HZ 200
+
+// Runtime PM: idle delay after the last subscriber/UIO user goes away
+#define ZED_PL_AUTOSUSPEND_MS 2000
+
+// Register map
+// Register map per synthesizer unit
+struct zed_pl_unit_reg {
+    union {
+        uint32_t freq_reg_all;
+        struct {
+            uint32_t freq : 16;
+            uint32_t rsvd : 16;
+        } bit;
+    } freq_reg;
+    union {
+        uint32_t ctl_reg_all;
+        struct {
+            uint32_t wave_type : 2;
+            uint32_t trigger   : 1;
+            uint32_t rsvd      : 29;
+        } bit;
+    } ctl_reg;
+    union {
+        uint32_t vca_eg_reg_all;
+        struct {
+            uint32_t vca_attack  : 8;
+            uint32_t vca_decay   : 8;
+            uint32_t vca_sustain : 8;
+            uint32_t vca_release : 8;
+        } bit;
+    } vca_eg_reg;
+    union {
+        uint32_t amp_reg_all;
+        struct {
+            uint32_t amp_l : 16;
+            uint32_t amp_r : 16;
+        } bit;
+    } amp_reg;
+};
+
+// Packed register fields, for building whole words
+#define ZED_PL_CTL_TRIGGER      BIT(2)
+#define ZED_PL_AMP_WORD(l, r)   (((uint32_t)(r) << 16) | ((uint32_t)(l) & 0xFFFF))
+
+struct zed_pl_common_reg {
+    union {
+        uint32_t audio_ctl_all;
+        struct {
+            uint32_t aud_clk_sel : 1;
+            uint32_t rsvd        : 31;
+        } bit;
+    } audio_ctl_reg;
+    uint32_t unit_free_reg;     // First word of the free bitmap (one bit per unit)
+};
+
+// Word index inside a unit
+enum zed_pl_unit_word {
+    ZED_PL_REG_FREQ   = 0,
+    ZED_PL_REG_CTL    = 1,
+    ZED_PL_REG_VCA_EG = 2,
+    ZED_PL_REG_AMP    = 3,
+};
+
+// Word offsets in the register window of n units
+// Units come first, then audio_ctl and the free bitmap (32 units per word)
+#define ZED_PL_UNIT_REG_WORDS      (sizeof(struct zed_pl_unit_reg) / sizeof(uint32_t))
+#define ZED_PL_UNIT_FREE_WORDS(n)  DIV_ROUND_UP(n, 32)
+#define ZED_PL_COMMON_REG_OFF(n)   ((n) * ZED_PL_UNIT_REG_WORDS)
+#define ZED_PL_AUDIO_CTL_OFF(n)    (ZED_PL_COMMON_REG_OFF(n) + 0)
+#define ZED_PL_UNIT_FREE_OFF(n)    (ZED_PL_COMMON_REG_OFF(n) + 1)
+#define ZED_PL_REG_WINDOW_SIZE(n)  ((ZED_PL_UNIT_FREE_OFF(n) + ZED_PL_UNIT_FREE_WORDS(n)) * sizeof(uint32_t))
+
+// Voice table
+// Voices are indexed by unit number (or overflow voice number). Per-channel voice lists are
+// linked through next/prev indices, so allocation needs no heap memory after probe
+typedef uint16_t zed_pl_vidx_t;
+#define ZED_PL_VOICE_NONE ((zed_pl_vidx_t)0xFFFF)
+
+enum zed_pl_voice_state {
+    ZED_PL_VOICE_FREE  = 0,
+    ZED_PL_VOICE_ON    = 1,
+    ZED_PL_VOICE_STACK = 2,     // Extra unit of a unison stack
+};
+
+// Struct-of-arrays, so that a scan touches only the field it needs
+// (num_voices entries each, allocated at probe)
+struct zed_pl_voice_table {
+    int8_t        *note;
+    int8_t        *vel;
+    uint8_t       *channel;
+    uint8_t       *state;
+    zed_pl_vidx_t *next;
+    zed_pl_vidx_t *prev;
+    uint32_t      *age;
+    uint32_t      *level;   // amp word before the limiter (0 when not sounding)
+    int8_t        *spread;  // Position in the unison stack, -64..64 (0: center or alone)
+};
+
+// Predicted unit release
+// A released unit is expected free after its release time (2 ms per step of
+// vca_release, plus a margin). The hardware free bitmap is only read every
+// busy_verify allocations, or when no unit is predicted free.
+#define ZED_PL_PREDICT_MARGIN_MS 5
+
+struct zed_pl_predict {
+    unsigned long   *busy;      // Released units still in their release phase
+    uint32_t        *free_at;   // Predicted end of release (ns >> 10, wraps)
+    atomic_t         allocs;
+    atomic_t         hw_reads;
+    atomic_t         hits;
+    atomic_t         misses;
+};
+
+// Output headroom limiter
+// Running sums of amp_l/amp_r over sounding voices, updated by the difference
+// whenever a voice level changes. When the output would exceed the headroom,
+// all voices are scaled by one gain in a single pass (and given back when it falls again).
+struct zed_pl_limiter {
+    atomic_t            sum_l;      // Before the limiter gain
+    atomic_t            sum_r;
+    int                 gain;       // Q10, 1024: no reduction
+    int                 peak;       // Highest output sum
+    u64                 passes;
+    struct work_struct  work;
+};
+
+// Per-CPU MIDI worker
+// Channel events are queued here and processed on a fixed CPU,
+// so that events of one channel keep their order
+struct zed_pl_port;
+
+struct zed_pl_midi_event {
+    struct snd_seq_event         ev;
+    struct zed_pl_port          *port;
+};
+
+struct zed_pl_midi_worker {
+    struct work_struct           work;
+    spinlock_t                   lock;
+    DECLARE_KFIFO(fifo, struct zed_pl_midi_event, ZED_PL_WORKER_FIFO);
+    struct zed_pl_card_data     *prv;
+    int                          cpu;
+
+    // Statistics
+    u64                          events;
+    u64                          busy_ns;
+    atomic64_t                   dropped;   // Counted by the senders
+} ____cacheline_aligned_in_smp;
+
+// Per-channel voice quota, reservation and priority
+#define ZED_PL_PRIORITY_DEFAULT 64
+#define ZED_PL_PRIORITY_MAX     127
+
+struct zed_pl_voice_policy {
+    uint16_t max_voices[ZED_PL_SYNTH_NUM_PARTS];
+    uint16_t reserved[ZED_PL_SYNTH_NUM_PARTS];
+    uint16_t priority[ZED_PL_SYNTH_NUM_PARTS];
+    atomic_t active[ZED_PL_SYNTH_NUM_PARTS];
+
+    // Statistics
+    atomic_t steals;
+    atomic_t dropped;
+    atomic_t stacked;   // Extra units of unison stacks sounding now
+    atomic_t degraded;  // Stacks that got fewer units than the program asks for
+};
+
+// Sequencer port (chset->private_data)
+struct zed_pl_port {
+    struct zed_pl_card_data     *prv;
+    struct snd_midi_channel_set *chset;
+    int                          index;
+    int                          part_base;  // Part of MIDI channel 0
+    int                          users;      // Subscribers (events of all of them are merged)
+    int                          last_client[ZED_PL_SYNTH_MIDI_CH];  // Last sender per channel (-1: none)
+    spinlock_t                   emul_lock[ZED_PL_SYNTH_MIDI_CH];    // Emulation state per channel
+    bool                         player;     // Owned by the MIDI file player
+
+    // MPE zones: number of member channels (0: zone off)
+    // Lower zone: manager channel 1, members 2..; upper zone: manager 16, members 15..
+    int                          mpe_lower;
+    int                          mpe_upper;
 };
 
 struct zed_pl_card_data {
@@ -47,11 +258,69 @@ struct zed_pl_card_data {
     // MIDI related data
     //struct snd_card *midi_card; (card->snd_card)
 	struct snd_seq_device *seq_dev;
-	struct snd_midi_channel_set *chset;
 	struct mutex access_mutex;
     int seq_client;
-    int busy;
-    struct note_alloc_tracker alloc_pool;
+    struct zed_pl_port ports[ZED_PL_MAX_PORTS];
+    int num_ports;
+
+    // Units of the PL block, and voices (units + overflow voices)
+    int              num_units;
+    int              num_voices;
+
+    // Voices (entries are owned by the channel holding the unit)
+    struct zed_pl_voice_table voices;
+
+    // Units claimed by the driver (lock-free, shared by all channels)
+    unsigned long   *voice_busy;
+
+    // Units owned by UIO clients, never handed out by the allocator
+    unsigned long   *uio_units;
+    int              uio_first;
+    int              uio_count;
+    atomic_t         alloc_cursor;
+    atomic_t         voice_age;
+    struct zed_pl_voice_policy policy;
+    struct zed_pl_predict      predict;
+    struct zed_pl_limiter      limiter;
+
+    // Channels whose parameter edits still have to reach sounding voices
+    DECLARE_BITMAP(params_dirty, ZED_PL_SYNTH_NUM_PARTS);
+    struct work_struct params_work;
+
+    // Modulation engine (runs only while a channel is modulated)
+    DECLARE_BITMAP(mod_active, ZED_PL_SYNTH_NUM_PARTS);
+    unsigned long      mod_running;
+    struct hrtimer     mod_timer;
+    struct work_struct mod_work;
+    u64                mod_ticks;
+    u64                mod_voices;
+    u64                mod_writes;
+
+    // MIDI workers (num_workers == 0: process in the sequencer context)
+    struct zed_pl_midi_worker workers[ZED_PL_MAX_WORKERS];
+    int              num_workers;
+    atomic64_t       inline_events;
+
+    // Non-channel events delivered in atomic context, run after the channel
+    // workers; while any is pending, channel events queue behind it
+    struct zed_pl_midi_worker ordered;
+    atomic_t         ordered_pending;
+
+    // Register shadow, written together with the hardware
+    // and restored in one burst on resume (overflow voices at the end)
+    struct zed_pl_unit_reg  *shadow_unit;
+    struct zed_pl_common_reg shadow_common;
+    s64                      resume_ns;
+
+    // Software overflow voices (optional)
+    struct zed_pl_overflow *overflow;
+
+    // MIDI file player (optional)
+    struct zed_pl_player   *player;
+
+    // Register write journal (optional)
+    struct rchan*    journal;
+    struct dentry*   debugfs;
 
     // UIO data
     void __iomem*    addr_base;
@@ -64,19 +333,136 @@ int zed_pl_synth_use(void *private_data, struct snd_seq_port_subscribe *info);
 int zed_pl_synth_unuse(void *private_data, struct snd_seq_port_subscribe *info);
 void zed_pl_synth_free_port(void *private_data);
 int zed_pl_synth_event_input(struct snd_seq_event *ev, int direct, void *private_data, int atomic, int hop);
+void zed_pl_synth_init_workers(struct zed_pl_card_data *prv);
+void zed_pl_synth_flush_workers(struct zed_pl_card_data *prv);
+void zed_pl_synth_release_workers(struct zed_pl_card_data *prv);
+ssize_t zed_pl_synth_show_worker_stats(struct zed_pl_card_data *prv, char *buf);
 
 // Midi emulator
 void zed_pl_synth_program_change(struct zed_pl_card_data *prv, int ch, int pgm_num);
+void zed_pl_synth_program(struct zed_pl_port *port, struct snd_midi_channel *chan);
 void zed_pl_synth_note_on(void *p, int note, int vel, struct snd_midi_channel *chan);
 void zed_pl_synth_note_off(void *p, int note, int vel, struct snd_midi_channel *chan);
 void zed_pl_synth_key_press(void *p, int note, int vel, struct snd_midi_channel *chan);
 void zed_pl_synth_terminate_note(void *p, int note, struct snd_midi_channel *chan);
 void zed_pl_synth_control(void *p, int type, struct snd_midi_channel *chan);
 void zed_pl_synth_nrpn(void *p, struct snd_midi_channel *chan, struct snd_midi_channel_set *chset);
+void zed_pl_synth_rpn(struct zed_pl_port *port, struct snd_midi_channel *chan);
+bool zed_pl_synth_is_burst(const unsigned char *buf, int len);
+int  zed_pl_synth_sysex_burst(struct zed_pl_port *port, const unsigned char *buf, int len);
+int  zed_pl_synth_scene_recall(struct zed_pl_port *port, int scene, bool cut);
+bool zed_pl_synth_is_mts(const unsigned char *buf, int len);
+int  zed_pl_synth_mts(struct zed_pl_port *port, const unsigned char *buf, int len);
+void zed_pl_synth_release_tunings(void);
 void zed_pl_synth_sysex(void *p, unsigned char *buf, int len, int parsed, struct snd_midi_channel_set *chset);
 
+// Register access (hardware + shadow)
+void zed_pl_synth_write_unit(struct zed_pl_card_data *prv, int unit_no, const struct zed_pl_unit_reg *reg);
+void zed_pl_synth_write_reg(struct zed_pl_card_data *prv, int unit_no, enum zed_pl_unit_word word, uint32_t val);
+void zed_pl_synth_write_amp(struct zed_pl_card_data *prv, int unit_no, uint32_t amp);
+void zed_pl_synth_set_clk_sel(struct zed_pl_card_data *prv, int sel);
+void zed_pl_synth_read_busy(struct zed_pl_card_data *prv, unsigned long *busy);
+void zed_pl_synth_restore_regs(struct zed_pl_card_data *prv);
+
+// Units available to the kernel allocator
+static inline int zed_pl_synth_kernel_units(struct zed_pl_card_data *prv)
+{
+    return prv->num_units - prv->uio_count;
+}
+
 // Initialization and release
-int zed_pl_synth_init_alloc_pool(struct zed_pl_card_data *prv);
-void zed_pl_synth_release_alloc_pool(struct zed_pl_card_data *prv);
-void zed_pl_synth_midi_init(void);
+int  zed_pl_synth_alloc_voices(struct zed_pl_card_data *prv);
+int  zed_pl_synth_set_uio_units(struct zed_pl_card_data *prv, int first, int count);
+void zed_pl_synth_init_voice_table(struct zed_pl_card_data *prv);
+void zed_pl_synth_init_policy(struct zed_pl_card_data *prv);
+void zed_pl_synth_init_params(struct zed_pl_card_data *prv);
+void zed_pl_synth_release_params(struct zed_pl_card_data *prv);
+void zed_pl_synth_init_mod(struct zed_pl_card_data *prv);
+void zed_pl_synth_release_mod(struct zed_pl_card_data *prv);
+void zed_pl_synth_init_limiter(struct zed_pl_card_data *prv);
+void zed_pl_synth_release_limiter(struct zed_pl_card_data *prv);
+ssize_t zed_pl_synth_show_mod_stats(struct zed_pl_card_data *prv, char *buf);
+ssize_t zed_pl_synth_show_predict_stats(struct zed_pl_card_data *prv, char *buf);
+ssize_t zed_pl_synth_show_limiter(struct zed_pl_card_data *prv, char *buf);
+
+// Channel initialization and voice release
+void zed_pl_synth_init_channels(void);
+void zed_pl_synth_midi_init(struct zed_pl_port *port);
 void zed_pl_synth_release(struct zed_pl_card_data *prv);
+void zed_pl_synth_release_port(struct zed_pl_port *port);
+void zed_pl_synth_release_client(struct zed_pl_port *port, int client);
+
+// Software overflow voices
+#if IS_ENABLED(CONFIG_SND_SOC_ZED_SND_OVERFLOW)
+int  zed_pl_overflow_init(struct zed_pl_card_data *prv);
+void zed_pl_overflow_release(struct zed_pl_card_data *prv);
+int  zed_pl_overflow_alloc(struct zed_pl_card_data *prv);
+void zed_pl_overflow_write(struct zed_pl_card_data *prv, int voice, enum zed_pl_unit_word word, uint32_t val);
+void zed_pl_overflow_write_unit(struct zed_pl_card_data *prv, int voice, const struct zed_pl_unit_reg *reg);
+ssize_t zed_pl_overflow_show_stats(struct zed_pl_card_data *prv, char *buf);
+#else
+static inline int  zed_pl_overflow_init(struct zed_pl_card_data *prv) { return 0; }
+static inline void zed_pl_overflow_release(struct zed_pl_card_data *prv) { }
+static inline int  zed_pl_overflow_alloc(struct zed_pl_card_data *prv) { return -1; }
+static inline void zed_pl_overflow_write(struct zed_pl_card_data *prv, int voice, enum zed_pl_unit_word word, uint32_t val) { }
+static inline void zed_pl_overflow_write_unit(struct zed_pl_card_data *prv, int voice, const struct zed_pl_unit_reg *reg) { }
+static inline ssize_t zed_pl_overflow_show_stats(struct zed_pl_card_data *prv, char *buf)
+{
+    return sprintf(buf, "disabled\n");
+}
+#endif
+
+// Standard MIDI File parser (MIDI file player and benchmark)
+// Channel message, time in us from the start of the file (at 100% tempo)
+struct zed_pl_smf_event {
+    uint32_t time_us;
+    uint8_t  status;
+    uint8_t  data[2];
+    uint8_t  pad;
+};
+
+struct zed_pl_smf {
+    struct zed_pl_smf_event *events;
+    int                      num_events;
+    uint32_t                 length_us;
+    uint16_t                 channels;   // Channels used by the file
+};
+
+int  zed_pl_smf_parse(struct zed_pl_smf *smf, const u8 *buf, size_t size);
+
+// MIDI file player
+#if IS_ENABLED(CONFIG_SND_SOC_ZED_SND_PLAYER)
+int  zed_pl_player_init(struct zed_pl_card_data *prv);
+void zed_pl_player_release(struct zed_pl_card_data *prv);
+int  zed_pl_player_command(struct zed_pl_card_data *prv, const char *buf);
+ssize_t zed_pl_player_show(struct zed_pl_card_data *prv, char *buf);
+#else
+static inline int  zed_pl_player_init(struct zed_pl_card_data *prv) { return 0; }
+static inline void zed_pl_player_release(struct zed_pl_card_data *prv) { }
+static inline int  zed_pl_player_command(struct zed_pl_card_data *prv, const char *buf) { return -ENODEV; }
+static inline ssize_t zed_pl_player_show(struct zed_pl_card_data *prv, char *buf)
+{
+    return sprintf(buf, "disabled\n");
+}
+#endif
+
+// Register write journal
+#if IS_ENABLED(CONFIG_SND_SOC_ZED_SND_JOURNAL)
+void zed_pl_journal_init(struct zed_pl_card_data *prv);
+void zed_pl_journal_release(struct zed_pl_card_data *prv);
+void __zed_pl_journal_record(struct zed_pl_card_data *prv, int word_off, uint32_t val);
+
+static inline void zed_pl_journal_record(struct zed_pl_card_data *prv, int word_off, uint32_t val)
+{
+    if (unlikely(prv->journal)) {
+        __zed_pl_journal_record(prv, word_off, val);
+    }
+}
+#else
+static inline void zed_pl_journal_init(struct zed_pl_card_data *prv) { }
+static inline void zed_pl_journal_release(struct zed_pl_card_data *prv) { }
+static inline void zed_pl_journal_record(struct zed_pl_card_data *prv, int word_off, uint32_t val) { }
+#endif
+
+// ALSA controls
+int zed_pl_synth_add_controls(struct zed_pl_card_data *prv);